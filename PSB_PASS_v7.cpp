@@ -35,6 +35,15 @@
 /* *******Implementation Starts Here******* */
 #include <bits/stdc++.h>
 #include "llvm/IR/Dominators.h"
+#include "llvm/ADT/SetVector.h"
+#include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/Analysis/Loads.h"
+#include "llvm/Analysis/MemoryLocation.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/Transforms/Utils/Local.h"
+#include "llvm/Transforms/Utils/SSAUpdater.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/PassPlugin.h"
 /* *******Implementation Ends Here******* */
 
 using namespace llvm;
@@ -47,6 +56,9 @@ namespace Correctness{
 struct PSBPass : public FunctionPass {
   static char ID;
   const static int THRESHOLD = 60;
+  // Analyses of the function being transformed, set by runImpl.
+  BranchProbabilityInfo *BPI = nullptr;
+  DominatorTree *DT = nullptr;
   PSBPass() : FunctionPass(ID) {}
 
   // Specify the vector of analysis passes that will be used inside your pass.
@@ -100,8 +112,8 @@ struct PSBPass : public FunctionPass {
 
 
   BasicBlock* best_successor(BasicBlock* CurBB, map<BasicBlock*, int> VisitMap) {
-    BranchProbabilityInfo &bpi = getAnalysis<BranchProbabilityInfoWrapperPass>().getBPI();
-    DominatorTree &dt = getAnalysis<DominatorTreeWrapperPass>().getDomTree(); 
+    BranchProbabilityInfo &bpi = *BPI;
+    DominatorTree &dt = *DT;
 
     // errs() << "********************\n Best Sucessor \n" << *CurBB; 
     // errs() << "\nThreshold" << BranchProbability(THRESHOLD, 100) << "\n ******************************"; 
@@ -128,8 +140,8 @@ struct PSBPass : public FunctionPass {
   
   BasicBlock* best_predecessor(BasicBlock* CurBB, map<BasicBlock*, int> VisitMap,
                                map<BasicBlock*, uint64_t> ProfileMap) {
-    BranchProbabilityInfo &bpi = getAnalysis<BranchProbabilityInfoWrapperPass>().getBPI();
-    DominatorTree &dt = getAnalysis<DominatorTreeWrapperPass>().getDomTree();
+    BranchProbabilityInfo &bpi = *BPI;
+    DominatorTree &dt = *DT;
     // errs() << "********************\n Best Predecessor \n" << *CurBB << "\n ******************************"; 
 
     for (BasicBlock *Pred : predecessors(CurBB)) {
@@ -161,6 +173,7 @@ struct PSBPass : public FunctionPass {
     // copied BB 
     map<BasicBlock*, BasicBlock*> copiedMap;
     ValueToValueMapTy VMap;
+    bool modified = false;
     bool doCopy = false; 
     BasicBlock* prevCopiedBB; 
     for (auto& curTrace: traces) {
@@ -172,6 +185,7 @@ struct PSBPass : public FunctionPass {
           for (auto pred : predecessors(originalBB)) {
             // if predecessor not in trace, side entrance 
             if (TraceMap[pred] != TraceMap[originalBB]) {
+              modified = true;
               doCopy = true; 
 
               // copy first original block  
@@ -232,21 +246,28 @@ struct PSBPass : public FunctionPass {
       }
     }
   
-    return false;
+    return modified;
   }
 
 
   bool runOnFunction(Function &F) override {
+    // Create objects for each analysis pass
+    BranchProbabilityInfo &bpi = getAnalysis<BranchProbabilityInfoWrapperPass>().getBPI(); 
+    BlockFrequencyInfo &bfi = getAnalysis<BlockFrequencyInfoWrapperPass>().getBFI();
+    DominatorTree &dt = getAnalysis<DominatorTreeWrapperPass>().getDomTree();    
+    return runImpl(F, bpi, bfi, dt);
+  }
+
+
+  // Shared by the legacy pass and PSBPassNPM.
+  bool runImpl(Function &F, BranchProbabilityInfo &bpi, BlockFrequencyInfo &bfi, DominatorTree &dt) {
     map<BasicBlock*, uint64_t> ProfileMap;
     map<BasicBlock*, int> VisitMap;
     map<BasicBlock*, int> TraceMap; 
     vector<vector<BasicBlock*>> traces;
     int traceCnt = 0;
-
-    // Create objects for each analysis pass
-    BranchProbabilityInfo &bpi = getAnalysis<BranchProbabilityInfoWrapperPass>().getBPI(); 
-    BlockFrequencyInfo &bfi = getAnalysis<BlockFrequencyInfoWrapperPass>().getBFI();
-    DominatorTree &dt = getAnalysis<DominatorTreeWrapperPass>().getDomTree();    
+    BPI = &bpi;
+    DT = &dt;
     
     // Mark all BBs unvisited
     for (Function::iterator it = F.begin(), e = F.end(); it != e; ++it) {
@@ -310,11 +331,9 @@ struct PSBPass : public FunctionPass {
     // After TRACE FORMATION,
     // TAIL DUPLICATION
     printTraces(traces);
-    tailDuplication(traces, TraceMap, &F);
+    return tailDuplication(traces, TraceMap, &F);
 
     //////////////    END    ////////////////
-    
-    return false;
   }
   
 }; // end of struct OperationStatistics
@@ -331,14 +350,181 @@ static RegisterPass<Correctness::PSBPass> X("psbpass", "Profile Super Block Pass
 namespace Performance{
 struct FPLICMPass : public LoopPass {
   static char ID;
+  // An edge taken with at least this probability (in %) extends the frequent path.
+  const static int FREQ_THRESHOLD = 80;
   FPLICMPass() : LoopPass(ID) {}
 
   bool runOnLoop(Loop *L, LPPassManager &LPM) override {
+    BranchProbabilityInfo &bpi = getAnalysis<BranchProbabilityInfoWrapperPass>().getBPI();
+    BlockFrequencyInfo &bfi = getAnalysis<BlockFrequencyInfoWrapperPass>().getBFI();
+    LoopInfo &LI = getAnalysis<LoopInfoWrapperPass>().getLoopInfo();
+    AAResults &AA = getAnalysis<AAResultsWrapperPass>().getAAResults();
+    return runImpl(L, bpi, bfi, LI, AA);
+  }
+
+
+  // A value the loop only changes off the frequent path: a hoisted load, or a
+  // computation over hoisted values. Its copy in the preheader and the copies
+  // re-materialised in the fix-up blocks are the available definitions; SSA
+  // hands out the version live at any other point of the loop.
+  struct AlmostInvariant {
+    SSAUpdater SSA;
+    Value *Hoisted = nullptr; // copy in the preheader
+    AlmostInvariant(SmallVectorImpl<PHINode*> *NewPHIs) : SSA(NewPHIs) {}
+  };
+
+
+  // Shared by the legacy pass and FPLICMPassNPM.
+  bool runImpl(Loop *L, BranchProbabilityInfo &bpi, BlockFrequencyInfo &bfi, LoopInfo &LI, AAResults &AA) {
     bool Changed = false;
 
     /* *******Implementation Starts Here******* */
-    
+    BasicBlock *preheader = L->getLoopPreheader();
+    if (!preheader) {
+      return false;
+    }
+    for (BasicBlock *BB : L->blocks()) {
+      if (BB->isEHPad()) {
+        return false;
+      }
+    }
+    Instruction *hoistPt = preheader->getTerminator();
+    const DataLayout &DL = preheader->getModule()->getDataLayout();
 
+    vector<BasicBlock*> path = frequentPath(L, LI, bpi, bfi);
+    SmallPtrSet<BasicBlock*, 16> onPath(path.begin(), path.end());
+
+    SmallVector<Instruction*, 16> writers;
+    for (BasicBlock *BB : L->blocks()) {
+      for (Instruction &I : *BB) {
+        if (I.mayWriteToMemory()) {
+          writers.push_back(&I);
+        }
+      }
+    }
+
+    SmallVector<PHINode*, 16> newPHIs;                // placed by the SSAUpdaters
+    deque<AlmostInvariant> values;                    // stable addresses
+    DenseMap<Value*, AlmostInvariant*> byPtr;         // hoisted load per address
+    DenseMap<Value*, AlmostInvariant*> versionOf;     // in-loop version -> value
+    SetVector<BasicBlock*> fixupBlocks;               // every block holding a fix-up
+
+    // 1) Loads on the frequent path whose address only infrequent blocks store to.
+    for (BasicBlock *BB : path) {
+      if (inSubLoop(BB, L, &LI)) {
+        continue;
+      }
+      uint64_t freq = bfi.getBlockFreq(BB).getFrequency();
+      for (Instruction &I : make_early_inc_range(*BB)) {
+        LoadInst *LD = dyn_cast<LoadInst>(&I);
+        if (!LD || !LD->isSimple() || !L->isLoopInvariant(LD->getPointerOperand())) {
+          continue;
+        }
+        Value *ptr = LD->getPointerOperand();
+        AlmostInvariant *AI = byPtr.lookup(ptr);
+        if (!AI) {
+          SetVector<BasicBlock*> storeBlocks;
+          if (!onlyStoredOffPath(LD, writers, onPath, AA, storeBlocks)) {
+            continue;
+          }
+          // Each fix-up costs about as much as the load it replaces.
+          uint64_t fixupFreq = 0;
+          for (BasicBlock *storeBB : storeBlocks) {
+            fixupFreq += bfi.getBlockFreq(storeBB).getFrequency();
+          }
+          if (fixupFreq >= freq ||
+              !isSafeToLoadUnconditionally(ptr, LD->getType(), LD->getAlign(), DL, hoistPt)) {
+            continue;
+          }
+
+          values.emplace_back(&newPHIs);
+          AI = &values.back();
+          AI->SSA.Initialize(LD->getType(), LD->getName());
+          AI->Hoisted = new LoadInst(LD->getType(), ptr, LD->getName() + ".fp", false, LD->getAlign(), hoistPt);
+          AI->SSA.AddAvailableValue(preheader, AI->Hoisted);
+          // The fix-up for a store is the stored value itself.
+          for (BasicBlock *storeBB : storeBlocks) {
+            AI->SSA.AddAvailableValue(storeBB, lastStoredValue(storeBB, ptr));
+            fixupBlocks.insert(storeBB);
+          }
+          byPtr[ptr] = AI;
+        }
+        Value *V = AI->SSA.GetValueInMiddleOfBlock(BB);
+        LD->replaceAllUsesWith(V);
+        LD->eraseFromParent();
+        versionOf[V] = AI;
+        Changed = true;
+      }
+    }
+
+    // 2) Computations over invariant and hoisted values. Plain invariant ones
+    //    just move; the rest are re-materialised in every fix-up block too.
+    uint64_t fixupFreq = 0;
+    for (BasicBlock *fixBB : fixupBlocks) {
+      fixupFreq += bfi.getBlockFreq(fixBB).getFrequency();
+    }
+    for (BasicBlock *BB : path) {
+      if (inSubLoop(BB, L, &LI)) {
+        continue;
+      }
+      for (Instruction &I : make_early_inc_range(*BB)) {
+        if (isa<PHINode>(I) || I.isTerminator() || I.mayReadOrWriteMemory() ||
+            !isSafeToSpeculativelyExecute(&I)) {
+          continue;
+        }
+        bool usesHoisted = false, hoistable = true;
+        for (Value *Op : I.operands()) {
+          if (L->isLoopInvariant(Op)) {
+            continue;
+          }
+          if (!versionOf.count(Op)) {
+            hoistable = false;
+            break;
+          }
+          usesHoisted = true;
+        }
+        if (!hoistable) {
+          continue;
+        }
+        if (!usesHoisted) {
+          I.moveBefore(hoistPt);
+          Changed = true;
+          continue;
+        }
+        if (fixupFreq >= bfi.getBlockFreq(BB).getFrequency()) {
+          continue;
+        }
+
+        values.emplace_back(&newPHIs);
+        AlmostInvariant *AI = &values.back();
+        AI->SSA.Initialize(I.getType(), I.getName());
+        AI->Hoisted = rematerialize(&I, hoistPt, [&](Value *Op) -> Value* {
+          AlmostInvariant *OpAI = versionOf.lookup(Op);
+          return OpAI ? OpAI->Hoisted : Op;
+        });
+        AI->SSA.AddAvailableValue(preheader, AI->Hoisted);
+        for (BasicBlock *fixBB : fixupBlocks) {
+          Value *fixup = rematerialize(&I, fixBB->getTerminator(), [&](Value *Op) -> Value* {
+            AlmostInvariant *OpAI = versionOf.lookup(Op);
+            return OpAI ? OpAI->SSA.GetValueAtEndOfBlock(fixBB) : Op;
+          });
+          AI->SSA.AddAvailableValue(fixBB, fixup);
+        }
+        Value *V = AI->SSA.GetValueInMiddleOfBlock(BB);
+        I.replaceAllUsesWith(V);
+        I.eraseFromParent();
+        versionOf[V] = AI;
+        Changed = true;
+      }
+    }
+
+    // Versions of values that were only needed to compute others are dead.
+    SmallVector<WeakTrackingVH, 16> deadCandidates(newPHIs.begin(), newPHIs.end());
+    for (WeakTrackingVH &VH : deadCandidates) {
+      if (PHINode *PN = dyn_cast_or_null<PHINode>(VH)) {
+        RecursivelyDeleteDeadPHINode(PN);
+      }
+    }
     /* *******Implementation Ends Here******* */
     
     return Changed;
@@ -349,6 +535,8 @@ struct FPLICMPass : public LoopPass {
     AU.addRequired<BranchProbabilityInfoWrapperPass>();
     AU.addRequired<BlockFrequencyInfoWrapperPass>();
     AU.addRequired<LoopInfoWrapperPass>();
+    AU.addRequired<AAResultsWrapperPass>();
+    AU.setPreservesCFG();
   }
 
 private:
@@ -359,6 +547,100 @@ private:
     return LI->getLoopFor(BB) != CurLoop;
   }
 
+
+  // Blocks on the frequent path: starting at the header, keep following the
+  // successor taken with at least FREQ_THRESHOLD% probability while it stays
+  // in the loop and has not been visited yet. A subloop the path runs into is
+  // taken whole and left through its hottest exit.
+  vector<BasicBlock*> frequentPath(Loop *L, LoopInfo &LI, BranchProbabilityInfo &bpi, BlockFrequencyInfo &bfi) {
+    vector<BasicBlock*> path;
+    SmallPtrSet<BasicBlock*, 16> visited;
+    BasicBlock *BB = L->getHeader();
+    while (BB && L->contains(BB) && visited.insert(BB).second) {
+      path.push_back(BB);
+      BasicBlock *next = nullptr;
+      if (inSubLoop(BB, L, &LI)) {
+        Loop *sub = LI.getLoopFor(BB);
+        while (sub->getParentLoop() != L) {
+          sub = sub->getParentLoop();
+        }
+        for (BasicBlock *subBB : sub->blocks()) {
+          if (visited.insert(subBB).second) {
+            path.push_back(subBB);
+          }
+        }
+        SmallVector<Loop::Edge, 4> exits;
+        sub->getExitEdges(exits);
+        BlockFrequency best;
+        for (const Loop::Edge &E : exits) {
+          BlockFrequency edgeFreq = bfi.getBlockFreq(E.first) * bpi.getEdgeProbability(E.first, E.second);
+          if (!next || edgeFreq > best) {
+            next = E.second;
+            best = edgeFreq;
+          }
+        }
+        BB = next;
+        continue;
+      }
+      for (BasicBlock *succ : successors(BB)) {
+        if (bpi.getEdgeProbability(BB, succ) >= BranchProbability(FREQ_THRESHOLD, 100)) {
+          next = succ;
+          break;
+        }
+      }
+      BB = next;
+    }
+    return path;
+  }
+
+
+  // True if every instruction of the loop that may write LD's location is a
+  // simple store to exactly LD's pointer in a block off the frequent path.
+  // The blocks holding those stores are collected in storeBlocks.
+  bool onlyStoredOffPath(LoadInst *LD, const SmallVectorImpl<Instruction*> &writers,
+                         const SmallPtrSetImpl<BasicBlock*> &onPath, AAResults &AA,
+                         SetVector<BasicBlock*> &storeBlocks) {
+    MemoryLocation loc = MemoryLocation::get(LD);
+    for (Instruction *W : writers) {
+      if (!isModSet(AA.getModRefInfo(W, loc))) {
+        continue;
+      }
+      StoreInst *SI = dyn_cast<StoreInst>(W);
+      if (!SI || !SI->isSimple() || SI->getPointerOperand() != loc.Ptr ||
+          SI->getValueOperand()->getType() != LD->getType() ||
+          onPath.count(SI->getParent())) {
+        return false;
+      }
+      storeBlocks.insert(SI->getParent());
+    }
+    return true;
+  }
+
+
+  // Value held at ptr when BB ends, given that BB stores to ptr.
+  Value *lastStoredValue(BasicBlock *BB, Value *ptr) {
+    for (Instruction &I : reverse(*BB)) {
+      if (StoreInst *SI = dyn_cast<StoreInst>(&I)) {
+        if (SI->getPointerOperand() == ptr) {
+          return SI->getValueOperand();
+        }
+      }
+    }
+    llvm_unreachable("fix-up block without a store to the hoisted address");
+  }
+
+
+  // Clones I before InsertPt, passing every operand through Map.
+  Instruction *rematerialize(Instruction *I, Instruction *InsertPt, function_ref<Value*(Value*)> Map) {
+    Instruction *C = I->clone();
+    C->setName(I->getName() + ".fp");
+    for (Use &U : C->operands()) {
+      U.set(Map(U.get()));
+    }
+    C->insertBefore(InsertPt);
+    return C;
+  }
+
 }; 
 } // end of namespace Performance
 
@@ -366,4 +648,60 @@ char Performance::FPLICMPass::ID = 0;
 static RegisterPass<Performance::FPLICMPass> Y("fplicm-performance", "Frequent Loop Invariant Code Motion for performance test", false, false);
 
 
+// New pass manager versions, for -load-pass-plugin. FPLICM runs as a function
+// pass visiting loops innermost first, the order the LPPassManager uses.
+namespace Correctness {
+struct PSBPassNPM : PassInfoMixin<PSBPassNPM> {
+  PreservedAnalyses run(Function &F, FunctionAnalysisManager &FAM) {
+    PSBPass P;
+    bool Changed = P.runImpl(F, FAM.getResult<BranchProbabilityAnalysis>(F),
+                             FAM.getResult<BlockFrequencyAnalysis>(F),
+                             FAM.getResult<DominatorTreeAnalysis>(F));
+    return Changed ? PreservedAnalyses::none() : PreservedAnalyses::all();
+  }
+};
+} // end of namespace Correctness
+
+namespace Performance {
+struct FPLICMPassNPM : PassInfoMixin<FPLICMPassNPM> {
+  PreservedAnalyses run(Function &F, FunctionAnalysisManager &FAM) {
+    LoopInfo &LI = FAM.getResult<LoopAnalysis>(F);
+    BranchProbabilityInfo &bpi = FAM.getResult<BranchProbabilityAnalysis>(F);
+    BlockFrequencyInfo &bfi = FAM.getResult<BlockFrequencyAnalysis>(F);
+    AAResults &AA = FAM.getResult<AAManager>(F);
+    FPLICMPass P;
+    bool Changed = false;
+    SmallVector<Loop*, 8> Worklist = LI.getLoopsInPreorder();
+    while (!Worklist.empty()) {
+      Changed |= P.runImpl(Worklist.pop_back_val(), bpi, bfi, LI, AA);
+    }
+    if (!Changed) {
+      return PreservedAnalyses::all();
+    }
+    PreservedAnalyses PA;
+    PA.preserveSet<CFGAnalyses>();
+    return PA;
+  }
+};
+} // end of namespace Performance
+
+extern "C" LLVM_ATTRIBUTE_WEAK PassPluginLibraryInfo llvmGetPassPluginInfo() {
+  return {LLVM_PLUGIN_API_VERSION, "ProfileSuperBlock", LLVM_VERSION_STRING,
+          [](PassBuilder &PB) {
+            PB.registerPipelineParsingCallback(
+                [](StringRef Name, FunctionPassManager &FPM, ArrayRef<PassBuilder::PipelineElement>) {
+                  if (Name == "psbpass") {
+                    FPM.addPass(Correctness::PSBPassNPM());
+                    return true;
+                  }
+                  if (Name == "fplicm-performance") {
+                    FPM.addPass(Performance::FPLICMPassNPM());
+                    return true;
+                  }
+                  return false;
+                });
+          }};
+}
+
+
 
@@ -0,0 +1,159 @@
+//===-- SB_BUDGET.cpp - Cost model and code growth budget for tail duplication ===//
+//
+// See SB_BUDGET.h.
+//
+//===----------------------------------------------------------------------===//
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/BranchProbabilityInfo.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Support/CommandLine.h"
+
+#include <limits>
+
+#include "SB_BUDGET.h"
+
+using namespace llvm;
+using namespace std;
+
+static cl::opt<bool> UseDupBudget("sb-dup-budget", cl::init(true),
+    cl::desc("Only tail duplicate traces the cost model admits within the "
+             "module's code growth budget"));
+
+static cl::opt<unsigned> DupGrowth("sb-dup-growth", cl::init(10),
+    cl::desc("Code growth (percent of the module's size) tail duplication may spend"));
+
+static cl::opt<unsigned> DupMinBudget("sb-dup-min-budget", cl::init(64),
+    cl::desc("Code size tail duplication may always spend, however small the module"));
+
+namespace SuperBlock {
+
+unsigned codeSize(const BasicBlock &BB, const TargetTransformInfo &TTI) {
+  unsigned size = 0;
+  for (const Instruction &I : BB) {
+    auto cost = TTI.getInstructionCost(&I, TargetTransformInfo::TCK_CodeSize).getValue();
+    size += cost ? *cost : 1;
+  }
+  return size;
+}
+
+
+uint64_t codeSize(const Function &F, const TargetTransformInfo &TTI) {
+  uint64_t size = 0;
+  for (const BasicBlock &BB : F) {
+    size += codeSize(BB, TTI);
+  }
+  return size;
+}
+
+
+// How often BB runs: a profile count when F has an entry count, executions
+// per call otherwise.
+static double executions(const BasicBlock *BB, const BlockFrequencyInfo &BFI) {
+  if (BB->getParent()->getEntryCount()) {
+    return double(BFI.getBlockProfileCount(BB).getValueOr(0));
+  }
+  double entryFreq = BFI.getEntryFreq();
+  return entryFreq ? BFI.getBlockFreq(BB).getFrequency() / entryFreq : 0.0;
+}
+
+
+DupCandidate priceTailDuplication(ArrayRef<BasicBlock*> Trace, TraceOfFn TraceOf,
+                                  const BranchProbabilityInfo &BPI, const BlockFrequencyInfo &BFI,
+                                  const LoopInfo &LI, const TargetTransformInfo &TTI) {
+  DupCandidate C;
+  if (Trace.size() < 2) {
+    return C;
+  }
+  // Same walk as tailDuplicateTrace(): from the first side entrance to the
+  // first block it would not copy.
+  int id = TraceOf(Trace.front());
+  auto sideEntered = [&](const BasicBlock *BB) {
+    return any_of(predecessors(BB), [&](const BasicBlock *pred) { return TraceOf(pred) != id; });
+  };
+  unsigned first = 1;
+  for (; first < Trace.size(); ++first) {
+    if (!is_contained(successors(Trace[first - 1]), Trace[first])) {
+      return C;
+    }
+    if (sideEntered(Trace[first])) {
+      break;
+    }
+  }
+  if (first == Trace.size()) {
+    return C;
+  }
+  const BasicBlock *entryBB = Trace[first - 1];
+  if (isa<IndirectBrInst>(entryBB->getTerminator()) || isa<CallBrInst>(entryBB->getTerminator())) {
+    return C;
+  }
+
+  for (unsigned i = first; i < Trace.size(); ++i) {
+    if (!canDuplicateBlock(Trace[i]) ||
+        (i > first && !is_contained(successors(Trace[i - 1]), Trace[i]))) {
+      break;
+    }
+    Loop *L = LI.getLoopFor(Trace[i]);
+    if (L && !L->contains(entryBB)) {
+      break;
+    }
+    if (sideEntered(Trace[i])) {
+      BranchProbability P = edgeProbability(Trace[i - 1], Trace[i], BPI);
+      C.Benefit += executions(Trace[i - 1], BFI) * P.getNumerator() / P.getDenominator();
+    }
+    C.Cost += codeSize(*Trace[i], TTI);
+  }
+  return C;
+}
+
+
+DupCandidate priceLoopPeel(const Loop &L, unsigned Count, const BlockFrequencyInfo &BFI,
+                           const TargetTransformInfo &TTI) {
+  DupCandidate C;
+  if (const BasicBlock *preheader = L.getLoopPreheader()) {
+    C.Benefit = executions(preheader, BFI) * Count;
+  }
+  for (const BasicBlock *BB : L.blocks()) {
+    C.Cost += Count * codeSize(*BB, TTI);
+  }
+  return C;
+}
+
+
+DupBudget::DupBudget(uint64_t Size, vector<DupCandidate> Candidates) {
+  erase_if(Candidates, [](const DupCandidate &C) { return C.Cost == 0 || C.Benefit <= 0; });
+  stable_sort(Candidates.begin(), Candidates.end(), [](const DupCandidate &A, const DupCandidate &B) {
+    return A.Benefit / A.Cost > B.Benefit / B.Cost;
+  });
+
+  int64_t limit = max<uint64_t>(Size * DupGrowth / 100, DupMinBudget);
+  Remaining = limit;
+  Cutoff = numeric_limits<double>::infinity();
+  for (const DupCandidate &C : Candidates) {
+    if (C.Cost > limit) {
+      return;
+    }
+    limit -= C.Cost;
+    Cutoff = C.Benefit / C.Cost;
+  }
+  // Everything fits: duplications priced later (loop peels) only need the
+  // room that is left.
+  Cutoff = 0;
+}
+
+
+bool DupBudget::admit(const DupCandidate &C) {
+  if (!UseDupBudget || C.Cost == 0) {
+    return true;
+  }
+  if (C.Benefit <= 0 || C.Benefit / C.Cost < Cutoff || C.Cost > Remaining) {
+    return false;
+  }
+  Remaining -= C.Cost;
+  return true;
+}
+
+} // end of namespace SuperBlock
@@ -0,0 +1,88 @@
+//===-- SB_BUDGET.h - Cost model and code growth budget for tail duplication ===//
+//
+// Tail duplicating every trace with a side entrance can grow a large program
+// a lot, mostly for traces that hardly ever run. Each duplication is priced
+// instead: its benefit is the profile-weighted number of merges taken off the
+// hot path, its cost the code size of the copy. A module-wide budget admits
+// the best benefit per unit of code first, up to -sb-dup-growth percent of
+// the module's size.
+//
+// The budget covers the module when psbpass or rsbpass is named at module
+// level (-passes='psbpass', or -psbpass with the legacy pass manager), and
+// only the function being transformed when the pass runs in a function
+// pipeline (function(psbpass), -sb-ep-pipeline).
+//
+//===----------------------------------------------------------------------===//
+#ifndef SB_BUDGET_H
+#define SB_BUDGET_H
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/IR/BasicBlock.h"
+
+#include <vector>
+
+#include "SB_UTILS.h"
+
+namespace llvm {
+class BlockFrequencyInfo;
+class BranchProbabilityInfo;
+class Function;
+class Loop;
+class LoopInfo;
+class TargetTransformInfo;
+} // end of namespace llvm
+
+namespace SuperBlock {
+struct DupCandidate {
+  double Benefit = 0;  // executions that no longer pass through a merge
+  unsigned Cost = 0;   // code size of the copied tail
+};
+
+// TCK_CodeSize of BB's instructions, each at least 1.
+unsigned codeSize(const llvm::BasicBlock &BB, const llvm::TargetTransformInfo &TTI);
+
+// codeSize() of every block of F.
+uint64_t codeSize(const llvm::Function &F, const llvm::TargetTransformInfo &TTI);
+
+// What tailDuplicateTrace(Trace, TraceOf, ..., LI) would copy, priced without
+// copying it. The benefit sums, over every copied block that has a side
+// entrance, the flow along the trace edge into it: a profile count when F has
+// an entry count, executions per call otherwise. The cost is the
+// TCK_CodeSize of every copied instruction. Zero for a trace with nothing to
+// copy.
+DupCandidate priceTailDuplication(llvm::ArrayRef<llvm::BasicBlock *> Trace, TraceOfFn TraceOf,
+                                  const llvm::BranchProbabilityInfo &BPI,
+                                  const llvm::BlockFrequencyInfo &BFI, const llvm::LoopInfo &LI,
+                                  const llvm::TargetTransformInfo &TTI);
+
+// What peeling the first Count iterations off L would copy, priced the same
+// way: the benefit is the flow from L's preheader times Count, the header
+// merges the peeled iterations no longer go through; the cost is Count
+// copies of every block of L.
+DupCandidate priceLoopPeel(const llvm::Loop &L, unsigned Count, const llvm::BlockFrequencyInfo &BFI,
+                           const llvm::TargetTransformInfo &TTI);
+
+// Code growth budget of one run of a pass over a module. The pass selects the
+// traces of every function of the module before it duplicates any and prices
+// every duplication it would make (see SB_PASS.cpp); the constructor sorts
+// them by benefit per unit of cost and admits them in that order until the
+// growth limit is spent: the density of the last one admitted is the cut-off
+// (none if they all fit). Each function then admits its own duplications, and
+// its loop peels, that reach the cut-off while the budget lasts.
+class DupBudget {
+  double Cutoff = 0;
+  int64_t Remaining = 0;
+
+public:
+  // Budget for code of Size (the codeSize() of every function priced) with
+  // duplication candidates Candidates.
+  DupBudget(uint64_t Size, std::vector<DupCandidate> Candidates);
+
+  // True, and the cost is spent, if C is worth its code. Always true under
+  // -sb-dup-budget=false.
+  bool admit(const DupCandidate &C);
+};
+} // end of namespace SuperBlock
+
+#endif
@@ -0,0 +1,138 @@
+//===-- SB_EXPAND.cpp - Branch target expansion ---------------------------===//
+//
+// See SB_EXPAND.h.
+//
+//===----------------------------------------------------------------------===//
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/Analysis/DomTreeUpdater.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/Support/CommandLine.h"
+
+#include "SB_EXPAND.h"
+#include "SB_UTILS.h"
+
+using namespace llvm;
+using namespace std;
+
+static cl::opt<unsigned> ExpandThreshold("sb-expand-threshold", cl::init(60),
+    cl::desc("Branch probability (percent) above which the superblock a "
+             "superblock ends in is copied onto it"));
+
+static cl::opt<unsigned> ExpandMaxSize("sb-expand-max-size", cl::init(64),
+    cl::desc("Most instructions branch target expansion adds to one superblock"));
+
+namespace SuperBlock {
+
+// Successor BB branches to with at least ExpandThreshold percent, if any.
+static BasicBlock *likelySuccessor(BasicBlock *BB, const BranchProbabilityInfo &BPI) {
+  SmallPtrSet<BasicBlock*, 4> seen;
+  for (BasicBlock *succ : successors(BB)) {
+    if (seen.insert(succ).second &&
+        edgeProbability(BB, succ, BPI) >= BranchProbability(ExpandThreshold, 100)) {
+      return succ;
+    }
+  }
+  return nullptr;
+}
+
+
+// Every block of Trace but the first is only entered from the one before it.
+static bool isChain(ArrayRef<BasicBlock*> Trace) {
+  for (unsigned i = 1; i < Trace.size(); ++i) {
+    if (Trace[i]->getUniquePredecessor() != Trace[i - 1]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+bool expandSuperblocks(vector<vector<BasicBlock*>> &Traces, const BranchProbabilityInfo &BPI,
+                       DomTreeUpdater &DTU, LoopInfo &LI) {
+  DenseMap<const BasicBlock*, unsigned> headOf;
+  for (unsigned t = 0; t < Traces.size(); ++t) {
+    headOf[Traces[t].front()] = t;
+  }
+
+  bool changed = false;
+  vector<bool> absorbed(Traces.size(), false);
+  for (unsigned t = 0; t < Traces.size(); ++t) {
+    if (absorbed[t]) {
+      continue;
+    }
+    vector<BasicBlock*> &SB = Traces[t];
+    unsigned budget = ExpandMaxSize;
+    while (BasicBlock *target = likelySuccessor(SB.back(), BPI)) {
+      auto it = headOf.find(target);
+      if (it == headOf.end() || it->second == t) {
+        break;
+      }
+      Loop *L = LI.getLoopFor(target);
+      if (L && L->getHeader() == target) {
+        break;
+      }
+
+      const vector<BasicBlock*> &targetSB = Traces[it->second];
+      SmallPtrSet<const BasicBlock*, 16> inSB(SB.begin(), SB.end());
+      if (all_of(predecessors(target), [&](const BasicBlock *pred) { return inSB.count(pred); })) {
+        // Earlier expansions took every other entrance: nothing to copy, the
+        // target superblock simply becomes the rest of SB. Copying it would
+        // leave the original unreachable.
+        if (!isChain(targetSB)) {
+          break;
+        }
+        SB.insert(SB.end(), targetSB.begin(), targetSB.end());
+        absorbed[it->second] = true;
+        headOf.erase(it);
+        continue;
+      }
+
+      // Copy the longest prefix of the target superblock that fits.
+      unsigned n = 0, size = 0;
+      while (n < targetSB.size() && size + targetSB[n]->size() <= budget) {
+        size += targetSB[n++]->size();
+      }
+      if (n == 0) {
+        break;
+      }
+
+      // Tail duplication does the copying: seen from SB, every edge into the
+      // target superblock but the one from its last block is a side entrance.
+      // SB itself must have none left, or its own tail would be copied too.
+      auto fromSB = [&](const BasicBlock *BB) {
+        return all_of(predecessors(BB), [&](const BasicBlock *pred) { return inSB.count(pred); });
+      };
+      if (!all_of(drop_begin(SB), fromSB)) {
+        break;
+      }
+      vector<BasicBlock*> expanded(SB);
+      expanded.insert(expanded.end(), targetSB.begin(), targetSB.begin() + n);
+      auto traceOf = [&](const BasicBlock *BB) { return inSB.count(BB) ? 0 : -1; };
+      if (!tailDuplicateTrace(expanded, traceOf, &DTU, &LI)) {
+        break;
+      }
+      for (unsigned i = SB.size(); i < expanded.size(); ++i) {
+        budget -= expanded[i]->size();
+      }
+      SB = std::move(expanded);
+      changed = true;
+    }
+  }
+
+  // Superblocks appended whole to another one are not superblocks of their own.
+  unsigned kept = 0;
+  for (unsigned t = 0; t < Traces.size(); ++t) {
+    if (!absorbed[t]) {
+      if (kept != t) {
+        Traces[kept] = std::move(Traces[t]);  // a self-move would empty it
+      }
+      ++kept;
+    }
+  }
+  Traces.resize(kept);
+  return changed;
+}
+
+} // end of namespace SuperBlock
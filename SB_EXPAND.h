@@ -0,0 +1,37 @@
+//===-- SB_EXPAND.h - Branch target expansion -----------------------------===//
+//
+// Trace growth stops as soon as the likely successor already belongs to
+// another trace, which leaves many superblocks two or three blocks long even
+// on the hottest paths. Branch target expansion enlarges them afterwards by
+// appending a copy of the superblock they are likely to branch into.
+//
+//===----------------------------------------------------------------------===//
+#ifndef SB_EXPAND_H
+#define SB_EXPAND_H
+
+#include "llvm/IR/BasicBlock.h"
+
+#include <vector>
+
+namespace llvm {
+class BranchProbabilityInfo;
+class DomTreeUpdater;
+class LoopInfo;
+} // end of namespace llvm
+
+namespace SuperBlock {
+// For each superblock of Traces (single entry, as tailDuplicateTrace() leaves
+// them), in order: while its last block branches with at least
+// -sb-expand-threshold percent probability to the head of another
+// superblock, copy that superblock (as much of it as the remaining
+// -sb-expand-max-size budget allows) and append the copy. Loop headers are
+// never copied; that is what unrolling and peeling are for. A superblock
+// that, after earlier copies, is entered from nowhere else is appended as it
+// is and dropped from Traces. DTU and LI are kept up to date. Returns true if
+// anything was copied.
+bool expandSuperblocks(std::vector<std::vector<llvm::BasicBlock *>> &Traces,
+                       const llvm::BranchProbabilityInfo &BPI,
+                       llvm::DomTreeUpdater &DTU, llvm::LoopInfo &LI);
+} // end of namespace SuperBlock
+
+#endif
@@ -0,0 +1,220 @@
+//===-- SB_HYPER.cpp - Hyperblock formation by if-conversion --------------===//
+//
+// See SB_HYPER.h.
+//
+//===----------------------------------------------------------------------===//
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/Analysis/BranchProbabilityInfo.h"
+#include "llvm/Analysis/DomTreeUpdater.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+
+#include "SB_HYPER.h"
+#include "SB_UTILS.h"
+
+using namespace llvm;
+using namespace std;
+
+static cl::opt<unsigned> MispredictCost("sb-hyperblock-mispredict-cost", cl::init(12),
+    cl::desc("Cost of a branch mispredict, in instructions, assumed by -sb-hyperblock"));
+
+static cl::opt<unsigned> HyperMaxSize("sb-hyperblock-max-size", cl::init(16),
+    cl::desc("Most instructions -sb-hyperblock speculates out of one hammock"));
+
+namespace SuperBlock {
+
+namespace {
+// Head ends in a conditional branch; Arm[i] is the block successor i enters,
+// or null if successor i is Join itself.
+struct Hammock {
+  BasicBlock *Head = nullptr;
+  BasicBlock *Join = nullptr;
+  BasicBlock *Arm[2] = {nullptr, nullptr};
+  StoreInst *Store[2] = {nullptr, nullptr};
+  unsigned Size[2] = {0, 0};
+};
+} // end of anonymous namespace
+
+
+// BB is entered only from Head and falls through to a single block.
+static bool isArm(BasicBlock *BB, BasicBlock *Head) {
+  return BB != Head && BB->getSinglePredecessor() == Head && BB->getSingleSuccessor() &&
+         isa<BranchInst>(BB->getTerminator()) && !BB->hasAddressTaken();
+}
+
+
+static bool matchHammock(BasicBlock *Head, Hammock &H) {
+  auto *BI = dyn_cast<BranchInst>(Head->getTerminator());
+  if (!BI || !BI->isConditional()) {
+    return false;
+  }
+  BasicBlock *S0 = BI->getSuccessor(0), *S1 = BI->getSuccessor(1);
+  if (S0 == S1) {
+    return false;
+  }
+  H.Head = Head;
+  if (isArm(S0, Head) && isArm(S1, Head) && S0->getSingleSuccessor() == S1->getSingleSuccessor()) {
+    H.Join = S0->getSingleSuccessor();
+    H.Arm[0] = S0;
+    H.Arm[1] = S1;
+  } else if (isArm(S0, Head) && S0->getSingleSuccessor() == S1) {
+    H.Join = S1;
+    H.Arm[0] = S0;
+  } else if (isArm(S1, Head) && S1->getSingleSuccessor() == S0) {
+    H.Join = S0;
+    H.Arm[1] = S1;
+  } else {
+    return false;
+  }
+  return H.Join != Head;
+}
+
+
+// Everything in Arm but its terminator can run unconditionally, except for
+// a store as its last instruction. Counts the instructions.
+static bool canSpeculateArm(BasicBlock *Arm, StoreInst *&Store, unsigned &Size) {
+  for (Instruction &I : *Arm) {
+    if (I.isTerminator() || isa<PHINode>(I) || isa<DbgInfoIntrinsic>(I)) {
+      continue;
+    }
+    if (Store) {
+      return false;
+    }
+    ++Size;
+    auto *SI = dyn_cast<StoreInst>(&I);
+    if (SI && SI->isSimple()) {
+      Store = SI;
+    } else if (!isSafeToSpeculativelyExecute(&I)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+// Value PN receives when Head's branch goes to successor i.
+static Value *incomingFor(PHINode &PN, const Hammock &H, unsigned i) {
+  return PN.getIncomingValueForBlock(H.Arm[i] ? H.Arm[i] : H.Head);
+}
+
+
+static bool isProfitable(Hammock &H, const BranchProbabilityInfo &BPI, unsigned Threshold) {
+  auto *BI = cast<BranchInst>(H.Head->getTerminator());
+  BranchProbability P0 = edgeProbability(H.Head, BI->getSuccessor(0), BPI);
+  BranchProbability limit(Threshold, 100);
+  if (P0 > limit || P0.getCompl() > limit) {
+    return false;  // biased: trace formation follows it
+  }
+  for (unsigned i = 0; i < 2; ++i) {
+    if (H.Arm[i] && !canSpeculateArm(H.Arm[i], H.Store[i], H.Size[i])) {
+      return false;
+    }
+  }
+  // Only the same store on both sides can be merged.
+  if (H.Store[0] || H.Store[1]) {
+    if (!H.Store[0] || !H.Store[1] ||
+        H.Store[0]->getPointerOperand() != H.Store[1]->getPointerOperand() ||
+        H.Store[0]->getValueOperand()->getType() != H.Store[1]->getValueOperand()->getType()) {
+      return false;
+    }
+  }
+  unsigned selects = H.Store[0] ? 1 : 0;
+  for (PHINode &PN : H.Join->phis()) {
+    selects += incomingFor(PN, H, 0) != incomingFor(PN, H, 1);
+  }
+
+  // Both arms always run; the branch, and its mispredicts, go away.
+  double p0 = double(P0.getNumerator()) / P0.getDenominator();
+  double extra = H.Size[0] + H.Size[1] + selects - (p0 * H.Size[0] + (1 - p0) * H.Size[1]);
+  double saved = MispredictCost * min(p0, 1 - p0) + 1;
+  return H.Size[0] + H.Size[1] <= HyperMaxSize && extra <= saved;
+}
+
+
+static void ifConvert(Hammock &H, DomTreeUpdater &DTU, LoopInfo &LI) {
+  auto *BI = cast<BranchInst>(H.Head->getTerminator());
+  Value *C = BI->getCondition();
+  IRBuilder<> B(BI);
+
+  for (unsigned i = 0; i < 2; ++i) {
+    if (!H.Arm[i]) {
+      continue;
+    }
+    FoldSingleEntryPHINodes(H.Arm[i]);
+    for (Instruction &I : make_early_inc_range(*H.Arm[i])) {
+      if (!I.isTerminator() && &I != H.Store[i]) {
+        I.moveBefore(BI);
+      }
+    }
+  }
+  if (H.Store[0]) {
+    Value *V = B.CreateSelect(C, H.Store[0]->getValueOperand(), H.Store[1]->getValueOperand(), "hb");
+    B.CreateAlignedStore(V, H.Store[0]->getPointerOperand(),
+                         min(H.Store[0]->getAlign(), H.Store[1]->getAlign()));
+    H.Store[0]->eraseFromParent();
+    H.Store[1]->eraseFromParent();
+  }
+  for (PHINode &PN : H.Join->phis()) {
+    Value *V0 = incomingFor(PN, H, 0), *V1 = incomingFor(PN, H, 1);
+    Value *V = V0 == V1 ? V0 : B.CreateSelect(C, V0, V1, PN.getName() + ".hb");
+    if (H.Arm[0] && H.Arm[1]) {
+      PN.addIncoming(V, H.Head);
+    } else {
+      PN.setIncomingValueForBlock(H.Head, V);
+    }
+  }
+
+  BranchInst::Create(H.Join, BI);
+  BI->eraseFromParent();
+  SmallVector<DominatorTree::UpdateType, 3> updates;
+  for (unsigned i = 0; i < 2; ++i) {
+    if (H.Arm[i]) {
+      updates.push_back({DominatorTree::Delete, H.Head, H.Arm[i]});
+    }
+  }
+  if (H.Arm[0] && H.Arm[1]) {
+    updates.push_back({DominatorTree::Insert, H.Head, H.Join});
+  }
+  DTU.applyUpdates(updates);
+  for (unsigned i = 0; i < 2; ++i) {
+    if (H.Arm[i]) {
+      LI.removeBlock(H.Arm[i]);
+      DeleteDeadBlock(H.Arm[i], &DTU);
+    }
+  }
+  MergeBlockIntoPredecessor(H.Join, &DTU, &LI);
+}
+
+
+bool formHyperblocks(Function &F, const BranchProbabilityInfo &BPI, unsigned Threshold,
+                     DomTreeUpdater &DTU, LoopInfo &LI) {
+  // Blocks whose terminator changed. BPI only knows their old one, so they
+  // are only looked at again if the new one carries branch weights.
+  SmallPtrSet<const BasicBlock*, 16> stale;
+  bool changed = false, progress = true;
+  while (progress) {
+    progress = false;
+    for (BasicBlock &BB : make_early_inc_range(F)) {
+      if (DTU.isBBPendingDeletion(&BB) ||
+          (stale.count(&BB) && !BB.getTerminator()->getMetadata(LLVMContext::MD_prof))) {
+        continue;
+      }
+      Hammock H;
+      if (!matchHammock(&BB, H) || !isProfitable(H, BPI, Threshold)) {
+        continue;
+      }
+      ifConvert(H, DTU, LI);
+      stale.insert(&BB);
+      changed = progress = true;
+    }
+  }
+  return changed;
+}
+
+} // end of namespace SuperBlock
@@ -0,0 +1,39 @@
+//===-- SB_HYPER.h - Hyperblock formation by if-conversion ----------------===//
+//
+// A branch that goes either way about as often ends every trace that reaches
+// it (no successor beats the trace growth threshold) and is the branch most
+// likely to be mispredicted. formHyperblocks() if-converts the short ones
+// before traces are formed, so the trace simply runs through them.
+//
+//===----------------------------------------------------------------------===//
+#ifndef SB_HYPER_H
+#define SB_HYPER_H
+
+namespace llvm {
+class BranchProbabilityInfo;
+class DomTreeUpdater;
+class Function;
+class LoopInfo;
+} // end of namespace llvm
+
+namespace SuperBlock {
+// If-converts hammocks of F whose branch is unbiased: neither edge taken with
+// more than Threshold percent. A hammock is a conditional branch whose arms
+// (one of them may be empty) are single blocks that are only entered from the
+// branch and fall through to the same join block. The arms' instructions are
+// speculated above the branch, a store to the same address at the end of
+// both arms becomes one store of a select, and the join's PHIs become selects.
+//
+// Whether a hammock is worth it is decided from the profile: the extra work
+// of running both arms must not exceed the expected cost of mispredicting
+// the branch (-sb-hyperblock-mispredict-cost instructions, times the rarer
+// edge's probability), and the arms together may hold at most
+// -sb-hyperblock-max-size instructions. Nested hammocks are converted inside
+// out. DTU and LI are kept up to date; BPI and BFI are not, so recompute them
+// if this returns true.
+bool formHyperblocks(llvm::Function &F, const llvm::BranchProbabilityInfo &BPI,
+                     unsigned Threshold, llvm::DomTreeUpdater &DTU,
+                     llvm::LoopInfo &LI);
+} // end of namespace SuperBlock
+
+#endif
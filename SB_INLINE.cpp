@@ -0,0 +1,207 @@
+//===-- SB_INLINE.cpp - Profile-guided inlining before superblock formation ===//
+//
+// See SB_INLINE.h.
+//
+//===----------------------------------------------------------------------===//
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/InlineCost.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/IR/Attributes.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Pass.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+
+#include <algorithm>
+
+#include "SB_BUDGET.h"
+#include "SB_INLINE.h"
+#include "SB_PLUGIN.h"
+
+using namespace llvm;
+using namespace std;
+
+static cl::opt<unsigned> InlineHot("sb-inline-hot", cl::init(1),
+    cl::desc("Call sites run at least this percent as often as the hottest one are inlined"));
+
+static cl::opt<unsigned> InlineMaxSize("sb-inline-max-size", cl::init(100),
+    cl::desc("Largest callee (TCK_CodeSize) -sb-inline copies into a call site"));
+
+static cl::opt<unsigned> InlineGrowth("sb-inline-growth", cl::init(20),
+    cl::desc("Code growth (percent of the module's size) -sb-inline may spend"));
+
+static cl::opt<unsigned> InlineMinBudget("sb-inline-min-budget", cl::init(64),
+    cl::desc("Code size -sb-inline may always spend, however small the module"));
+
+namespace SuperBlock {
+
+namespace {
+struct InlineCandidate {
+  CallBase *Call;
+  Function *Callee;
+  uint64_t Count;  // executions of the call
+  unsigned Cost;   // code size of the callee when collected
+};
+} // end of anonymous namespace
+
+
+static unsigned functionSize(const Function &F, const TargetTransformInfo &TTI) {
+  unsigned size = 0;
+  for (const BasicBlock &BB : F) {
+    size += codeSize(BB, TTI);
+  }
+  return size;
+}
+
+
+// Whether CB may be inlined at all, regardless of profit.
+static Function *inlinableCallee(CallBase &CB, const TargetTransformInfo &TTI) {
+  Function *caller = CB.getFunction();
+  Function *callee = CB.getCalledFunction();
+  if (!callee || callee == caller || callee->isDeclaration() || callee->isInterposable() ||
+      CB.getFunctionType() != callee->getFunctionType() || CB.isNoInline() ||
+      callee->hasFnAttribute(Attribute::NoInline) || callee->hasFnAttribute("coroutine.presplit")) {
+    return nullptr;
+  }
+  if (!AttributeFuncs::areInlineCompatible(*caller, *callee) ||
+      !TTI.areInlineCompatible(caller, callee) || !isInlineViable(*callee).isSuccess()) {
+    return nullptr;
+  }
+  return callee;
+}
+
+
+bool inlineHotCalls(Module &M, function_ref<BlockFrequencyInfo &(Function &)> GetBFI,
+                    function_ref<TargetTransformInfo &(Function &)> GetTTI) {
+  uint64_t moduleSize = 0;
+  vector<InlineCandidate> candidates;
+  for (Function &F : M) {
+    if (F.isDeclaration()) {
+      continue;
+    }
+    const TargetTransformInfo &TTI = GetTTI(F);
+    moduleSize += functionSize(F, TTI);
+    if (!F.getEntryCount().hasValue()) {
+      continue;
+    }
+    BlockFrequencyInfo &BFI = GetBFI(F);
+    for (Instruction &I : instructions(F)) {
+      auto *CB = dyn_cast<CallBase>(&I);
+      if (!CB || isa<IntrinsicInst>(CB)) {
+        continue;
+      }
+      Function *callee = inlinableCallee(*CB, TTI);
+      uint64_t count = BFI.getBlockProfileCount(CB->getParent()).getValueOr(0);
+      if (!callee || !count) {
+        continue;
+      }
+      unsigned cost = functionSize(*callee, GetTTI(*callee));
+      if (cost <= InlineMaxSize) {
+        candidates.push_back({CB, callee, count, cost});
+      }
+    }
+  }
+  if (candidates.empty()) {
+    return false;
+  }
+
+  uint64_t hottest = 0;
+  for (const InlineCandidate &C : candidates) {
+    hottest = max(hottest, C.Count);
+  }
+  candidates.erase(remove_if(candidates.begin(), candidates.end(),
+                             [&](const InlineCandidate &C) {
+                               return C.Count * 100 < hottest * InlineHot;
+                             }),
+                   candidates.end());
+  // Most calls removed per unit of code first; ties keep program order.
+  stable_sort(candidates.begin(), candidates.end(),
+              [](const InlineCandidate &A, const InlineCandidate &B) {
+                return double(A.Count) / max(A.Cost, 1u) > double(B.Count) / max(B.Cost, 1u);
+              });
+
+  int64_t remaining = max<int64_t>(moduleSize * InlineGrowth / 100, InlineMinBudget);
+  bool changed = false;
+  for (const InlineCandidate &C : candidates) {
+    // The callee may have grown since it was priced, by inlining into it.
+    unsigned cost = functionSize(*C.Callee, GetTTI(*C.Callee));
+    if (cost > InlineMaxSize || cost > remaining) {
+      continue;
+    }
+    Function *caller = C.Call->getFunction();
+    OptimizationRemark remark("sb-inline", "Inlined", C.Call);
+    remark << ore::NV("Callee", C.Callee) << " inlined into " << ore::NV("Caller", caller)
+           << " (" << ore::NV("Count", C.Count) << " calls, size " << ore::NV("Cost", cost) << ")";
+    InlineFunctionInfo IFI;
+    if (!InlineFunction(*C.Call, IFI).isSuccess()) {
+      continue;
+    }
+    remaining -= cost;
+    changed = true;
+    // The inlined calls no longer enter the callee.
+    if (auto entry = C.Callee->getEntryCount()) {
+      uint64_t left = entry->getCount() > C.Count ? entry->getCount() - C.Count : 0;
+      C.Callee->setEntryCount(left, entry->getType());
+    }
+    OptimizationRemarkEmitter ORE(caller);
+    ORE.emit(remark);
+  }
+
+  return changed;
+}
+
+
+namespace {
+struct SBInlineNPM : PassInfoMixin<SBInlineNPM> {
+  PreservedAnalyses run(Module &M, ModuleAnalysisManager &MAM) {
+    auto &FAM = MAM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+    bool changed = inlineHotCalls(
+        M, [&](Function &F) -> BlockFrequencyInfo & { return FAM.getResult<BlockFrequencyAnalysis>(F); },
+        [&](Function &F) -> TargetTransformInfo & { return FAM.getResult<TargetIRAnalysis>(F); });
+    return changed ? PreservedAnalyses::none() : PreservedAnalyses::all();
+  }
+};
+
+struct SBInline : public ModulePass {
+  static char ID;
+  SBInline() : ModulePass(ID) {}
+
+  void getAnalysisUsage(AnalysisUsage &AU) const override {
+    AU.addRequired<BlockFrequencyInfoWrapperPass>();
+    AU.addRequired<TargetTransformInfoWrapperPass>();
+  }
+
+  bool runOnModule(Module &M) override {
+    return inlineHotCalls(
+        M, [&](Function &F) -> BlockFrequencyInfo & {
+          return getAnalysis<BlockFrequencyInfoWrapperPass>(F).getBFI();
+        },
+        [&](Function &F) -> TargetTransformInfo & {
+          return getAnalysis<TargetTransformInfoWrapperPass>().getTTI(F);
+        });
+  }
+};
+} // end of anonymous namespace
+
+
+void registerInlinePasses(PassBuilder &PB) {
+  PB.registerPipelineParsingCallback(
+      [](StringRef Name, ModulePassManager &MPM, ArrayRef<PassBuilder::PipelineElement>) {
+        if (Name == "sb-inline") {
+          MPM.addPass(SBInlineNPM());
+          return true;
+        }
+        return false;
+      });
+}
+
+} // end of namespace SuperBlock
+
+char SuperBlock::SBInline::ID = 0;
+static RegisterPass<SuperBlock::SBInline> I("sb-inline", "Profile-guided inlining before superblock formation");
@@ -0,0 +1,42 @@
+//===-- SB_INLINE.h - Profile-guided inlining before superblock formation --===//
+//
+// A trace cannot run through a call, so a hot call in a loop (miniDist in
+// leetcode/dijkstra.cpp) leaves the superblock passes only the pieces around
+// it. sb-inline runs first and inlines the hot, small callees of the module
+// so traces can follow the callee's body:
+//
+//   opt -load LLVMSB.so -load-pass-plugin=LLVMSB.so
+//       -passes='pgo-instr-use,sb-inline,globaldce,psbpass' in.bc ...
+//
+// A call site is a candidate if the profile ran it at least -sb-inline-hot
+// percent as often as the module's hottest call site and its callee is a
+// definition of at most -sb-inline-max-size (TCK_CodeSize) that can be
+// inlined. Candidates are taken by calls removed per unit of code, like tail
+// duplications in SB_BUDGET.h, until -sb-inline-growth percent of the
+// module's size is spent. Only the calls present before the pass count; the
+// calls a callee brings along are not inlined in turn. Functions without a
+// profile entry count are left alone, and a local callee inlined everywhere
+// is left for globaldce.
+//
+//===----------------------------------------------------------------------===//
+#ifndef SB_INLINE_H
+#define SB_INLINE_H
+
+#include "llvm/ADT/STLExtras.h"
+
+namespace llvm {
+class BlockFrequencyInfo;
+class Function;
+class Module;
+class TargetTransformInfo;
+} // end of namespace llvm
+
+namespace SuperBlock {
+// Inlines the hot call sites of M as described above. GetBFI is only asked
+// for before anything is inlined. Returns true if M changed.
+bool inlineHotCalls(llvm::Module &M,
+                    llvm::function_ref<llvm::BlockFrequencyInfo &(llvm::Function &)> GetBFI,
+                    llvm::function_ref<llvm::TargetTransformInfo &(llvm::Function &)> GetTTI);
+} // end of namespace SuperBlock
+
+#endif
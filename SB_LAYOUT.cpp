@@ -0,0 +1,90 @@
+//===-- SB_LAYOUT.cpp - Trace-ordered block layout -------------------------===//
+//
+// See SB_LAYOUT.h.
+//
+//===----------------------------------------------------------------------===//
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/BranchProbabilityInfo.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Support/CommandLine.h"
+
+#include "SB_LAYOUT.h"
+#include "SB_UTILS.h"
+
+using namespace llvm;
+using namespace std;
+
+static cl::opt<bool> LayoutSB("sb-layout", cl::init(true),
+    cl::desc("Lay superblocks out contiguously and write the profile into "
+             "branch_weights"));
+
+namespace SuperBlock {
+
+void annotateBranchWeights(Function &F, const BranchProbabilityInfo &BPI,
+                           const BlockFrequencyInfo &BFI) {
+  if (!LayoutSB || !F.getEntryCount()) {
+    return;
+  }
+  for (BasicBlock &BB : F) {
+    Instruction *term = BB.getTerminator();
+    if (!term || term->getNumSuccessors() < 2 ||
+        !(isa<BranchInst>(term) || isa<SwitchInst>(term)) ||
+        term->getMetadata(LLVMContext::MD_prof)) {
+      continue;
+    }
+    // Counts where the profile has them, so later stages can split them
+    // between copies; bare probabilities in blocks it never reached.
+    uint64_t count = BFI.getBlockProfileCount(&BB).getValueOr(0);
+    SmallVector<uint64_t, 4> weights;
+    for (unsigned i = 0, e = term->getNumSuccessors(); i != e; ++i) {
+      BranchProbability P = BPI.getEdgeProbability(&BB, i);
+      weights.push_back(count ? P.scale(count) : P.getNumerator());
+    }
+    setBranchWeights(term, weights);
+  }
+}
+
+
+bool layoutSuperblocks(Function &F, ArrayRef<vector<BasicBlock*>> Traces) {
+  if (!LayoutSB || Traces.empty()) {
+    return false;
+  }
+  vector<BasicBlock*> order;
+  SmallPtrSet<const BasicBlock*, 32> placed;
+  auto place = [&](ArrayRef<BasicBlock*> Blocks) {
+    for (BasicBlock *BB : Blocks) {
+      if (placed.insert(BB).second) {
+        order.push_back(BB);
+      }
+    }
+  };
+  BasicBlock *entry = &F.getEntryBlock();
+  for (const vector<BasicBlock*> &T : Traces) {
+    if (!T.empty() && T.front() == entry) {
+      place(T);
+    }
+  }
+  place(entry);
+  for (const vector<BasicBlock*> &T : Traces) {
+    place(T);
+  }
+  for (BasicBlock &BB : F) {
+    if (!placed.count(&BB)) {
+      order.push_back(&BB);
+    }
+  }
+
+  bool changed = false;
+  for (unsigned i = 1; i < order.size(); ++i) {
+    if (order[i]->getPrevNode() != order[i - 1]) {
+      order[i]->moveAfter(order[i - 1]);
+      changed = true;
+    }
+  }
+  return changed;
+}
+
+} // end of namespace SuperBlock
@@ -0,0 +1,47 @@
+//===-- SB_LAYOUT.h - Trace-ordered block layout ---------------------------===//
+//
+// CloneBasicBlock() appends every copy at the end of the function, so after
+// tail duplication a superblock is spread over the whole function and its
+// in-trace edges are no longer fall-throughs. layoutSuperblocks() puts the
+// blocks back in trace order. The code generator's block placement starts
+// from the IR order and weighs edges by their branch_weights, so both have to
+// agree on the hot path; annotateBranchWeights() makes the profile explicit
+// on every branch before anything is cloned, so the copies carry it too.
+//
+//===----------------------------------------------------------------------===//
+#ifndef SB_LAYOUT_H
+#define SB_LAYOUT_H
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/IR/BasicBlock.h"
+
+#include <vector>
+
+namespace llvm {
+class BlockFrequencyInfo;
+class BranchProbabilityInfo;
+class Function;
+} // end of namespace llvm
+
+namespace SuperBlock {
+// Gives every branch and switch of a profiled F (one with an entry count)
+// that has no branch_weights the probabilities BPI computed for it, scaled by
+// the block's profile count. Existing weights are measured, and stay; a
+// function without a profile is left alone, so BPI's static guesses never
+// pass for measured data. Call it before the CFG changes: BPI knows nothing
+// about blocks created later. The weights only restate what BPI already
+// says, so this is not a change of F by itself. Does nothing under
+// -sb-layout=false.
+void annotateBranchWeights(llvm::Function &F, const llvm::BranchProbabilityInfo &BPI,
+                           const llvm::BlockFrequencyInfo &BFI);
+
+// Reorders the blocks of F so each trace is contiguous, in the order given
+// (hottest first, as traces are formed), with the trace holding the entry
+// block first. Blocks in no trace, such as the originals left behind for
+// side entrances, keep their relative order after the last trace. Returns
+// true if any block moved; does nothing under -sb-layout=false.
+bool layoutSuperblocks(llvm::Function &F,
+                       llvm::ArrayRef<std::vector<llvm::BasicBlock *>> Traces);
+} // end of namespace SuperBlock
+
+#endif
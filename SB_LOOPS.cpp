@@ -0,0 +1,404 @@
+//===-- SB_LOOPS.cpp - Loop transforms on superblocks ---------------------===//
+//
+// See SB_LOOPS.h.
+//
+//===----------------------------------------------------------------------===//
+#include "llvm/ADT/SetVector.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/DomTreeUpdater.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+
+#include "SB_BUDGET.h"
+#include "SB_LOOPS.h"
+#include "SB_UTILS.h"
+
+#include <memory>
+
+using namespace llvm;
+using namespace std;
+
+static cl::opt<unsigned> UnrollMaxFactor("sb-unroll-max-factor", cl::init(4),
+    cl::desc("Most iterations a superblock loop is unrolled to (1 disables)"));
+
+static cl::opt<unsigned> UnrollMaxSize("sb-unroll-max-size", cl::init(200),
+    cl::desc("Most instructions superblock loop unrolling may add per loop"));
+
+static cl::opt<unsigned> PeelMaxCount("sb-peel-max-count", cl::init(2),
+    cl::desc("Most iterations peeled off a short-running loop (0 disables)"));
+
+static cl::opt<unsigned> PeelMaxSize("sb-peel-max-size", cl::init(150),
+    cl::desc("Most instructions superblock loop peeling may add per loop"));
+
+namespace SuperBlock {
+
+double profiledTripCount(const Loop *L, BlockFrequencyInfo &BFI) {
+  BasicBlock *preheader = L->getLoopPreheader();
+  if (!preheader) {
+    return 0;
+  }
+  uint64_t entries = BFI.getBlockFreq(preheader).getFrequency();
+  if (entries == 0) {
+    return 0;
+  }
+  return double(BFI.getBlockFreq(L->getHeader()).getFrequency()) / entries;
+}
+
+
+// End (inclusive) of the loop body that starts at the header Trace[H]: the
+// last block of the run of superblock blocks of the same loop that branches
+// back to the header, or -1 if there is none. Only that latch may branch to
+// the header, and only along one edge.
+static int loopBodyEnd(const vector<BasicBlock*> &Trace, unsigned H, LoopInfo &LI) {
+  BasicBlock *header = Trace[H];
+  Loop *L = LI.getLoopFor(header);
+  int end = -1;
+  for (unsigned i = H; i < Trace.size(); ++i) {
+    BasicBlock *BB = Trace[i];
+    if (LI.getLoopFor(BB) != L || !canDuplicateBlock(BB) ||
+        (i > H && BB->getSinglePredecessor() != Trace[i - 1])) {
+      break;
+    }
+    unsigned backedges = count(successors(BB), header);
+    if (backedges > 1) {
+      break;
+    }
+    if (backedges == 1) {
+      end = i;
+      break;
+    }
+  }
+  return end;
+}
+
+
+// Translates V through the copy made with VMap (null for the original).
+static Value *inCopy(Value *V, const ValueToValueMapTy *VMap) {
+  if (!VMap) {
+    return V;
+  }
+  Value *mapped = VMap->lookup(V);
+  return mapped ? mapped : V;
+}
+
+
+// Unrolls Trace[H..E] (header to latch) Factor times; see SB_LOOPS.h.
+static void unrollTraceLoop(vector<BasicBlock*> &Trace, unsigned H, unsigned E,
+                            unsigned Factor, DomTreeUpdater &DTU, LoopInfo &LI) {
+  SmallVector<BasicBlock*, 8> origBBs(Trace.begin() + H, Trace.begin() + E + 1);
+  BasicBlock *header = origBBs.front();
+  BasicBlock *latch = origBBs.back();
+  Loop *L = LI.getLoopFor(header);
+  Function *Parent = header->getParent();
+
+  // Copy c (1 <= c < Factor) is Copies[c - 1]; every block of the body is in
+  // its map, so edges inside the body stay inside the copy.
+  vector<unique_ptr<ValueToValueMapTy>> Maps;
+  vector<SmallVector<BasicBlock*, 8>> Copies;
+  for (unsigned c = 1; c < Factor; ++c) {
+    Maps.push_back(make_unique<ValueToValueMapTy>());
+    ValueToValueMapTy &VMap = *Maps.back();
+    Copies.emplace_back();
+    for (BasicBlock *BB : origBBs) {
+      BasicBlock *NewBB = CloneBasicBlock(BB, VMap, ".u" + Twine(c), Parent);
+      VMap[BB] = NewBB;
+      L->addBasicBlockToLoop(NewBB, LI);
+      Copies.back().push_back(NewBB);
+    }
+    for (BasicBlock *NewBB : Copies.back()) {
+      for (Instruction &II : *NewBB) {
+        RemapInstruction(&II, VMap, RF_NoModuleLevelChanges | RF_IgnoreMissingLocals);
+      }
+    }
+  }
+
+  // Chain the copies: latch -> copy 1 -> ... -> copy Factor-1 -> header. The
+  // header of copy c is only entered from the latch of copy c - 1.
+  SmallVector<DominatorTree::UpdateType, 16> updates;
+  for (unsigned c = 0; c < Copies.size(); ++c) {
+    BasicBlock *prevLatch = c == 0 ? latch : Copies[c - 1].back();
+    const ValueToValueMapTy *prevMap = c == 0 ? nullptr : Maps[c - 1].get();
+    BasicBlock *copyHeader = Copies[c].front();
+    auto origIt = header->phis().begin();
+    for (PHINode &PN : copyHeader->phis()) {
+      PHINode &origPN = *origIt++;
+      Value *V = inCopy(origPN.getIncomingValueForBlock(latch), prevMap);
+      for (unsigned i = PN.getNumIncomingValues(); i-- > 0;) {
+        PN.removeIncomingValue(i, false);
+      }
+      PN.addIncoming(V, prevLatch);
+    }
+    if (c == 0) {
+      latch->getTerminator()->replaceSuccessorWith(header, copyHeader);
+    } else {
+      // The copied backedge was remapped onto the copy's own header.
+      prevLatch->getTerminator()->replaceSuccessorWith(Copies[c - 1].front(), copyHeader);
+    }
+  }
+  BasicBlock *lastLatch = Copies.back().back();
+  lastLatch->getTerminator()->replaceSuccessorWith(Copies.back().front(), header);
+  for (PHINode &PN : header->phis()) {
+    Value *V = inCopy(PN.getIncomingValueForBlock(latch), Maps.back().get());
+    PN.removeIncomingValue(latch, false);
+    PN.addIncoming(V, lastLatch);
+  }
+
+  // Side exits of the copies are new edges into blocks off the trace.
+  SmallPtrSet<BasicBlock*, 8> chained;
+  chained.insert(header);
+  for (auto &copy : Copies) {
+    chained.insert(copy.front());
+  }
+  for (unsigned c = 0; c < Copies.size(); ++c) {
+    for (unsigned i = 0; i < origBBs.size(); ++i) {
+      BasicBlock *copyBB = Copies[c][i];
+      SmallPtrSet<BasicBlock*, 4> seen;
+      for (BasicBlock *succ : successors(copyBB)) {
+        if (seen.insert(succ).second) {
+          updates.push_back({DominatorTree::Insert, copyBB, succ});
+        }
+        if (chained.count(succ) || (i + 1 < origBBs.size() && succ == Copies[c][i + 1])) {
+          continue;
+        }
+        for (PHINode &PN : succ->phis()) {
+          PN.addIncoming(inCopy(PN.getIncomingValueForBlock(origBBs[i]), Maps[c].get()), copyBB);
+        }
+      }
+    }
+  }
+  updates.push_back({DominatorTree::Delete, latch, header});
+  updates.push_back({DominatorTree::Insert, latch, Copies.front().front()});
+  DTU.applyUpdates(updates);
+
+  // Every value of the body now has Factor definitions.
+  SmallVector<const ValueToValueMapTy*, 4> maps;
+  for (auto &VMap : Maps) {
+    maps.push_back(VMap.get());
+  }
+  repairSSA(origBBs, maps);
+
+  vector<BasicBlock*> unrolled;
+  for (auto &copy : Copies) {
+    unrolled.insert(unrolled.end(), copy.begin(), copy.end());
+  }
+  Trace.insert(Trace.begin() + E + 1, unrolled.begin(), unrolled.end());
+}
+
+
+bool unrollSuperblockLoops(vector<vector<BasicBlock*>> &Traces, BlockFrequencyInfo &BFI,
+                           DomTreeUpdater &DTU, LoopInfo &LI) {
+  bool changed = false;
+  for (vector<BasicBlock*> &Trace : Traces) {
+    for (unsigned h = 0; h < Trace.size(); ++h) {
+      Loop *L = LI.getLoopFor(Trace[h]);
+      if (!L || L->getHeader() != Trace[h]) {
+        continue;
+      }
+      int e = loopBodyEnd(Trace, h, LI);
+      if (e < 0) {
+        continue;
+      }
+      unsigned size = 0;
+      for (int i = h; i <= e; ++i) {
+        size += Trace[i]->size();
+      }
+      unsigned factor = min<double>(UnrollMaxFactor, profiledTripCount(L, BFI));
+      while (factor > 1 && (factor - 1) * size > UnrollMaxSize) {
+        --factor;
+      }
+      if (factor < 2) {
+        continue;
+      }
+      unrollTraceLoop(Trace, h, e, factor, DTU, LI);
+      changed = true;
+      // The copies hold no further headers.
+      h = e + (factor - 1) * (e - h + 1);
+    }
+  }
+  return changed;
+}
+
+
+// Peels Count iterations off the innermost loop L; see SB_LOOPS.h. Returns
+// the copies, each holding a clone of every block of L in L's block order
+// (header first), and the maps they were made with.
+static void peelLoop(Loop *L, unsigned Count, DomTreeUpdater &DTU, LoopInfo &LI,
+                     vector<SmallVector<BasicBlock*, 8>> &Copies,
+                     vector<unique_ptr<ValueToValueMapTy>> &Maps) {
+  BasicBlock *header = L->getHeader();
+  BasicBlock *preheader = L->getLoopPreheader();
+  SmallVector<BasicBlock*, 8> loopBBs(L->block_begin(), L->block_end());
+  // getLoopLatches() lists a latch once per edge to the header; keep each
+  // once and count its edges where the header PHIs need them.
+  SmallVector<BasicBlock*, 4> latchEdges;
+  L->getLoopLatches(latchEdges);
+  SmallSetVector<BasicBlock*, 4> latches(latchEdges.begin(), latchEdges.end());
+  Loop *Parent = L->getParentLoop();
+  Function *F = header->getParent();
+
+  for (unsigned c = 1; c <= Count; ++c) {
+    Maps.push_back(make_unique<ValueToValueMapTy>());
+    ValueToValueMapTy &VMap = *Maps.back();
+    Copies.emplace_back();
+    for (BasicBlock *BB : loopBBs) {
+      BasicBlock *NewBB = CloneBasicBlock(BB, VMap, ".p" + Twine(c), F);
+      VMap[BB] = NewBB;
+      if (Parent) {
+        Parent->addBasicBlockToLoop(NewBB, LI);
+      }
+      Copies.back().push_back(NewBB);
+    }
+    for (BasicBlock *NewBB : Copies.back()) {
+      for (Instruction &II : *NewBB) {
+        RemapInstruction(&II, VMap, RF_NoModuleLevelChanges | RF_IgnoreMissingLocals);
+      }
+    }
+  }
+
+  // preheader -> copy 1 -> ... -> copy Count -> header. Every backedge of a
+  // copy was remapped onto its own header and moves on to the next one. A
+  // latch may branch to the header along several edges (a switch with two
+  // cases to it); the header PHIs take one entry per edge.
+  auto addLatchEntries = [&](PHINode &PN, PHINode &OrigPN, const ValueToValueMapTy &VMap) {
+    for (BasicBlock *latch : latches) {
+      Value *V = inCopy(OrigPN.getIncomingValueForBlock(latch), &VMap);
+      BasicBlock *copyLatch = cast<BasicBlock>(VMap.lookup(latch));
+      for (unsigned n = count(successors(latch), header); n > 0; --n) {
+        PN.addIncoming(V, copyLatch);
+      }
+    }
+  };
+  SmallPtrSet<BasicBlock*, 8> chained;
+  chained.insert(header);
+  for (unsigned c = 0; c < Count; ++c) {
+    BasicBlock *copyHeader = Copies[c].front();
+    chained.insert(copyHeader);
+    auto origIt = header->phis().begin();
+    for (PHINode &PN : copyHeader->phis()) {
+      PHINode &origPN = *origIt++;
+      for (unsigned i = PN.getNumIncomingValues(); i-- > 0;) {
+        PN.removeIncomingValue(i, false);
+      }
+      if (c == 0) {
+        PN.addIncoming(origPN.getIncomingValueForBlock(preheader), preheader);
+        continue;
+      }
+      addLatchEntries(PN, origPN, *Maps[c - 1]);
+    }
+    BasicBlock *next = c + 1 < Count ? Copies[c + 1].front() : header;
+    for (BasicBlock *latch : latches) {
+      cast<BasicBlock>((*Maps[c])[latch])->getTerminator()->replaceSuccessorWith(copyHeader, next);
+    }
+  }
+  preheader->getTerminator()->replaceSuccessorWith(header, Copies.front().front());
+  for (PHINode &PN : header->phis()) {
+    PN.removeIncomingValue(preheader, false);
+    addLatchEntries(PN, PN, *Maps.back());
+  }
+
+  // Edges leaving a copy for an exit of L are new.
+  SmallVector<DominatorTree::UpdateType, 16> updates;
+  for (unsigned c = 0; c < Count; ++c) {
+    SmallPtrSet<BasicBlock*, 8> inCopyBBs(Copies[c].begin(), Copies[c].end());
+    for (unsigned i = 0; i < loopBBs.size(); ++i) {
+      BasicBlock *copyBB = Copies[c][i];
+      SmallPtrSet<BasicBlock*, 4> seen;
+      for (BasicBlock *succ : successors(copyBB)) {
+        if (seen.insert(succ).second) {
+          updates.push_back({DominatorTree::Insert, copyBB, succ});
+        }
+        if (inCopyBBs.count(succ) || chained.count(succ)) {
+          continue;
+        }
+        for (PHINode &PN : succ->phis()) {
+          PN.addIncoming(inCopy(PN.getIncomingValueForBlock(loopBBs[i]), Maps[c].get()), copyBB);
+        }
+      }
+    }
+  }
+  updates.push_back({DominatorTree::Delete, preheader, header});
+  updates.push_back({DominatorTree::Insert, preheader, Copies.front().front()});
+  DTU.applyUpdates(updates);
+
+  SmallVector<const ValueToValueMapTy*, 4> maps;
+  for (auto &VMap : Maps) {
+    maps.push_back(VMap.get());
+  }
+  repairSSA(loopBBs, maps);
+}
+
+
+bool peelSuperblockLoops(vector<vector<BasicBlock*>> &Traces, BlockFrequencyInfo &BFI,
+                         const TargetTransformInfo &TTI, DupBudget &Budget,
+                         DomTreeUpdater &DTU, LoopInfo &LI) {
+  bool changed = false;
+  for (Loop *L : LI.getLoopsInPreorder()) {
+    BasicBlock *preheader = L->getLoopPreheader();
+    if (!L->isInnermost() || !preheader || !isa<BranchInst>(preheader->getTerminator()) ||
+        !all_of(L->blocks(), canDuplicateBlock)) {
+      continue;
+    }
+    unsigned size = 0;
+    for (BasicBlock *BB : L->blocks()) {
+      size += BB->size();
+    }
+    // Long-running loops are left to the unroller.
+    double trips = profiledTripCount(L, BFI) + 0.5;
+    if (trips >= PeelMaxCount + 1) {
+      continue;
+    }
+    unsigned count = trips;
+    if (count == 0 || count * size > PeelMaxSize) {
+      continue;
+    }
+
+    // The hot path through L, if a superblock covers it from the header to
+    // the latch, and the place after the preheader in its own trace.
+    vector<BasicBlock*> *loopTrace = nullptr, *preTrace = nullptr;
+    int h = -1, e = -1, p = -1;
+    for (vector<BasicBlock*> &Trace : Traces) {
+      for (unsigned i = 0; i < Trace.size(); ++i) {
+        if (Trace[i] == L->getHeader()) {
+          loopTrace = &Trace;
+          h = i;
+        } else if (Trace[i] == preheader) {
+          preTrace = &Trace;
+          p = i;
+        }
+      }
+    }
+    if (loopTrace) {
+      e = loopBodyEnd(*loopTrace, h, LI);
+    }
+    vector<BasicBlock*> hotPath;
+    if (e >= 0) {
+      hotPath.assign(loopTrace->begin() + h, loopTrace->begin() + e + 1);
+    }
+    // Only superblocks gain from the copies.
+    if (!preTrace || hotPath.empty() || !Budget.admit(priceLoopPeel(*L, count, BFI, TTI))) {
+      continue;
+    }
+
+    vector<SmallVector<BasicBlock*, 8>> Copies;
+    vector<unique_ptr<ValueToValueMapTy>> Maps;
+    peelLoop(L, count, DTU, LI, Copies, Maps);
+    changed = true;
+
+    // The peeled hot paths run on from the preheader's superblock.
+    vector<BasicBlock*> peeled;
+    for (auto &VMap : Maps) {
+      for (BasicBlock *BB : hotPath) {
+        peeled.push_back(cast<BasicBlock>((*VMap)[BB]));
+      }
+    }
+    preTrace->insert(preTrace->begin() + p + 1, peeled.begin(), peeled.end());
+  }
+  return changed;
+}
+
+} // end of namespace SuperBlock
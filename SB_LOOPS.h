@@ -0,0 +1,63 @@
+//===-- SB_LOOPS.h - Loop transforms on superblocks -----------------------===//
+//
+// Trace formation stops at backedges, so a hot loop body becomes one
+// superblock that branches back to the header on every iteration. The
+// transforms here make superblocks span several iterations instead.
+//
+//===----------------------------------------------------------------------===//
+#ifndef SB_LOOPS_H
+#define SB_LOOPS_H
+
+#include "llvm/IR/BasicBlock.h"
+
+#include <vector>
+
+namespace llvm {
+class BlockFrequencyInfo;
+class DomTreeUpdater;
+class Loop;
+class LoopInfo;
+class TargetTransformInfo;
+} // end of namespace llvm
+
+namespace SuperBlock {
+class DupBudget;
+
+// Average number of header executions per entry into L, from BFI. Returns 0
+// if L has no preheader or BFI does not know it (a block made after BFI ran).
+double profiledTripCount(const llvm::Loop *L, llvm::BlockFrequencyInfo &BFI);
+
+// Superblock loop unrolling. A trace that runs from a loop header to a latch
+// of the same loop without leaving it (every block but the header entered
+// only from the block before it, as tailDuplicateTrace() leaves them) is
+// copied N - 1 times. Each copy is entered from the latch of the one before,
+// and the last one branches back to the header. Side exits of the copies go
+// to the same blocks as the original's. N comes from the profiled trip count
+// and is capped by -sb-unroll-max-factor and -sb-unroll-max-size.
+//
+// The copies are inserted into the trace after the latch, so the superblock
+// covers N iterations. BFI must describe the function as it was when the
+// traces were formed; DTU and LI are kept up to date. Returns true if any
+// loop was unrolled.
+bool unrollSuperblockLoops(std::vector<std::vector<llvm::BasicBlock *>> &Traces,
+                           llvm::BlockFrequencyInfo &BFI,
+                           llvm::DomTreeUpdater &DTU, llvm::LoopInfo &LI);
+
+// Superblock loop peeling. An innermost loop whose profiled trip count rounds
+// to K, 1 <= K <= -sb-peel-max-count, which a superblock covers from header
+// to latch and whose preheader is in a superblock, gets its first K
+// iterations peeled off: K copies of the whole loop run in a row between the
+// preheader and the header, each exiting wherever the loop does. The copies
+// of the superblock are inserted into the preheader's trace right after the
+// preheader, so the peeled iterations merge with the code leading into the
+// loop. Peeling grows the code like tail duplication does, so Budget must
+// admit the priceLoopPeel() of each loop first.
+//
+// Run it before unrollSuperblockLoops(): a peeled loop is entered from a new
+// block BFI does not know, so the unroller leaves it alone.
+bool peelSuperblockLoops(std::vector<std::vector<llvm::BasicBlock *>> &Traces,
+                         llvm::BlockFrequencyInfo &BFI, const llvm::TargetTransformInfo &TTI,
+                         DupBudget &Budget, llvm::DomTreeUpdater &DTU, llvm::LoopInfo &LI);
+} // end of namespace SuperBlock
+
+#endif
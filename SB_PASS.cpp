@@ -23,6 +23,7 @@
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/Support/Debug.h"
+#include "llvm/Support/Format.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Transforms/Scalar/LoopPassManager.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
@@ -34,7 +35,30 @@
 
 /* *******Implementation Starts Here******* */
 #include <bits/stdc++.h>
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/IR/ModuleSlotTracker.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/IR/Dominators.h"
+#include "llvm/Analysis/DomTreeUpdater.h"
+#include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
+#include "SB_BUDGET.h"
+#include "SB_EXPAND.h"
+#include "SB_HYPER.h"
+#include "SB_LAYOUT.h"
+#include "SB_LOOPS.h"
+#include "SB_PLUGIN.h"
+#include "SB_PRESSURE.h"
+#include "SB_PROFILE.h"
+#include "SB_SCHED.h"
+#include "SB_SELECT.h"
+#include "SB_SPLIT.h"
+#include "SB_SWITCH.h"
+#include "SB_THRESHOLD.h"
+#include "SB_TRACE.h"
+#include "SB_TREEGION.h"
+#include "SB_UTILS.h"
 /* *******Implementation Ends Here******* */
 
 using namespace llvm;
@@ -42,24 +66,178 @@ using namespace std;
 
 #define DEBUG_TYPE "fplicm"
 
+static cl::opt<bool> PrintTraces("sb-print-traces", cl::init(false), cl::Hidden,
+    cl::desc("Print every trace formed by -psbpass/-rsbpass and every "
+             "treegion formed by -tsbpass to stderr"));
+
+static cl::opt<bool> Hyperblock("sb-hyperblock", cl::init(false),
+    cl::desc("If-convert short unbiased hammocks before -psbpass forms traces"));
+
+static cl::opt<unsigned> MaxTraceLength("sb-max-trace-length", cl::init(0),
+    cl::desc("Most blocks -psbpass/-rsbpass put in one trace (0: no limit)"));
+
+static cl::opt<unsigned> SwitchThreshold("sb-switch-threshold", cl::init(30),
+    cl::desc("How likely (percent) the hottest case of a switch must be for "
+             "-psbpass to grow a trace into it, if below the trace threshold"));
+
 
 namespace SuperBlock { 
-struct PSBPass : public FunctionPass {
+
+// Greedy trace growth shared by PSBPass and RSBPass: seed with the hottest
+// block not yet in a trace, grow forward with best_successor, then backward
+// with best_predecessor, up to -sb-max-trace-length blocks. Sel only decides
+// which neighbour to take.
+template <class Selector>
+TraceSet formTraces(const TraceGraph &G, Selector &Sel) {
+  TraceSet TS(G);
+  
+  // while (there are unvisited nodes) do  
+  for (unsigned seed : G.hottestFirst()) {
+    // seed = unvisited BB with largest execution freq
+    if (TS.TraceOf[seed] >= 0) {
+      continue;
+    }
+    int traceCnt = TS.Traces.size();
+    
+    //trace[i] += seed
+    deque<BasicBlock*> curTrace;
+    curTrace.push_back(G.Blocks[seed]);
+    TS.TraceOf[seed] = traceCnt;
+    
+    auto full = [&]() { return MaxTraceLength && curTrace.size() >= MaxTraceLength; };
+
+    // Grow Trace Forward
+    unsigned cur = seed;
+    while (!full()) {
+      unsigned next = Sel.best_successor(cur, TS.TraceOf);
+      if (next == NoBlock) {
+        break;
+      }
+      curTrace.push_back(G.Blocks[next]);
+      TS.TraceOf[next] = traceCnt;
+      cur = next;
+    }
+    
+    // Grow trace backward analogously 
+    cur = seed;
+    while (!full()) {
+      unsigned prev = Sel.best_predecessor(cur, TS.TraceOf);
+      if (prev == NoBlock) {
+        break;
+      }
+      curTrace.push_front(G.Blocks[prev]);
+      TS.TraceOf[prev] = traceCnt;
+      cur = prev;
+    }
+    
+    // Add current trace to traces collection
+    TS.Traces.emplace_back(curTrace.begin(), curTrace.end());
+  }
+  return TS;
+}
+
+
+// Traces of G as the pass with trace selector Sel forms them: grown by Sel
+// itself, or built by the -sb-selector algorithm if the pass takes one.
+template <class Selector>
+TraceSet selectTraces(const TraceGraph &G, Selector &Sel) {
+  TraceSelector algo = traceSelector(*G.Blocks.front()->getParent());
+  if (Selector::PluggableSelection && algo != TraceSelector::Greedy) {
+    return formChainedTraces(G, algo, MaxTraceLength);
+  }
+  return formTraces(G, Sel);
+}
+
+
+// One function between the two halves of PSBPass and RSBPass: its traces,
+// selected on the CFG the first half left (hyperblocks formed, hot switch
+// cases split off), and what tail duplicating each of them would cost, so the
+// module's budget is computed from exactly the duplications the second half
+// makes.
+struct FunctionTraces {
+  Function *F;
+  unique_ptr<TraceGraph> Graph;  // TS refers to it
+  TraceSet TS;
+  vector<DupCandidate> Prices;   // one per trace of TS
+  bool Modified = false;         // by the first half
+
+  FunctionTraces(Function &F, unique_ptr<TraceGraph> Graph, TraceSet TS)
+      : F(&F), Graph(std::move(Graph)), TS(std::move(TS)) {}
+};
+
+
+// The analyses of one function that PSBPass and RSBPass run on, from either
+// pass manager.
+struct SBAnalyses {
+  BranchProbabilityInfo &bpi;
+  BlockFrequencyInfo &bfi;
+  DominatorTree &dt;
+  LoopInfo &li;
+  AAResults &aa;
+  const TargetTransformInfo &tti;
+};
+
+
+// Runs P (a PSBPass or RSBPass) on every function of M under one tail
+// duplication budget: the first half of the pass on every function, then the
+// budget over all of their priced duplications, then the second half on every
+// function. Analyses(F) returns the SBAnalyses of F; it is asked again for
+// the second half, as a legacy pass manager on-the-fly analysis only
+// describes the function last asked for. Changed(F) is called for every
+// function the pass changed. Returns true if it changed any.
+template <class SBPass, class AnalysesFn, class ChangedFn>
+bool runOnModuleImpl(SBPass &P, Module &M, AnalysesFn Analyses, ChangedFn Changed) {
+  vector<FunctionTraces> funcs;
+  uint64_t size = 0;
+  vector<DupCandidate> candidates;
+  for (Function &F : M) {
+    if (F.isDeclaration()) {
+      continue;
+    }
+    SBAnalyses A = Analyses(F);
+    funcs.push_back(P.selectSuperblocks(F, A.bpi, A.bfi, A.dt, A.li, A.tti));
+    size += codeSize(F, A.tti);
+    candidates.insert(candidates.end(), funcs.back().Prices.begin(), funcs.back().Prices.end());
+  }
+  DupBudget budget(size, std::move(candidates));
+
+  bool modified = false;
+  for (FunctionTraces &FT : funcs) {
+    SBAnalyses A = Analyses(*FT.F);
+    if (P.formSuperblocks(FT, A.bpi, A.bfi, A.dt, A.li, A.aa, A.tti, budget)) {
+      Changed(*FT.F);
+      modified = true;
+    }
+  }
+  return modified;
+}
+
+
+struct PSBPass : public ModulePass {
   static char ID;
-  const static int THRESHOLD = 60;
-  PSBPass() : FunctionPass(ID) {}
+  const static bool SplitByPressure = true;   // see SB_PRESSURE.h
+  const static bool AdaptiveThreshold = true; // see SB_THRESHOLD.h
+  const static bool PluggableSelection = true; // -sb-selector, see SB_SELECT.h
+  unsigned Threshold = 60;                    // trace growth threshold, percent
+  const TraceGraph *G = nullptr;
+  PSBPass() : ModulePass(ID) {}
 
   // Specify the vector of analysis passes that will be used inside your pass.
   void getAnalysisUsage(AnalysisUsage &AU) const {
     AU.addRequired<BlockFrequencyInfoWrapperPass>(); // Analysis pass to load block execution count
     AU.addRequired<BranchProbabilityInfoWrapperPass>(); // Analysis pass to load branch probability
     AU.addRequired<DominatorTreeWrapperPass>();
+    AU.addRequired<LoopInfoWrapperPass>();
+    AU.addRequired<AAResultsWrapperPass>(); // memory dependences for scheduling
+    AU.addRequired<TargetTransformInfoWrapperPass>(); // instruction latencies
   }
   
   
   ///////////////  Start   //////////////////
-  void printTraces(vector<vector<BasicBlock*>> traces) {
-    // TODO: delete
+  void printTraces(const vector<vector<BasicBlock*>>& traces) {
+    if (traces.empty()) {
+      return;
+    }
     for (auto& itt: traces) {
       errs() << "/////////   TRACE   ///////////\n";
       for (auto& itb: itt) {
@@ -67,10 +245,16 @@ struct PSBPass : public FunctionPass {
       }
     } 
     
+    // One slot tracker for the whole function; printing each block on its
+    // own would renumber the function every time.
+    Function *F = traces.front().front()->getParent();
+    ModuleSlotTracker MST(F->getParent());
+    MST.incorporateFunction(*F);
     for (auto& itt: traces) {
       errs() << "/////////   TRACE   ///////////\n";
       for (auto& itb: itt) {
-        errs() << *itb << "\n////////////\n";
+        static_cast<Value*>(itb)->print(errs(), MST);
+        errs() << "\n////////////\n";
       }
     }    
   }
@@ -82,237 +266,191 @@ struct PSBPass : public FunctionPass {
       errs() << succ << "\n";
     } 
   }
-  
-  
-  static bool cmpval(pair<BasicBlock*, uint64_t>& a, pair<BasicBlock*, uint64_t>& b) {
-    return a.second > b.second;
-  }
-    
-    
-  vector<pair<BasicBlock*, uint64_t>> mapsort(map<BasicBlock*, uint64_t>& Map) {
-    vector<pair<BasicBlock*, uint64_t>> VM;
-    for (auto& it: Map) {
-      VM.push_back(it);
-    } 
-    std::sort(VM.begin(), VM.end(), cmpval);
-    return VM;
-  }
-
-
-  BasicBlock* best_successor(BasicBlock* CurBB, map<BasicBlock*, int> VisitMap) {
-    BranchProbabilityInfo &bpi = getAnalysis<BranchProbabilityInfoWrapperPass>().getBPI();
-    DominatorTree &dt = getAnalysis<DominatorTreeWrapperPass>().getDomTree(); 
 
-    // errs() << "********************\n Best Sucessor \n" << *CurBB; 
-    // errs() << "\nThreshold" << BranchProbability(THRESHOLD, 100) << "\n ******************************"; 
 
-    for (BasicBlock *Succ : successors(CurBB)) {
-      const BasicBlock* cCurBB = CurBB;
-      const BasicBlock* cSucc = Succ;
-      if (dt.dominates(cSucc, cCurBB)) {
-        // errs() << "BsetSucc Found Backedge: \n" << *CurBB << "------>\n" << *Succ << "\n";
+  unsigned best_successor(unsigned CurBB, const vector<int>& TraceOf) {
+    // A switch spreads its probability over many cases, so no single one
+    // clears the threshold; follow the hottest case if it is hot enough.
+    if (G->Blocks[CurBB]->getTerminator()->getNumSuccessors() > 2) {
+      const TraceEdge *hottest = nullptr;
+      for (const TraceEdge &E : G->Succs[CurBB]) {
+        if (!hottest || E.Prob > hottest->Prob) {
+          hottest = &E;
+        }
+      }
+      unsigned bar = min<unsigned>(Threshold, SwitchThreshold);
+      if (!hottest || hottest->Backedge || TraceOf[hottest->BB] >= 0 ||
+          !(hottest->Prob > BranchProbability(bar, 100))) {
+        return NoBlock;
+      }
+      return hottest->BB;
+    }
+    for (const TraceEdge &E : G->Succs[CurBB]) {
+      if (E.Backedge) {
         continue; 
       }
-      if (VisitMap[Succ] > 0) {  // d is visited
+      if (TraceOf[E.BB] >= 0) {  // d is visited
         continue; 
       }
-      auto prob = bpi.getEdgeProbability(CurBB, Succ);
-      // errs() << "------------Probability: " << prob << "\n" << *Succ << "\n\n"; 
-      if (prob > BranchProbability(THRESHOLD, 100)){
-        return Succ;
+      if (E.Prob > BranchProbability(Threshold, 100)){
+        return E.BB;
       }
     }
-    return NULL;
+    return NoBlock;
   }
   
   
-  BasicBlock* best_predecessor(BasicBlock* CurBB, map<BasicBlock*, int> VisitMap,
-                               map<BasicBlock*, uint64_t> ProfileMap) {
-    BranchProbabilityInfo &bpi = getAnalysis<BranchProbabilityInfoWrapperPass>().getBPI();
-    DominatorTree &dt = getAnalysis<DominatorTreeWrapperPass>().getDomTree();
-    // errs() << "********************\n Best Predecessor \n" << *CurBB << "\n ******************************"; 
-
-    for (BasicBlock *Pred : predecessors(CurBB)) {
-      const BasicBlock* cCurBB = CurBB;
-      const BasicBlock* cPred = Pred;
-      if (dt.dominates(cCurBB, cPred)) {
-        // errs() << "BestPred Found Backedge: \n" << *Pred << "------>\n" << *CurBB << "\n";
+  unsigned best_predecessor(unsigned CurBB, const vector<int>& TraceOf) {
+    for (const TraceEdge &E : G->Preds[CurBB]) {
+      if (E.Backedge) {
         continue; 
       }
-      if (VisitMap[Pred] > 0) {  // p is visited
+      if (TraceOf[E.BB] >= 0) {  // p is visited
         continue; 
       }
-      auto prob = bpi.getEdgeProbability(Pred, CurBB);
       float predWeight = static_cast<float>( 
-          ProfileMap[Pred]
-          * static_cast<uint64_t>(prob.getNumerator()) 
-          / static_cast<uint64_t>(prob.getDenominator()) );
-      float predPercent = predWeight / static_cast<float>(ProfileMap[CurBB]);
-      // errs() << "------------Probability: " << predPercent << "\n" << *Pred << "\n\n"; 
-      if (predPercent > static_cast<float>(THRESHOLD / 100.0)){
-        return Pred; 
+          G->Count[E.BB]
+          * static_cast<uint64_t>(E.Prob.getNumerator()) 
+          / static_cast<uint64_t>(E.Prob.getDenominator()) );
+      float predPercent = predWeight / static_cast<float>(G->Count[CurBB]);
+      if (predPercent > static_cast<float>(Threshold / 100.0)){
+        return E.BB; 
       }
     }
-    return NULL;
+    return NoBlock;
   }
   
   
-  bool tailDuplication(vector<vector<BasicBlock*>> traces, map<BasicBlock*, int> TraceMap, Function* Parent) {
-    // copied BB 
-    map<BasicBlock*, BasicBlock*> copiedMap;
-    ValueToValueMapTy VMap;
+  // Only the duplications the cost model admits within the module's budget,
+  // at the prices the first half put on them.
+  bool tailDuplication(FunctionTraces& FT, DupBudget& budget, DomTreeUpdater& DTU, LoopInfo& LI) {
     bool modified = false;
-    bool doCopy = false; 
-    BasicBlock* prevCopiedBB; 
-    for (auto& curTrace: traces) {
-      doCopy = false; 
-      BasicBlock* prevBB = *curTrace.begin(); 
-      for (auto it = next(curTrace.begin()); it != curTrace.end(); ++it) {  // Ignore first BB
-        BasicBlock* originalBB = *it;
-        if (!doCopy) {  // detect first side entrance 
-          for (auto pred : predecessors(originalBB)) {
-            // if predecessor not in trace, side entrance 
-            if (TraceMap[pred] != TraceMap[originalBB]) {
-              modified = true;
-              doCopy = true; 
-
-              // copy first original block  
-              BasicBlock* clonedBB = CloneBasicBlock(originalBB, VMap, "", Parent); 
-              
-              // find predecessor in trace, connect predecessor and copy 
-              Instruction* term = prevBB->getTerminator(); 
-              // set prevBB's successor
-              // find idx of origBB in trace, substitute with copiedBB
-              unsigned idx = 0;
-              for (auto succ : successors(prevBB)) {
-                if (succ == originalBB) {
-                  break;
-                }
-                idx++;
-              }
-              term->setSuccessor(idx, clonedBB);
-              
-              for (Instruction &II : *clonedBB) {
-                RemapInstruction(&II, VMap, RF_IgnoreMissingLocals);
-              }
-              
-              // remove edge between predecessor and original 
-              // errs()<< "\noriginal basic block \n" << *originalBB << "\n";
-              // errs()<< "\nclone basic block \n" << *clonedBB << "\n";
-              
-              prevCopiedBB = clonedBB; 
-              break; 
-            }
-          }
-          // No side entrace for current BB, update previously BB 
-          prevBB = originalBB; 
-        } 
-        // tail portion 
-        else {
-          // Copy current BB
-          BasicBlock* clonedBB = CloneBasicBlock(originalBB, VMap, "", Parent);
-          
-          // previously copied BB connects to copied BB 
-          // remove edge between previously copied and current copied BB
-          Instruction* term = prevCopiedBB->getTerminator();
-          unsigned idx = 0;
-          for (auto succ : successors(prevCopiedBB)) {
-            if (succ == originalBB) {
-              break;
-            }
-            idx++;
-          }
-          term->setSuccessor(idx, clonedBB);
-          
-          for (Instruction &II : *clonedBB) {
-            RemapInstruction(&II, VMap, RF_IgnoreMissingLocals);
-          }
-
-          // prev = cur
-          prevCopiedBB = clonedBB; 
-        }
+    TraceSet& TS = FT.TS;
+    auto traceOf = [&](const BasicBlock *BB) { return TS.traceOf(BB); };
+    for (unsigned t = 0; t < TS.Traces.size(); ++t) {
+      if (budget.admit(FT.Prices[t])) {
+        modified |= tailDuplicateTrace(TS.Traces[t], traceOf, &DTU, &LI);
       }
     }
-  
     return modified;
   }
 
+  bool runOnModule(Module &M) override {
+    // Each getAnalysis(F) reruns all of them on F; the last leaves them in step.
+    auto analyses = [&](Function &F) {
+      return SBAnalyses{getAnalysis<BranchProbabilityInfoWrapperPass>(F).getBPI(),
+                        getAnalysis<BlockFrequencyInfoWrapperPass>(F).getBFI(),
+                        getAnalysis<DominatorTreeWrapperPass>(F).getDomTree(),
+                        getAnalysis<LoopInfoWrapperPass>(F).getLoopInfo(),
+                        getAnalysis<AAResultsWrapperPass>(F).getAAResults(),
+                        getAnalysis<TargetTransformInfoWrapperPass>().getTTI(F)};
+    };
+    return runOnModuleImpl(*this, M, analyses, [](Function &) {});
+  }
 
-  bool runOnFunction(Function &F) override {
-    map<BasicBlock*, uint64_t> ProfileMap;
-    map<BasicBlock*, int> VisitMap;
-    map<BasicBlock*, int> TraceMap; 
-    vector<vector<BasicBlock*>> traces;
-    int traceCnt = 0;
-
-    // Create objects for each analysis pass
-    BranchProbabilityInfo &bpi = getAnalysis<BranchProbabilityInfoWrapperPass>().getBPI(); 
-    BlockFrequencyInfo &bfi = getAnalysis<BlockFrequencyInfoWrapperPass>().getBFI();
-    DominatorTree &dt = getAnalysis<DominatorTreeWrapperPass>().getDomTree();    
-    
-    // Mark all BBs unvisited
-    for (Function::iterator it = F.begin(), e = F.end(); it != e; ++it) {
-      BasicBlock& BB = *it;
-      uint64_t blockCount = bfi.getBlockProfileCount(&BB).getValue();
-      
-      ProfileMap[&BB] = blockCount;
-      VisitMap[&BB] = 0;
-    }
-    // Sort ProfileMap, highest freq to lowest
-    vector<pair<BasicBlock*, uint64_t>> sortedBBs = mapsort(ProfileMap);
-    
-    // while (there are unvisited nodes) do  
-    for (auto& it: sortedBBs) {   
-      // seed = unvisited BB with largest execution freq
-      BasicBlock* seedBB = it.first;
-      // errs() << *seedBB << "\ncnt: " << it.second << "\n\n";  
-      if (VisitMap[seedBB] > 0) {
-        continue;
-      }
-      
-      //trace[i] += seed
-      vector<BasicBlock*> curTrace;
-      curTrace.push_back(seedBB);
-      TraceMap[seedBB] = traceCnt; 
-      // errs() << "TRACE " << traceCnt << curTrace[0] << "\n";
-      
-      // mark seed visited
-      VisitMap[seedBB] = 1;
-      BasicBlock* curBB = seedBB;
-      // Grow Trace Forward
-      while(true) {
-        BasicBlock* next = best_successor(curBB, VisitMap);
-        if (next == NULL) {
-          break;
-        }
-        curTrace.push_back(next);
-        TraceMap[next] = traceCnt; 
-        VisitMap[next] = 1;
-        curBB = next;
-      }
-      
-      // Grow trace backward analogously 
-      curBB = seedBB;
-      while(true) {
-        BasicBlock* prev = best_predecessor(curBB, VisitMap, ProfileMap);
-        if (prev == NULL) {
-          break;
-        }
-        curTrace.insert(curTrace.begin(), prev);
-         TraceMap[prev] = traceCnt; 
-        VisitMap[prev] = 1;
-        curBB = prev;
+
+  // F alone, under a budget for F alone: the new pass manager wrapper in a
+  // function pipeline (function(psbpass), -sb-ep-pipeline).
+  bool runImpl(Function &F, BranchProbabilityInfo &bpi, BlockFrequencyInfo &bfi, DominatorTree &dt, LoopInfo &li,
+               AAResults &aa, const TargetTransformInfo &tti) {
+    FunctionTraces FT = selectSuperblocks(F, bpi, bfi, dt, li, tti);
+    DupBudget budget(codeSize(F, tti), FT.Prices);
+    return formSuperblocks(FT, bpi, bfi, dt, li, aa, tti, budget);
+  }
+
+
+  // The first half, up to tail duplication: selects the traces of F and
+  // prices their duplication.
+  FunctionTraces selectSuperblocks(Function &F, BranchProbabilityInfo &bpi, BlockFrequencyInfo &bfi,
+                                   DominatorTree &dt, LoopInfo &li, const TargetTransformInfo &tti) {
+    // THRESHOLD: how biased an edge must be for a trace to grow along it
+    OptimizationRemarkEmitter ORE(&F, &bfi);
+    Threshold = selectThreshold(F, bpi, bfi, &ORE, "psbpass");
+
+    // HYPERBLOCK FORMATION: unbiased hammocks would end every trace that
+    // reaches them; if-convert the cheap ones so traces run through.
+    bool modified = false;
+    if (Hyperblock) {
+      DomTreeUpdater HDTU(dt, DomTreeUpdater::UpdateStrategy::Lazy);
+      modified = formHyperblocks(F, bpi, Threshold, HDTU, li);
+      HDTU.flush();
+      if (modified) {
+        bpi.releaseMemory();
+        bpi.calculate(F, li, nullptr, &dt, nullptr);
+        bfi.releaseMemory();
+        bfi.calculate(F, bpi, li);
       }
-      
-      // Add current trace to traces collection
-      traceCnt++;
-      traces.push_back(curTrace);
+    }
+
+    auto graph = make_unique<TraceGraph>(F, bpi, bfi, dt);
+    G = graph.get();
+    FunctionTraces FT(F, std::move(graph), selectTraces(*G, *this));
+    G = nullptr;
+    TraceSet &TS = FT.TS;
+
+    // REGISTER PRESSURE: end traces where their values stop fitting
+    if (splitTracesByPressure(TS.Traces, tti, &ORE, "psbpass")) {
+      TS.renumber();
     }
     
     // After TRACE FORMATION,
     // TAIL DUPLICATION
-    printTraces(traces);
-    return tailDuplication(traces, TraceMap, &F);
+    if (PrintTraces) {
+      printTraces(TS.Traces);
+    }
+    DomTreeUpdater DTU(dt, DomTreeUpdater::UpdateStrategy::Lazy);
+    annotateBranchWeights(F, bpi, bfi);
+    // SWITCH SPLITTING: the case a trace follows gets its own branch
+    modified |= splitHotSwitchCases(TS.Traces, bpi, DTU, li);
+    DTU.flush();
+    FT.Modified = modified;
+
+    // Priced on the CFG they will be duplicated on.
+    auto traceOf = [&](const BasicBlock *BB) { return TS.traceOf(BB); };
+    for (auto& curTrace: TS.Traces) {
+      FT.Prices.push_back(priceTailDuplication(curTrace, traceOf, bpi, bfi, li, tti));
+    }
+    return FT;
+  }
+
+
+  // The second half: the duplications of FT that budget admits and all that
+  // follows them.
+  bool formSuperblocks(FunctionTraces &FT, BranchProbabilityInfo &bpi, BlockFrequencyInfo &bfi,
+                       DominatorTree &dt, LoopInfo &li, AAResults &aa, const TargetTransformInfo &tti,
+                       DupBudget &budget) {
+    Function &F = *FT.F;
+    TraceSet &TS = FT.TS;
+    // dt and li follow every clone; the lazy updater batches the dominator
+    // tree edits of all traces into one update.
+    DomTreeUpdater DTU(dt, DomTreeUpdater::UpdateStrategy::Lazy);
+    bool modified = FT.Modified;
+    modified |= tailDuplication(FT, budget, DTU, li);
+
+    // BRANCH TARGET EXPANSION
+    modified |= expandSuperblocks(TS.Traces, bpi, DTU, li);
+
+    // SUPERBLOCK LOOP PEELING AND UNROLLING
+    modified |= peelSuperblockLoops(TS.Traces, bfi, tti, budget, DTU, li);
+    modified |= unrollSuperblockLoops(TS.Traces, bfi, DTU, li);
+    DTU.flush();
+
+    // SUPERBLOCK SCHEDULING
+    modified |= scheduleSuperblocks(TS.Traces, aa, tti, li);
+
+    // LAYOUT: each superblock contiguous, hottest first
+    modified |= layoutSuperblocks(F, TS.Traces);
+
+    // PROFILE: split the counts between the copies
+    if (modified) {
+      updateProfileCounts(F, dt, li, bpi, bfi);
+    }
+
+    // HOT/COLD SPLITTING: record the traces for sb-hot-cold-split, which
+    // moves whole cold traces and cold leftovers out; metadata only, so not
+    // a change
+    markTraces(F, TS.Traces);
+    return modified;
 
     //////////////    END    ////////////////
   }
@@ -321,22 +459,31 @@ struct PSBPass : public FunctionPass {
 
 
 // Random Super Block
-struct RSBPass : public FunctionPass {
+struct RSBPass : public ModulePass {
 static char ID;
-  const static int THRESHOLD = 60;
-  RSBPass() : FunctionPass(ID) {}
+  const static bool SplitByPressure = false;
+  const static bool AdaptiveThreshold = false; // successors are picked at random
+  const static bool PluggableSelection = false;
+  unsigned Threshold = 60;
+  const TraceGraph *G = nullptr;
+  RSBPass() : ModulePass(ID) {}
 
   // Specify the vector of analysis passes that will be used inside your pass.
   void getAnalysisUsage(AnalysisUsage &AU) const {
     AU.addRequired<BlockFrequencyInfoWrapperPass>(); // Analysis pass to load block execution count
     AU.addRequired<BranchProbabilityInfoWrapperPass>(); // Analysis pass to load branch probability
     AU.addRequired<DominatorTreeWrapperPass>();
+    AU.addRequired<LoopInfoWrapperPass>();
+    AU.addRequired<AAResultsWrapperPass>(); // memory dependences for scheduling
+    AU.addRequired<TargetTransformInfoWrapperPass>(); // instruction latencies
   }
   
   
   ///////////////  Start   //////////////////
-  void printTraces(vector<vector<BasicBlock*>> traces) {
-    // TODO: delete
+  void printTraces(const vector<vector<BasicBlock*>>& traces) {
+    if (traces.empty()) {
+      return;
+    }
     for (auto& itt: traces) {
       errs() << "/////////   TRACE   ///////////\n";
       for (auto& itb: itt) {
@@ -344,10 +491,16 @@ static char ID;
       }
     } 
     
+    // One slot tracker for the whole function; printing each block on its
+    // own would renumber the function every time.
+    Function *F = traces.front().front()->getParent();
+    ModuleSlotTracker MST(F->getParent());
+    MST.incorporateFunction(*F);
     for (auto& itt: traces) {
       errs() << "/////////   TRACE   ///////////\n";
       for (auto& itb: itt) {
-        errs() << *itb << "\n////////////\n";
+        static_cast<Value*>(itb)->print(errs(), MST);
+        errs() << "\n////////////\n";
       }
     }    
   }
@@ -359,226 +512,138 @@ static char ID;
       errs() << succ << "\n";
     } 
   }
-  
-  
-  static bool cmpval(pair<BasicBlock*, uint64_t>& a, pair<BasicBlock*, uint64_t>& b) {
-    return a.second > b.second;
-  }
-    
-    
-  vector<pair<BasicBlock*, uint64_t>> mapsort(map<BasicBlock*, uint64_t>& Map) {
-    vector<pair<BasicBlock*, uint64_t>> VM;
-    for (auto& it: Map) {
-      VM.push_back(it);
-    } 
-    std::sort(VM.begin(), VM.end(), cmpval);
-    return VM;
-  }
 
 
-  BasicBlock* best_successor(BasicBlock* CurBB, map<BasicBlock*, int> VisitMap) {
-    BranchProbabilityInfo &bpi = getAnalysis<BranchProbabilityInfoWrapperPass>().getBPI();
-    DominatorTree &dt = getAnalysis<DominatorTreeWrapperPass>().getDomTree();
-    if (succ_size(CurBB) == 0) {
-      return NULL;
+  unsigned best_successor(unsigned CurBB, const vector<int>& TraceOf) {
+    const auto &succs = G->Succs[CurBB];
+    if (succs.empty()) {
+      return NoBlock;
     }
-    int randIdx = rand() % succ_size(CurBB);
-    auto CandPtr = next(succ_begin(CurBB), randIdx);
-    BasicBlock* Cand = *CandPtr;
-    errs() << "********************\n Best Successor \n" << randIdx << "\n" << *Cand << "\n ******************************";
-    const BasicBlock* cCurBB = CurBB;
-    const BasicBlock* cSucc = Cand;
-    if (dt.dominates(cSucc, cCurBB)) {
-      // errs() << "BsetSucc Found Backedge: \n" << *CurBB << "------>\n" << *Succ << "\n";
-      return NULL; 
+    int randIdx = rand() % succs.size();
+    const TraceEdge &Cand = succs[randIdx];
+    errs() << "********************\n Best Successor \n" << randIdx << "\n" << *G->Blocks[Cand.BB] << "\n ******************************";
+    if (Cand.Backedge) {
+      return NoBlock; 
     }
-    if (VisitMap[Cand] > 0) {  // d is visited
-      return NULL; 
+    if (TraceOf[Cand.BB] >= 0) {  // d is visited
+      return NoBlock; 
     }
-    return Cand;
+    return Cand.BB;
   }
   
   
-  BasicBlock* best_predecessor(BasicBlock* CurBB, map<BasicBlock*, int> VisitMap,
-                               map<BasicBlock*, uint64_t> ProfileMap) {
-    BranchProbabilityInfo &bpi = getAnalysis<BranchProbabilityInfoWrapperPass>().getBPI();
-    DominatorTree &dt = getAnalysis<DominatorTreeWrapperPass>().getDomTree();
-    if (pred_size(CurBB) == 0) {
-      return NULL;
+  unsigned best_predecessor(unsigned CurBB, const vector<int>& TraceOf) {
+    const auto &preds = G->Preds[CurBB];
+    if (preds.empty()) {
+      return NoBlock;
     }
-    int randIdx = rand() % pred_size(CurBB);
-    auto CandPtr = next(pred_begin(CurBB), randIdx);
-    BasicBlock* Cand = *CandPtr;
-    errs() << "********************\n Best Predecessor \n" << randIdx << "\n" << *Cand << "\n ******************************";
-    const BasicBlock* cCurBB = CurBB;
-    const BasicBlock* cPred = Cand;
-    if (dt.dominates(cCurBB, cPred)) {
-      // errs() << "BestPred Found Backedge: \n" << *Pred << "------>\n" << *CurBB << "\n";
-      return NULL;; 
+    int randIdx = rand() % preds.size();
+    const TraceEdge &Cand = preds[randIdx];
+    errs() << "********************\n Best Predecessor \n" << randIdx << "\n" << *G->Blocks[Cand.BB] << "\n ******************************";
+    if (Cand.Backedge) {
+      return NoBlock;
     }
-    if (VisitMap[Cand] > 0) {  // p is visited
-      return NULL;; 
+    if (TraceOf[Cand.BB] >= 0) {  // p is visited
+      return NoBlock;
     }
-    return Cand;
+    return Cand.BB;
   }
   
   
-  bool tailDuplication(vector<vector<BasicBlock*>> traces, map<BasicBlock*, int> TraceMap, Function* Parent) {
-    // copied BB 
-    map<BasicBlock*, BasicBlock*> copiedMap;
-    ValueToValueMapTy VMap;
+  // Only the duplications the cost model admits within the module's budget,
+  // at the prices the first half put on them.
+  bool tailDuplication(FunctionTraces& FT, DupBudget& budget, DomTreeUpdater& DTU, LoopInfo& LI) {
     bool modified = false;
-    bool doCopy = false; 
-    BasicBlock* prevCopiedBB; 
-    for (auto& curTrace: traces) {
-      doCopy = false; 
-      BasicBlock* prevBB = *curTrace.begin(); 
-      for (auto it = next(curTrace.begin()); it != curTrace.end(); ++it) {  // Ignore first BB
-        BasicBlock* originalBB = *it;
-        if (!doCopy) {  // detect first side entrance 
-          for (auto pred : predecessors(originalBB)) {
-            // if predecessor not in trace, side entrance 
-            if (TraceMap[pred] != TraceMap[originalBB]) {
-              modified = true;
-              doCopy = true; 
-
-              // copy first original block  
-              BasicBlock* clonedBB = CloneBasicBlock(originalBB, VMap, "", Parent); 
-              
-              // find predecessor in trace, connect predecessor and copy 
-              Instruction* term = prevBB->getTerminator(); 
-              // set prevBB's successor
-              // find idx of origBB in trace, substitute with copiedBB
-              unsigned idx = 0;
-              for (auto succ : successors(prevBB)) {
-                if (succ == originalBB) {
-                  break;
-                }
-                idx++;
-              }
-              term->setSuccessor(idx, clonedBB);
-              
-              for (Instruction &II : *clonedBB) {
-                RemapInstruction(&II, VMap, RF_IgnoreMissingLocals);
-              }
-              
-              // remove edge between predecessor and original 
-              // errs()<< "\noriginal basic block \n" << *originalBB << "\n";
-              // errs()<< "\nclone basic block \n" << *clonedBB << "\n";
-              
-              prevCopiedBB = clonedBB; 
-              break; 
-            }
-          }
-          // No side entrace for current BB, update previously BB 
-          prevBB = originalBB; 
-        } 
-        // tail portion 
-        else {
-          // Copy current BB
-          BasicBlock* clonedBB = CloneBasicBlock(originalBB, VMap, "", Parent);
-          
-          // previously copied BB connects to copied BB 
-          // remove edge between previously copied and current copied BB
-          Instruction* term = prevCopiedBB->getTerminator();
-          unsigned idx = 0;
-          for (auto succ : successors(prevCopiedBB)) {
-            if (succ == originalBB) {
-              break;
-            }
-            idx++;
-          }
-          term->setSuccessor(idx, clonedBB);
-          
-          for (Instruction &II : *clonedBB) {
-            RemapInstruction(&II, VMap, RF_IgnoreMissingLocals);
-          }
-
-          // prev = cur
-          prevCopiedBB = clonedBB; 
-        }
+    TraceSet& TS = FT.TS;
+    auto traceOf = [&](const BasicBlock *BB) { return TS.traceOf(BB); };
+    for (unsigned t = 0; t < TS.Traces.size(); ++t) {
+      if (budget.admit(FT.Prices[t])) {
+        modified |= tailDuplicateTrace(TS.Traces[t], traceOf, &DTU, &LI);
       }
     }
-  
     return modified;
   }
 
+  bool runOnModule(Module &M) override {
+    // Each getAnalysis(F) reruns all of them on F; the last leaves them in step.
+    auto analyses = [&](Function &F) {
+      return SBAnalyses{getAnalysis<BranchProbabilityInfoWrapperPass>(F).getBPI(),
+                        getAnalysis<BlockFrequencyInfoWrapperPass>(F).getBFI(),
+                        getAnalysis<DominatorTreeWrapperPass>(F).getDomTree(),
+                        getAnalysis<LoopInfoWrapperPass>(F).getLoopInfo(),
+                        getAnalysis<AAResultsWrapperPass>(F).getAAResults(),
+                        getAnalysis<TargetTransformInfoWrapperPass>().getTTI(F)};
+    };
+    return runOnModuleImpl(*this, M, analyses, [](Function &) {});
+  }
 
-  bool runOnFunction(Function &F) override {
-    map<BasicBlock*, uint64_t> ProfileMap;
-    map<BasicBlock*, int> VisitMap;
-    map<BasicBlock*, int> TraceMap; 
-    vector<vector<BasicBlock*>> traces;
-    int traceCnt = 0;
-
-    // Create objects for each analysis pass
-    BranchProbabilityInfo &bpi = getAnalysis<BranchProbabilityInfoWrapperPass>().getBPI(); 
-    BlockFrequencyInfo &bfi = getAnalysis<BlockFrequencyInfoWrapperPass>().getBFI();
-    DominatorTree &dt = getAnalysis<DominatorTreeWrapperPass>().getDomTree();    
-    
-    // Mark all BBs unvisited
-    for (Function::iterator it = F.begin(), e = F.end(); it != e; ++it) {
-      BasicBlock& BB = *it;
-      uint64_t blockCount = bfi.getBlockProfileCount(&BB).getValue();
-      
-      ProfileMap[&BB] = blockCount;
-      VisitMap[&BB] = 0;
-    }
-    // Sort ProfileMap, highest freq to lowest
-    vector<pair<BasicBlock*, uint64_t>> sortedBBs = mapsort(ProfileMap);
-    
-    // while (there are unvisited nodes) do  
-    for (auto& it: sortedBBs) {   
-      // seed = unvisited BB with largest execution freq
-      BasicBlock* seedBB = it.first;
-      // errs() << *seedBB << "\ncnt: " << it.second << "\n\n";  
-      if (VisitMap[seedBB] > 0) {
-        continue;
-      }
-      
-      //trace[i] += seed
-      vector<BasicBlock*> curTrace;
-      curTrace.push_back(seedBB);
-      TraceMap[seedBB] = traceCnt; 
-      // errs() << "TRACE " << traceCnt << curTrace[0] << "\n";
-      
-      // mark seed visited
-      VisitMap[seedBB] = 1;
-      BasicBlock* curBB = seedBB;
-      // Grow Trace Forward
-      while(true) {
-        BasicBlock* next = best_successor(curBB, VisitMap);
-        if (next == NULL) {
-          break;
-        }
-        curTrace.push_back(next);
-        TraceMap[next] = traceCnt; 
-        VisitMap[next] = 1;
-        curBB = next;
-      }
-      
-      // Grow trace backward analogously 
-      curBB = seedBB;
-      while(true) {
-        BasicBlock* prev = best_predecessor(curBB, VisitMap, ProfileMap);
-        if (prev == NULL) {
-          break;
-        }
-        curTrace.insert(curTrace.begin(), prev);
-         TraceMap[prev] = traceCnt; 
-        VisitMap[prev] = 1;
-        curBB = prev;
-      }
-      
-      // Add current trace to traces collection
-      traceCnt++;
-      traces.push_back(curTrace);
-    }
+
+  // F alone, under a budget for F alone: the new pass manager wrapper in a
+  // function pipeline (function(rsbpass), -sb-ep-pipeline).
+  bool runImpl(Function &F, BranchProbabilityInfo &bpi, BlockFrequencyInfo &bfi, DominatorTree &dt, LoopInfo &li,
+               AAResults &aa, const TargetTransformInfo &tti) {
+    FunctionTraces FT = selectSuperblocks(F, bpi, bfi, dt, li, tti);
+    DupBudget budget(codeSize(F, tti), FT.Prices);
+    return formSuperblocks(FT, bpi, bfi, dt, li, aa, tti, budget);
+  }
+
+
+  // The first half, up to tail duplication: selects the traces of F and
+  // prices their duplication.
+  FunctionTraces selectSuperblocks(Function &F, BranchProbabilityInfo &bpi, BlockFrequencyInfo &bfi,
+                                   DominatorTree &dt, LoopInfo &li, const TargetTransformInfo &tti) {
+    auto graph = make_unique<TraceGraph>(F, bpi, bfi, dt);
+    G = graph.get();
+    FunctionTraces FT(F, std::move(graph), selectTraces(*G, *this));
+    G = nullptr;
+    TraceSet &TS = FT.TS;
     
     // After TRACE FORMATION,
     // TAIL DUPLICATION
-    printTraces(traces);
-    return tailDuplication(traces, TraceMap, &F);
+    if (PrintTraces) {
+      printTraces(TS.Traces);
+    }
+    annotateBranchWeights(F, bpi, bfi);
+
+    auto traceOf = [&](const BasicBlock *BB) { return TS.traceOf(BB); };
+    for (auto& curTrace: TS.Traces) {
+      FT.Prices.push_back(priceTailDuplication(curTrace, traceOf, bpi, bfi, li, tti));
+    }
+    return FT;
+  }
+
+
+  // The second half: the duplications of FT that budget admits and all that
+  // follows them.
+  bool formSuperblocks(FunctionTraces &FT, BranchProbabilityInfo &bpi, BlockFrequencyInfo &bfi,
+                       DominatorTree &dt, LoopInfo &li, AAResults &aa, const TargetTransformInfo &tti,
+                       DupBudget &budget) {
+    Function &F = *FT.F;
+    TraceSet &TS = FT.TS;
+    // dt and li follow every clone; the lazy updater batches the dominator
+    // tree edits of all traces into one update.
+    DomTreeUpdater DTU(dt, DomTreeUpdater::UpdateStrategy::Lazy);
+    bool modified = tailDuplication(FT, budget, DTU, li);
+
+    // BRANCH TARGET EXPANSION
+    modified |= expandSuperblocks(TS.Traces, bpi, DTU, li);
+
+    // SUPERBLOCK LOOP PEELING AND UNROLLING
+    modified |= peelSuperblockLoops(TS.Traces, bfi, tti, budget, DTU, li);
+    modified |= unrollSuperblockLoops(TS.Traces, bfi, DTU, li);
+    DTU.flush();
+
+    // SUPERBLOCK SCHEDULING
+    modified |= scheduleSuperblocks(TS.Traces, aa, tti, li);
+
+    // LAYOUT: each superblock contiguous, hottest first
+    modified |= layoutSuperblocks(F, TS.Traces);
+
+    // PROFILE: split the counts between the copies
+    if (modified) {
+      updateProfileCounts(F, dt, li, bpi, bfi);
+    }
+    return modified;
 
     //////////////    END    ////////////////
   }
@@ -586,13 +651,203 @@ static char ID;
 }; // end of struct RSBPass
 
 
+// Treegion Super Block: single-entry trees instead of single paths, for
+// branches that are too unbiased for either of the passes above.
+struct TSBPass : public FunctionPass {
+  static char ID;
+  TSBPass() : FunctionPass(ID) {}
+
+  void getAnalysisUsage(AnalysisUsage &AU) const {
+    AU.addRequired<BlockFrequencyInfoWrapperPass>();
+    AU.addRequired<BranchProbabilityInfoWrapperPass>();
+    AU.addRequired<DominatorTreeWrapperPass>();
+    AU.addRequired<LoopInfoWrapperPass>();
+    AU.addRequired<AAResultsWrapperPass>();
+    AU.addRequired<TargetTransformInfoWrapperPass>();
+    AU.addPreserved<DominatorTreeWrapperPass>();
+    AU.addPreserved<LoopInfoWrapperPass>();
+  }
+
+
+  void printTreegions(const vector<Treegion>& treegions) {
+    if (treegions.empty()) {
+      return;
+    }
+    Function *F = treegions.front().Blocks.front()->getParent();
+    ModuleSlotTracker MST(F->getParent());
+    MST.incorporateFunction(*F);
+    for (const Treegion& T: treegions) {
+      errs() << "/////////   TREEGION   ///////////\n";
+      for (unsigned n = 0; n < T.Blocks.size(); ++n) {
+        T.Blocks[n]->printAsOperand(errs(), false, MST);
+        if (T.Parent[n] >= 0) {
+          errs() << " <- ";
+          T.Blocks[T.Parent[n]]->printAsOperand(errs(), false, MST);
+        }
+        errs() << format("  (%.3f)\n", T.Reach[n]);
+      }
+    }
+  }
+
+
+  bool runOnFunction(Function &F) override {
+    BranchProbabilityInfo &bpi = getAnalysis<BranchProbabilityInfoWrapperPass>().getBPI();
+    BlockFrequencyInfo &bfi = getAnalysis<BlockFrequencyInfoWrapperPass>().getBFI();
+    DominatorTree &dt = getAnalysis<DominatorTreeWrapperPass>().getDomTree();
+    LoopInfo &li = getAnalysis<LoopInfoWrapperPass>().getLoopInfo();
+    AAResults &aa = getAnalysis<AAResultsWrapperPass>().getAAResults();
+    TargetTransformInfo &tti = getAnalysis<TargetTransformInfoWrapperPass>().getTTI(F);
+    return runImpl(F, bpi, bfi, dt, li, aa, tti);
+  }
+
+
+  // Shared by the legacy pass and the new pass manager wrapper.
+  bool runImpl(Function &F, BranchProbabilityInfo &bpi, BlockFrequencyInfo &bfi, DominatorTree &dt, LoopInfo &li,
+               AAResults &aa, const TargetTransformInfo &tti) {
+    // TREEGION FORMATION, tail duplicating merge points as it goes
+    DomTreeUpdater DTU(dt, DomTreeUpdater::UpdateStrategy::Lazy);
+    vector<Treegion> treegions;
+    annotateBranchWeights(F, bpi, bfi);
+    bool modified = formTreegions(F, bpi, bfi, DTU, li, treegions);
+    DTU.flush();
+    if (PrintTraces) {
+      printTreegions(treegions);
+    }
+
+    // Every root-to-leaf path of a treegion is a superblock; schedule the
+    // likeliest ones.
+    vector<vector<BasicBlock*>> paths;
+    for (const Treegion& T: treegions) {
+      for (auto& path: T.paths()) {
+        paths.push_back(std::move(path));
+      }
+    }
+    modified |= scheduleSuperblocks(paths, aa, tti, li);
+    modified |= layoutSuperblocks(F, paths);
+    if (modified) {
+      updateProfileCounts(F, dt, li, bpi, bfi);
+    }
+    return modified;
+  }
+
+}; // end of struct TSBPass
+
+
 } // end of namespace Correctness
 
 //char Correctness::FPLICMPass::ID = 0;
 //static RegisterPass<Correctness::FPLICMPass> X("fplicm-correctness", "Frequent Loop Invariant Code Motion for correctness test", false, false);
 
+// New pass manager wrappers. The legacy passes above own the algorithm; these
+// only fetch the same analyses from the FunctionAnalysisManager.
+namespace SuperBlock {
+template <class LegacyPass>
+PreservedAnalyses runSBPass(Function &F, FunctionAnalysisManager &FAM) {
+  LegacyPass P;
+  bool Changed = P.runImpl(F, FAM.getResult<BranchProbabilityAnalysis>(F),
+                           FAM.getResult<BlockFrequencyAnalysis>(F),
+                           FAM.getResult<DominatorTreeAnalysis>(F),
+                           FAM.getResult<LoopAnalysis>(F),
+                           FAM.getResult<AAManager>(F),
+                           FAM.getResult<TargetIRAnalysis>(F));
+  if (!Changed) {
+    return PreservedAnalyses::all();
+  }
+  PreservedAnalyses PA;
+  PA.preserve<DominatorTreeAnalysis>();
+  PA.preserve<LoopAnalysis>();
+  return PA;
+}
+
+// psbpass and rsbpass named at module level: every function under one budget
+// for the whole module, see runOnModuleImpl.
+template <class LegacyPass>
+struct SBModulePassNPM : PassInfoMixin<SBModulePassNPM<LegacyPass>> {
+  PreservedAnalyses run(Module &M, ModuleAnalysisManager &MAM) {
+    FunctionAnalysisManager &FAM = MAM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+    auto analyses = [&](Function &F) {
+      return SBAnalyses{FAM.getResult<BranchProbabilityAnalysis>(F),
+                        FAM.getResult<BlockFrequencyAnalysis>(F),
+                        FAM.getResult<DominatorTreeAnalysis>(F),
+                        FAM.getResult<LoopAnalysis>(F),
+                        FAM.getResult<AAManager>(F),
+                        FAM.getResult<TargetIRAnalysis>(F)};
+    };
+    PreservedAnalyses FPA;
+    FPA.preserve<DominatorTreeAnalysis>();
+    FPA.preserve<LoopAnalysis>();
+    auto changed = [&](Function &F) { FAM.invalidate(F, FPA); };
+    LegacyPass P;
+    if (!runOnModuleImpl(P, M, analyses, changed)) {
+      return PreservedAnalyses::all();
+    }
+    // The functions changed have had their analyses invalidated above.
+    PreservedAnalyses PA;
+    PA.preserveSet<AllAnalysesOn<Function>>();
+    PA.preserve<FunctionAnalysisManagerModuleProxy>();
+    return PA;
+  }
+};
+
+struct PSBPassNPM : PassInfoMixin<PSBPassNPM> {
+  PreservedAnalyses run(Function &F, FunctionAnalysisManager &FAM) {
+    return runSBPass<PSBPass>(F, FAM);
+  }
+};
+
+struct RSBPassNPM : PassInfoMixin<RSBPassNPM> {
+  PreservedAnalyses run(Function &F, FunctionAnalysisManager &FAM) {
+    return runSBPass<RSBPass>(F, FAM);
+  }
+};
+
+struct TSBPassNPM : PassInfoMixin<TSBPassNPM> {
+  PreservedAnalyses run(Function &F, FunctionAnalysisManager &FAM) {
+    return runSBPass<TSBPass>(F, FAM);
+  }
+};
+
+void registerSBPasses(PassBuilder &PB) {
+  PB.registerPipelineParsingCallback(
+      [](StringRef Name, ModulePassManager &MPM, ArrayRef<PassBuilder::PipelineElement>) {
+        if (Name == "psbpass") {
+          MPM.addPass(SBModulePassNPM<PSBPass>());
+          return true;
+        }
+        if (Name == "rsbpass") {
+          MPM.addPass(SBModulePassNPM<RSBPass>());
+          return true;
+        }
+        if (Name == "tsbpass") {
+          MPM.addPass(createModuleToFunctionPassAdaptor(TSBPassNPM()));
+          return true;
+        }
+        return false;
+      });
+  PB.registerPipelineParsingCallback(
+      [](StringRef Name, FunctionPassManager &FPM, ArrayRef<PassBuilder::PipelineElement>) {
+        if (Name == "psbpass") {
+          FPM.addPass(PSBPassNPM());
+          return true;
+        }
+        if (Name == "rsbpass") {
+          FPM.addPass(RSBPassNPM());
+          return true;
+        }
+        if (Name == "tsbpass") {
+          FPM.addPass(TSBPassNPM());
+          return true;
+        }
+        return false;
+      });
+}
+} // end of namespace SuperBlock
+
 char SuperBlock::PSBPass::ID = 0;
 static RegisterPass<SuperBlock::PSBPass> X("psbpass", "Profile Super Block Pass");
 
 char SuperBlock::RSBPass::ID = 1;
 static RegisterPass<SuperBlock::RSBPass> Y("rsbpass", "Random Super Block Pass");
+
+char SuperBlock::TSBPass::ID = 2;
+static RegisterPass<SuperBlock::TSBPass> Z("tsbpass", "Treegion Super Block Pass");
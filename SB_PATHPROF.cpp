@@ -0,0 +1,478 @@
+//===-- SB_PATHPROF.cpp - Ball-Larus path profiling ------------------------===//
+//
+// See SB_PATHPROF.h.
+//
+//===----------------------------------------------------------------------===//
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Pass.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+
+#include <algorithm>
+
+#include "SB_PATHPROF.h"
+#include "SB_PLUGIN.h"
+
+using namespace llvm;
+using namespace std;
+
+static cl::opt<std::string> PathProfile("sb-path-profile", cl::init(""),
+    cl::desc("Path profile written by a -pathprof-gen binary, for -sb-selector=paths"));
+
+static cl::opt<unsigned> MaxPaths("sb-path-max-paths", cl::init(65536),
+    cl::desc("Functions with more acyclic paths than this are not path profiled"));
+
+namespace SuperBlock {
+
+namespace {
+// Ball-Larus numbering of one function. Nodes 0..N-1 are the blocks reachable
+// from the entry block, in topological order of the DAG left once the back
+// edges found by a DFS are removed. Two virtual nodes complete it: Exit, the
+// target of every return and of a dummy edge from each back edge's source,
+// and Entry, the source of the edge to the entry block and of a dummy edge to
+// each back edge's target. Out-edges are numbered so that the sum of the
+// values along a path from Entry to Exit is unique, 0..Total-1.
+struct PathNumbering {
+  struct Edge {
+    unsigned To;
+    uint64_t Val;
+  };
+  vector<BasicBlock*> Blocks;
+  DenseMap<const BasicBlock*, unsigned> Index;
+  vector<SmallVector<Edge, 2>> Out;
+  vector<pair<unsigned, unsigned>> Backedges;
+  uint64_t Total = 0;  // 0 if there are more paths than the limit
+
+  unsigned exitNode() const { return Blocks.size(); }
+  unsigned entryNode() const { return Blocks.size() + 1; }
+
+  PathNumbering(Function &F, uint64_t Limit) {
+    // Iterative DFS over unique successors; an edge to a block still on the
+    // stack is a back edge.
+    DenseMap<BasicBlock*, int> state;  // 1 on the stack, 2 finished
+    vector<BasicBlock*> postorder;
+    vector<pair<BasicBlock*, unsigned>> stack;
+    vector<pair<BasicBlock*, BasicBlock*>> back;
+    BasicBlock *entry = &F.getEntryBlock();
+    stack.push_back({entry, 0});
+    state[entry] = 1;
+    while (!stack.empty()) {
+      BasicBlock *BB = stack.back().first;
+      unsigned &next = stack.back().second;
+      Instruction *term = BB->getTerminator();
+      if (term && next < term->getNumSuccessors()) {
+        BasicBlock *succ = term->getSuccessor(next++);
+        int &s = state[succ];
+        if (s == 1) {
+          back.push_back({BB, succ});
+        } else if (s == 0) {
+          s = 1;
+          stack.push_back({succ, 0});
+        }
+        continue;
+      }
+      state[BB] = 2;
+      postorder.push_back(BB);
+      stack.pop_back();
+    }
+    Blocks.assign(postorder.rbegin(), postorder.rend());
+    for (unsigned i = 0; i < Blocks.size(); ++i) {
+      Index[Blocks[i]] = i;
+    }
+    unsigned N = Blocks.size();
+    Out.resize(N + 2);
+
+    SmallPtrSet<BasicBlock*, 4> toExit, headers;
+    for (auto &edge : back) {
+      if (!count(Backedges, make_pair(Index[edge.first], Index[edge.second]))) {
+        Backedges.push_back({Index[edge.first], Index[edge.second]});
+      }
+      toExit.insert(edge.first);
+    }
+    for (unsigned u = 0; u < N; ++u) {
+      SmallPtrSet<BasicBlock*, 4> seen;
+      for (BasicBlock *succ : successors(Blocks[u])) {
+        if (seen.insert(succ).second && Index[succ] > u) {
+          Out[u].push_back({Index[succ], 0});
+        }
+      }
+      if (succ_empty(Blocks[u]) || toExit.count(Blocks[u])) {
+        Out[u].push_back({exitNode(), 0});
+      }
+    }
+    Out[entryNode()].push_back({0, 0});
+    for (auto &edge : Backedges) {
+      if (headers.insert(Blocks[edge.second]).second) {
+        Out[entryNode()].push_back({edge.second, 0});
+      }
+    }
+
+    // Number of paths from each node to Exit, in reverse topological order,
+    // Entry last.
+    vector<uint64_t> paths(N + 2, 0);
+    paths[exitNode()] = 1;
+    auto number = [&](unsigned u) {
+      uint64_t sum = 0;
+      for (Edge &E : Out[u]) {
+        E.Val = sum;
+        sum += paths[E.To];
+        if (sum > Limit) {
+          return false;
+        }
+      }
+      paths[u] = sum;
+      return true;
+    };
+    for (unsigned u = N; u-- > 0;) {
+      if (!number(u)) {
+        return;
+      }
+    }
+    if (!number(entryNode())) {
+      return;
+    }
+    Total = paths[entryNode()];
+  }
+
+  const Edge *edge(unsigned From, unsigned To) const {
+    for (const Edge &E : Out[From]) {
+      if (E.To == To) {
+        return &E;
+      }
+    }
+    return nullptr;
+  }
+
+  // Identifies the CFG the numbering was made for.
+  uint64_t checksum() const {
+    uint64_t h = 14695981039346656037ull;  // FNV-1a
+    auto mix = [&](uint64_t v) {
+      h ^= v;
+      h *= 1099511628211ull;
+    };
+    mix(Blocks.size());
+    for (const auto &out : Out) {
+      mix(out.size());
+      for (const Edge &E : out) {
+        mix(E.To);
+      }
+    }
+    return h;
+  }
+
+  // Blocks of path Id, first to last; empty if Id is not a path.
+  vector<BasicBlock*> decode(uint64_t Id) const {
+    vector<BasicBlock*> path;
+    if (Id >= Total) {
+      return path;
+    }
+    unsigned node = entryNode();
+    while (node != exitNode()) {
+      const Edge *taken = nullptr;
+      for (const Edge &E : Out[node]) {
+        if (E.Val <= Id && (!taken || E.Val >= taken->Val)) {
+          taken = &E;
+        }
+      }
+      Id -= taken->Val;
+      node = taken->To;
+      if (node != exitNode()) {
+        path.push_back(Blocks[node]);
+      }
+    }
+    return path;
+  }
+};
+} // end of anonymous namespace
+
+
+// Where code for edge From -> To goes: the end of From if that is its only
+// successor, the start of To if From is its only predecessor, otherwise a
+// block split into the edge. Null if the edge cannot be split.
+static Instruction *edgeInsertPoint(BasicBlock *From, BasicBlock *To) {
+  Instruction *term = From->getTerminator();
+  if (all_of(successors(From), [&](BasicBlock *S) { return S == To; })) {
+    return term;
+  }
+  if (all_of(predecessors(To), [&](BasicBlock *P) { return P == From; })) {
+    return &*To->getFirstInsertionPt();
+  }
+  if (isa<IndirectBrInst>(term) || isa<CallBrInst>(term) || To->isEHPad()) {
+    return nullptr;
+  }
+  for (unsigned i = 0, e = term->getNumSuccessors(); i != e; ++i) {
+    if (term->getSuccessor(i) == To) {
+      BasicBlock *split = SplitCriticalEdge(term, i, CriticalEdgeSplittingOptions().setMergeIdenticalEdges());
+      return split ? split->getTerminator() : nullptr;
+    }
+  }
+  return nullptr;
+}
+
+
+static bool canInstrument(Function &F) {
+  for (BasicBlock &BB : F) {
+    if (BB.isEHPad() && !BB.isLandingPad()) {
+      return false;
+    }
+    Instruction *term = BB.getTerminator();
+    if (!term) {
+      return false;
+    }
+    // Edges that may need a split block must be splittable.
+    if (isa<IndirectBrInst>(term) || isa<CallBrInst>(term)) {
+      return false;
+    }
+    for (BasicBlock *succ : successors(&BB)) {
+      if (succ->isEHPad() && pred_size(succ) > 1) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+
+bool instrumentPathProfile(Module &M) {
+  LLVMContext &Ctx = M.getContext();
+  Type *i64 = Type::getInt64Ty(Ctx);
+  Type *i32 = Type::getInt32Ty(Ctx);
+  Type *i8p = Type::getInt8PtrTy(Ctx);
+  FunctionCallee regFn = M.getOrInsertFunction("__sb_pathprof_register", Type::getVoidTy(Ctx),
+                                               i8p, i64, PointerType::getUnqual(i64), i32);
+  struct Registration {
+    Function *F;
+    uint64_t Checksum;
+    GlobalVariable *Counts;
+    uint64_t Paths;
+  };
+  vector<Registration> registered;
+
+  for (Function &F : M) {
+    if (F.isDeclaration() || !canInstrument(F)) {
+      continue;
+    }
+    PathNumbering PN(F, MaxPaths);
+    if (!PN.Total) {
+      continue;
+    }
+
+    // Decide every insertion point first; splitting edges does not change
+    // the numbering, which was taken from the original CFG.
+    struct Action {
+      Instruction *At;
+      int64_t Add = 0;      // path register += Add
+      bool Count = false;   // then counts[register]++
+      int64_t Reset = -1;   // then path register = Reset
+    };
+    vector<Action> actions;
+    for (unsigned u = 0; u < PN.Blocks.size(); ++u) {
+      BasicBlock *BB = PN.Blocks[u];
+      for (const auto &E : PN.Out[u]) {
+        if (E.To != PN.exitNode() && E.Val) {
+          actions.push_back({nullptr, int64_t(E.Val)});
+          actions.back().At = edgeInsertPoint(BB, PN.Blocks[E.To]);
+        }
+      }
+      Instruction *term = BB->getTerminator();
+      if (succ_empty(BB) && !isa<UnreachableInst>(term)) {
+        actions.push_back({term, int64_t(PN.edge(u, PN.exitNode())->Val), true});
+      }
+    }
+    for (auto &edge : PN.Backedges) {
+      int64_t out = PN.edge(edge.first, PN.exitNode())->Val;
+      int64_t in = PN.edge(PN.entryNode(), edge.second)->Val;
+      actions.push_back({edgeInsertPoint(PN.Blocks[edge.first], PN.Blocks[edge.second]), out, true, in});
+    }
+    if (any_of(actions, [](const Action &A) { return !A.At; })) {
+      errs() << "pathprof-gen: cannot instrument every edge of " << F.getName()
+             << "; some paths will not be counted\n";
+    }
+
+    auto *arrayTy = ArrayType::get(i64, PN.Total);
+    auto *counts = new GlobalVariable(M, arrayTy, false, GlobalValue::InternalLinkage,
+                                      ConstantAggregateZero::get(arrayTy), "sb.pathprof." + F.getName());
+    IRBuilder<> B(&*F.getEntryBlock().getFirstInsertionPt());
+    AllocaInst *reg = B.CreateAlloca(i64, nullptr, "sb.path");
+    B.CreateStore(ConstantInt::get(i64, 0), reg);
+    for (const Action &A : actions) {
+      if (!A.At) {
+        continue;
+      }
+      B.SetInsertPoint(A.At);
+      Value *r = B.CreateLoad(i64, reg);
+      if (A.Add) {
+        r = B.CreateAdd(r, ConstantInt::get(i64, A.Add));
+      }
+      if (!A.Count) {
+        B.CreateStore(r, reg);
+        continue;
+      }
+      Value *slot = B.CreateInBoundsGEP(arrayTy, counts, {ConstantInt::get(i64, 0), r});
+      B.CreateStore(B.CreateAdd(B.CreateLoad(i64, slot), ConstantInt::get(i64, 1)), slot);
+      if (A.Reset >= 0) {
+        B.CreateStore(ConstantInt::get(i64, A.Reset), reg);
+      }
+    }
+    registered.push_back({&F, PN.checksum(), counts, PN.Total});
+  }
+  if (registered.empty()) {
+    return false;
+  }
+
+  // One constructor hands every counter array to the runtime.
+  Function *ctor = Function::Create(FunctionType::get(Type::getVoidTy(Ctx), false),
+                                    GlobalValue::InternalLinkage, "sb.pathprof.init", M);
+  IRBuilder<> B(BasicBlock::Create(Ctx, "entry", ctor));
+  for (const Registration &R : registered) {
+    B.CreateCall(regFn, {B.CreateGlobalStringPtr(R.F->getName()), ConstantInt::get(i64, R.Checksum),
+                         B.CreateConstInBoundsGEP2_64(R.Counts->getValueType(), R.Counts, 0, 0),
+                         ConstantInt::get(i32, R.Paths)});
+  }
+  B.CreateRetVoid();
+  appendToGlobalCtors(M, ctor, 0);
+  return true;
+}
+
+
+namespace {
+struct ProfiledFunction {
+  uint64_t Checksum = 0;
+  uint64_t Paths = 0;
+  DenseMap<uint64_t, uint64_t> Counts;
+};
+} // end of anonymous namespace
+
+// -sb-path-profile, read on first use. The runtime appends one record per
+// function per run; records of the same CFG add up.
+static const StringMap<ProfiledFunction> &loadPathProfile() {
+  static StringMap<ProfiledFunction> Profile;
+  static bool Loaded = false;
+  if (Loaded || PathProfile.empty()) {
+    return Profile;
+  }
+  Loaded = true;
+  auto Buf = MemoryBuffer::getFile(PathProfile);
+  if (!Buf) {
+    errs() << "-sb-path-profile: cannot read " << PathProfile << ": " << Buf.getError().message() << "\n";
+    return Profile;
+  }
+  SmallVector<StringRef, 64> Lines;
+  (*Buf)->getBuffer().split(Lines, '\n', -1, false);
+  ProfiledFunction *cur = nullptr;
+  for (StringRef Line : Lines) {
+    SmallVector<StringRef, 4> Fields;
+    Line.split(Fields, ' ', -1, false);
+    if (Fields.size() == 4 && Fields[0] == "fn") {
+      uint64_t checksum = 0, paths = 0;
+      Fields[2].getAsInteger(10, checksum);
+      Fields[3].getAsInteger(10, paths);
+      cur = &Profile[Fields[1]];
+      if (cur->Checksum != checksum || cur->Paths != paths) {
+        *cur = ProfiledFunction();
+        cur->Checksum = checksum;
+        cur->Paths = paths;
+      }
+      continue;
+    }
+    uint64_t id = 0, count = 0;
+    if (cur && Fields.size() == 2 && !Fields[0].getAsInteger(10, id) && !Fields[1].getAsInteger(10, count)) {
+      cur->Counts[id] += count;
+    }
+  }
+  return Profile;
+}
+
+
+// F's record in -sb-path-profile, if it was taken from F's current CFG.
+static const ProfiledFunction *lookup(Function &F, const PathNumbering &PN) {
+  const auto &Profile = loadPathProfile();
+  auto it = Profile.find(F.getName());
+  if (it == Profile.end() || !PN.Total || it->second.Checksum != PN.checksum() ||
+      it->second.Paths != PN.Total) {
+    return nullptr;
+  }
+  return &it->second;
+}
+
+
+bool hasPathProfile(Function &F) {
+  if (PathProfile.empty()) {
+    return false;
+  }
+  PathNumbering PN(F, ~0ull >> 1);
+  return lookup(F, PN) != nullptr;
+}
+
+
+vector<pair<uint64_t, vector<BasicBlock*>>> hotPaths(Function &F) {
+  vector<pair<uint64_t, vector<BasicBlock*>>> result;
+  if (PathProfile.empty()) {
+    return result;
+  }
+  PathNumbering PN(F, ~0ull >> 1);
+  const ProfiledFunction *PF = lookup(F, PN);
+  if (!PF) {
+    return result;
+  }
+  vector<pair<uint64_t, uint64_t>> byCount;  // (count, id)
+  for (auto &entry : PF->Counts) {
+    if (entry.second) {
+      byCount.push_back({entry.second, entry.first});
+    }
+  }
+  std::sort(byCount.begin(), byCount.end(), [](const pair<uint64_t, uint64_t> &A, const pair<uint64_t, uint64_t> &B) {
+    return A.first != B.first ? A.first > B.first : A.second < B.second;
+  });
+  for (auto &entry : byCount) {
+    auto path = PN.decode(entry.second);
+    if (!path.empty()) {
+      result.push_back({entry.first, std::move(path)});
+    }
+  }
+  return result;
+}
+
+
+namespace {
+struct PathProfileGenNPM : PassInfoMixin<PathProfileGenNPM> {
+  PreservedAnalyses run(Module &M, ModuleAnalysisManager &) {
+    return instrumentPathProfile(M) ? PreservedAnalyses::none() : PreservedAnalyses::all();
+  }
+};
+
+struct PathProfileGen : public ModulePass {
+  static char ID;
+  PathProfileGen() : ModulePass(ID) {}
+  bool runOnModule(Module &M) override { return instrumentPathProfile(M); }
+};
+} // end of anonymous namespace
+
+
+void registerPathProfilePasses(PassBuilder &PB) {
+  PB.registerPipelineParsingCallback(
+      [](StringRef Name, ModulePassManager &MPM, ArrayRef<PassBuilder::PipelineElement>) {
+        if (Name == "pathprof-gen") {
+          MPM.addPass(PathProfileGenNPM());
+          return true;
+        }
+        return false;
+      });
+}
+
+} // end of namespace SuperBlock
+
+char SuperBlock::PathProfileGen::ID = 0;
+static RegisterPass<SuperBlock::PathProfileGen> P("pathprof-gen", "Ball-Larus path profile instrumentation");
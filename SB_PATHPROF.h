@@ -0,0 +1,50 @@
+//===-- SB_PATHPROF.h - Ball-Larus path profiling --------------------------===//
+//
+// An edge profile says how often each branch goes each way, not which
+// outcomes happen together, so a trace grown from it may never run end to
+// end. A Ball-Larus path profile counts whole acyclic paths instead: each
+// path from the function entry or a loop header to a return or a back edge
+// gets a number in 0..N-1, computed on the fly in one register by adding a
+// constant on some edges, and one counter.
+//
+//   opt -load-pass-plugin=LLVMSB.so -passes=pathprof-gen in.bc -o prof.bc
+//   clang prof.bc SB_PATHPROF_RT.c -o prof && ./prof     # writes default.pathprof
+//   opt -load LLVMSB.so -load-pass-plugin=LLVMSB.so -sb-selector=paths
+//       -sb-path-profile=default.pathprof -passes='psbpass' in.bc ...
+//
+// The instrumented copy must be made from the same IR the superblock pass
+// later sees; a function whose CFG changed in between is recognised by its
+// checksum and formed without paths.
+//
+//===----------------------------------------------------------------------===//
+#ifndef SB_PATHPROF_H
+#define SB_PATHPROF_H
+
+#include "llvm/IR/BasicBlock.h"
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace llvm {
+class Function;
+class Module;
+} // end of namespace llvm
+
+namespace SuperBlock {
+// Adds the path counting code to every function of M with at most
+// -sb-path-max-paths paths, plus a constructor that registers the counters
+// with the runtime in SB_PATHPROF_RT.c. Functions with funclet EH, or with an
+// edge that would need splitting but cannot be split, are left alone.
+// Returns true if anything was instrumented.
+bool instrumentPathProfile(llvm::Module &M);
+
+// True if -sb-path-profile has paths for F as it is now.
+bool hasPathProfile(llvm::Function &F);
+
+// The executed paths of F from -sb-path-profile, hottest first, each with
+// its count and its blocks from first to last.
+std::vector<std::pair<uint64_t, std::vector<llvm::BasicBlock *>>> hotPaths(llvm::Function &F);
+} // end of namespace SuperBlock
+
+#endif
@@ -0,0 +1,62 @@
+/*===-- SB_PATHPROF_RT.c - Runtime of the Ball-Larus path profile ---------===//
+//
+// Linked into binaries instrumented by -passes=pathprof-gen. Each
+// instrumented function registers its path counters from a constructor; at
+// exit every function's nonzero counters are appended to the file named by
+// SB_PATHPROF_FILE (default.pathprof if unset):
+//
+//   fn <name> <cfg checksum> <number of paths>
+//   <path id> <count>
+//   ...
+//
+// Appending lets several runs accumulate; -sb-path-profile adds up records
+// of the same function and CFG.
+//
+//===----------------------------------------------------------------------===*/
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+struct sb_pathprof_fn {
+  const char *name;
+  uint64_t checksum;
+  uint64_t *counts;
+  uint32_t paths;
+  struct sb_pathprof_fn *next;
+};
+
+static struct sb_pathprof_fn *sb_pathprof_fns;
+
+static void sb_pathprof_dump(void) {
+  const char *path = getenv("SB_PATHPROF_FILE");
+  FILE *out = fopen(path ? path : "default.pathprof", "a");
+  if (!out) {
+    perror("sb_pathprof");
+    return;
+  }
+  for (struct sb_pathprof_fn *fn = sb_pathprof_fns; fn; fn = fn->next) {
+    fprintf(out, "fn %s %llu %u\n", fn->name, (unsigned long long)fn->checksum, fn->paths);
+    for (uint32_t i = 0; i < fn->paths; ++i) {
+      if (fn->counts[i]) {
+        fprintf(out, "%u %llu\n", i, (unsigned long long)fn->counts[i]);
+      }
+    }
+  }
+  fclose(out);
+}
+
+void __sb_pathprof_register(const char *name, uint64_t checksum, uint64_t *counts, uint32_t paths) {
+  struct sb_pathprof_fn *fn = malloc(sizeof *fn);
+  if (!fn) {
+    return;
+  }
+  if (!sb_pathprof_fns) {
+    atexit(sb_pathprof_dump);
+  }
+  fn->name = name;
+  fn->checksum = checksum;
+  fn->counts = counts;
+  fn->paths = paths;
+  fn->next = sb_pathprof_fns;
+  sb_pathprof_fns = fn;
+}
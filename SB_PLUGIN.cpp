@@ -0,0 +1,138 @@
+//===-- SB_PLUGIN.cpp - Pass plugin entry point for LLVMSB ----------------===//
+//
+// Makes LLVMSB.so loadable with -load-pass-plugin. Passes can then be named in
+// -passes= pipelines (psbpass, rsbpass, tsbpass, heuristic_sb, dataset_gen,
+// pathprof-gen, sb-inline, sb-switch-peel, sb-hot-cold-split) or spliced
+// into the default -O1/-O2/-O3 pipelines at an extension point:
+//
+//   opt -load LLVMSB.so -load-pass-plugin=LLVMSB.so -passes='default<O2>'
+//       -sb-ep=scalar-late -sb-ep-pipeline=psbpass in.bc -o out.bc
+//
+// (opt only parses -sb-* options of libraries given with -load, so pass the
+// library twice whenever one of them is used.)
+//
+// -sb-config=FILE reads -sb-* options from a file, one name=value per line
+// ('#' starts a comment), as written by sbtune.py; any other option is
+// rejected. Options also given on the command line keep their command line
+// value. A 'pass' line names the pass the configuration was tuned for; it is
+// for the driver script building the -passes= pipeline and is skipped here.
+//
+//===----------------------------------------------------------------------===//
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/PassPlugin.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "SB_PLUGIN.h"
+
+using namespace llvm;
+
+static cl::opt<std::string> EPPipeline("sb-ep-pipeline", cl::init(""),
+    cl::desc("Function pipeline (e.g. 'psbpass') to insert into the default "
+             "-O pipelines at the -sb-ep extension point"));
+
+static cl::opt<std::string> EPName("sb-ep", cl::init("scalar-late"),
+    cl::desc("Extension point for -sb-ep-pipeline: peephole, scalar-late, "
+             "vectorizer-start or optimizer-last"));
+
+static void loadConfig(const std::string &Path) {
+  auto Buf = MemoryBuffer::getFile(Path);
+  if (!Buf) {
+    errs() << "-sb-config: cannot read " << Path << ": " << Buf.getError().message() << "\n";
+    return;
+  }
+  StringMap<cl::Option*> &Opts = cl::getRegisteredOptions();
+  SmallVector<StringRef, 16> Lines;
+  (*Buf)->getBuffer().split(Lines, '\n');
+  for (StringRef Line : Lines) {
+    Line = Line.split('#').first.trim();
+    if (Line.empty()) {
+      continue;
+    }
+    StringRef Name, Value;
+    std::tie(Name, Value) = Line.split('=');
+    Name = Name.trim().ltrim('-');
+    Value = Value.trim();
+    if (Name == "pass") {
+      continue;
+    }
+    if (!Name.startswith("sb-")) {
+      errs() << "-sb-config: '" << Name << "' in " << Path << " is not an -sb-* option\n";
+      continue;
+    }
+    auto It = Opts.find(Name);
+    if (It == Opts.end()) {
+      errs() << "-sb-config: unknown option '" << Name << "' in " << Path << "\n";
+      continue;
+    }
+    cl::Option *O = It->second;
+    if (O->getNumOccurrences()) {
+      continue;  // given on the command line before -sb-config
+    }
+    // Let a later command line occurrence override the file.
+    O->setNumOccurrencesFlag(cl::ZeroOrMore);
+    if (O->addOccurrence(0, Name, Value)) {
+      errs() << "-sb-config: bad value '" << Value << "' for " << Name << " in " << Path << "\n";
+    }
+  }
+}
+
+static cl::opt<std::string> ConfigFile("sb-config", cl::init(""),
+    cl::desc("Read -sb-* options from this file (name=value per line)"),
+    cl::cb<void, std::string>(loadConfig));
+
+// Parses -sb-ep-pipeline into FPM. Returns false (after reporting) on a
+// malformed pipeline so the extension point is simply left empty.
+static bool addEPPipeline(PassBuilder &PB, FunctionPassManager &FPM) {
+  if (auto Err = PB.parsePassPipeline(FPM, EPPipeline)) {
+    errs() << "-sb-ep-pipeline: " << toString(std::move(Err)) << "\n";
+    return false;
+  }
+  return true;
+}
+
+static void registerExtensionPoints(PassBuilder &PB) {
+  PB.registerPeepholeEPCallback(
+      [&PB](FunctionPassManager &FPM, OptimizationLevel) {
+        if (!EPPipeline.empty() && EPName == "peephole") {
+          addEPPipeline(PB, FPM);
+        }
+      });
+  PB.registerScalarOptimizerLateEPCallback(
+      [&PB](FunctionPassManager &FPM, OptimizationLevel) {
+        if (!EPPipeline.empty() && EPName == "scalar-late") {
+          addEPPipeline(PB, FPM);
+        }
+      });
+  PB.registerVectorizerStartEPCallback(
+      [&PB](FunctionPassManager &FPM, OptimizationLevel) {
+        if (!EPPipeline.empty() && EPName == "vectorizer-start") {
+          addEPPipeline(PB, FPM);
+        }
+      });
+  PB.registerOptimizerLastEPCallback(
+      [&PB](ModulePassManager &MPM, OptimizationLevel) {
+        if (EPPipeline.empty() || EPName != "optimizer-last") {
+          return;
+        }
+        FunctionPassManager FPM;
+        if (addEPPipeline(PB, FPM)) {
+          MPM.addPass(createModuleToFunctionPassAdaptor(std::move(FPM)));
+        }
+      });
+}
+
+extern "C" LLVM_ATTRIBUTE_WEAK PassPluginLibraryInfo llvmGetPassPluginInfo() {
+  return {LLVM_PLUGIN_API_VERSION, "SuperBlock", LLVM_VERSION_STRING,
+          [](PassBuilder &PB) {
+            SuperBlock::registerSBPasses(PB);
+            SuperBlock::registerHeuristicSBPasses(PB);
+            SuperBlock::registerDatasetGenPasses(PB);
+            SuperBlock::registerPathProfilePasses(PB);
+            SuperBlock::registerInlinePasses(PB);
+            SuperBlock::registerSwitchPasses(PB);
+            SuperBlock::registerSplitPasses(PB);
+            registerExtensionPoints(PB);
+          }};
+}
@@ -0,0 +1,23 @@
+//===-- SB_PLUGIN.h - New pass manager registration for LLVMSB ------------===//
+//
+// Every source file of the LLVMSB library registers its passes with the new
+// pass manager through one of these hooks; SB_PLUGIN.cpp calls them all from
+// llvmGetPassPluginInfo so the library can be loaded with -load-pass-plugin.
+//
+//===----------------------------------------------------------------------===//
+#ifndef SB_PLUGIN_H
+#define SB_PLUGIN_H
+
+#include "llvm/Passes/PassBuilder.h"
+
+namespace SuperBlock {
+void registerSBPasses(llvm::PassBuilder &PB);          // SB_PASS.cpp
+void registerHeuristicSBPasses(llvm::PassBuilder &PB); // heuristic_sb.cpp
+void registerDatasetGenPasses(llvm::PassBuilder &PB);  // dataset_gen.cpp
+void registerPathProfilePasses(llvm::PassBuilder &PB); // SB_PATHPROF.cpp
+void registerInlinePasses(llvm::PassBuilder &PB);      // SB_INLINE.cpp
+void registerSwitchPasses(llvm::PassBuilder &PB);      // SB_SWITCH.cpp
+void registerSplitPasses(llvm::PassBuilder &PB);       // SB_SPLIT.cpp
+} // end of namespace SuperBlock
+
+#endif
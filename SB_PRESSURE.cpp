@@ -0,0 +1,182 @@
+//===-- SB_PRESSURE.cpp - Register pressure along a trace ------------------===//
+//
+// See SB_PRESSURE.h.
+//
+//===----------------------------------------------------------------------===//
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Support/CommandLine.h"
+
+#include "SB_PRESSURE.h"
+
+using namespace llvm;
+using namespace std;
+
+static cl::opt<bool> PressureSplit("sb-pressure-split", cl::init(true),
+    cl::desc("Split traces whose estimated register pressure exceeds the "
+             "register budget"));
+
+static cl::opt<unsigned> RegBudget("sb-reg-budget", cl::init(0),
+    cl::desc("Values a trace may keep live at once per register class "
+             "(0: the number of registers the target reports)"));
+
+namespace SuperBlock {
+
+PressureTracker::PressureTracker(const TargetTransformInfo &TTI) : TTI(TTI), Budget(RegBudget) {}
+
+
+bool PressureTracker::needsRegister(const Value *V) const {
+  if (!isa<Instruction>(V) && !isa<Argument>(V)) {
+    return false;
+  }
+  Type *Ty = V->getType();
+  if (!Ty->isIntOrIntVectorTy() && !Ty->isPtrOrPtrVectorTy() && !Ty->isFPOrFPVectorTy()) {
+    return false;
+  }
+  // Stack slots are addressed off the frame pointer, and a compare that
+  // only feeds its block's branch lives in the flags.
+  if (isa<AllocaInst>(V)) {
+    return false;
+  }
+  if (auto *C = dyn_cast<CmpInst>(V)) {
+    if (C->hasOneUse() && C->user_back() == C->getParent()->getTerminator()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+unsigned PressureTracker::classOf(const Value *V) const {
+  Type *Ty = V->getType();
+  return TTI.getRegisterClassForType(Ty->isVectorTy() || Ty->isFPOrFPVectorTy(), Ty);
+}
+
+
+unsigned PressureTracker::budgetFor(unsigned RegClass) const {
+  return Budget ? Budget : TTI.getNumberOfRegisters(RegClass);
+}
+
+
+bool PressureTracker::tryAppend(const BasicBlock *BB) {
+  auto live = Live;
+  SmallDenseMap<unsigned, unsigned, 4> peak;
+  SmallVector<pair<const Value*, unsigned>, 16> undo;  // old Remaining, 0 if absent
+
+  auto note = [&](unsigned cls, unsigned n) {
+    unsigned &p = peak[cls];
+    p = max(p, n);
+  };
+  auto reach = [&](const Value *V) {  // a use of V inside the trace
+    auto it = Remaining.find(V);
+    if (it == Remaining.end()) {
+      return false;
+    }
+    undo.push_back({V, it->second});
+    if (--it->second == 0) {
+      Remaining.erase(it);
+      live[classOf(V)]--;
+    }
+    return true;
+  };
+  auto define = [&](const Value *V) {
+    if (!needsRegister(V) || V->use_empty()) {
+      return;
+    }
+    undo.push_back({V, 0});
+    Remaining[V] = V->getNumUses();
+    unsigned cls = classOf(V);
+    note(cls, ++live[cls]);
+  };
+
+  for (const PHINode &PN : BB->phis()) {
+    if (Last && PN.getBasicBlockIndex(Last) >= 0) {
+      reach(PN.getIncomingValueForBlock(Last));
+    }
+  }
+  for (const PHINode &PN : BB->phis()) {
+    define(&PN);
+  }
+  for (const Instruction &I : *BB) {
+    if (isa<PHINode>(I)) {
+      continue;
+    }
+    // Operands from outside the trace only need a register here.
+    SmallDenseMap<unsigned, unsigned, 4> liveIns;
+    for (const Value *op : I.operands()) {
+      if (!reach(op) && needsRegister(op)) {
+        liveIns[classOf(op)]++;
+      }
+    }
+    for (auto &entry : liveIns) {
+      note(entry.first, live[entry.first] + entry.second);
+    }
+    define(&I);
+  }
+
+  Pressure = 0;
+  Registers = 0;
+  bool fits = true;
+  for (auto &entry : peak) {
+    unsigned budget = budgetFor(entry.first);
+    if (entry.second > budget && (!Pressure || entry.second - budget > Pressure - Registers)) {
+      Pressure = entry.second;
+      Registers = budget;
+      fits = false;
+    }
+  }
+  if (!fits && !InTrace.empty()) {
+    for (auto it = undo.rbegin(); it != undo.rend(); ++it) {
+      if (it->second) {
+        Remaining[it->first] = it->second;
+      } else {
+        Remaining.erase(it->first);
+      }
+    }
+    return false;
+  }
+  Live = std::move(live);
+  InTrace.insert(BB);
+  Last = BB;
+  return true;
+}
+
+
+bool splitTracesByPressure(vector<vector<BasicBlock*>> &Traces, const TargetTransformInfo &TTI,
+                           OptimizationRemarkEmitter *ORE, const char *PassName) {
+  if (!PressureSplit) {
+    return false;
+  }
+  bool split = false;
+  vector<vector<BasicBlock*>> result;
+  for (vector<BasicBlock*> &T : Traces) {
+    unsigned start = 0;
+    while (start < T.size()) {
+      PressureTracker tracker(TTI);
+      unsigned end = start;
+      while (end < T.size() && tracker.tryAppend(T[end])) {
+        ++end;
+      }
+      result.emplace_back(T.begin() + start, T.begin() + end);
+      if (end < T.size()) {
+        split = true;
+      }
+      if (end < T.size() && ORE) {
+        BasicBlock *BB = T[end];
+        ORE->emit([&]() {
+          return OptimizationRemarkAnalysis(PassName, "RegisterPressure", BB->getTerminator())
+                 << "trace split before " << ore::NV("Block", BB->getName())
+                 << ": an estimated " << ore::NV("Pressure", tracker.Pressure)
+                 << " live values would exceed the " << ore::NV("Registers", tracker.Registers)
+                 << " registers available";
+        });
+      }
+      start = end;
+    }
+  }
+  Traces = std::move(result);
+  return split;
+}
+
+} // end of namespace SuperBlock
@@ -0,0 +1,67 @@
+//===-- SB_PRESSURE.h - Register pressure along a trace --------------------===//
+//
+// The longer a superblock, the more values defined early in it are still
+// needed late in it or on one of its side exits, and once they no longer fit
+// in registers the spills eat what the superblock gained. Traces are checked
+// against the target's register count as they come out of trace formation,
+// and split where they would not fit.
+//
+//===----------------------------------------------------------------------===//
+#ifndef SB_PRESSURE_H
+#define SB_PRESSURE_H
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/IR/BasicBlock.h"
+
+#include <vector>
+
+namespace llvm {
+class OptimizationRemarkEmitter;
+class TargetTransformInfo;
+} // end of namespace llvm
+
+namespace SuperBlock {
+// Estimates the number of values live at once along a trace, treated as the
+// straight-line code a superblock becomes, one register class at a time. A
+// value defined in the trace is live from its definition until its last use
+// in the trace; a use anywhere else (a later block that is not appended, or
+// a PHI on a side exit) keeps it live to the end of the trace. Values from
+// outside the trace only count at the instructions that read them.
+class PressureTracker {
+  const llvm::TargetTransformInfo &TTI;
+  unsigned Budget;  // -sb-reg-budget, 0 for the target's register count
+  llvm::SmallDenseMap<unsigned, unsigned, 4> Live;         // per register class
+  llvm::DenseMap<const llvm::Value *, unsigned> Remaining; // uses not reached yet
+  llvm::SmallPtrSet<const llvm::BasicBlock *, 16> InTrace;
+  const llvm::BasicBlock *Last = nullptr;
+
+  bool needsRegister(const llvm::Value *V) const;
+  unsigned classOf(const llvm::Value *V) const;
+
+public:
+  explicit PressureTracker(const llvm::TargetTransformInfo &TTI);
+
+  // Appends BB to the trace unless that would take some register class past
+  // its budget; then nothing changes and Pressure/Registers describe the
+  // class that ran out. The first block is always taken.
+  bool tryAppend(const llvm::BasicBlock *BB);
+
+  unsigned budgetFor(unsigned RegClass) const;
+
+  unsigned Pressure = 0;   // highest estimate seen by the last tryAppend
+  unsigned Registers = 0;  // budget of the class that estimate belongs to
+};
+
+// Checks each trace with a PressureTracker and splits it before every block
+// that would not fit; the rest starts a new trace right after it. Each split
+// is reported to ORE, if given, as an analysis remark of pass PassName.
+// Returns true if any trace was split. Does nothing under
+// -sb-pressure-split=false.
+bool splitTracesByPressure(std::vector<std::vector<llvm::BasicBlock *>> &Traces,
+                           const llvm::TargetTransformInfo &TTI,
+                           llvm::OptimizationRemarkEmitter *ORE, const char *PassName);
+} // end of namespace SuperBlock
+
+#endif
@@ -0,0 +1,113 @@
+//===-- SB_PROFILE.cpp - Profile counts after tail duplication -------------===//
+//
+// See SB_PROFILE.h.
+//
+//===----------------------------------------------------------------------===//
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/PostOrderIterator.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/BranchProbabilityInfo.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Support/CommandLine.h"
+
+#include "SB_PROFILE.h"
+#include "SB_UTILS.h"
+
+using namespace llvm;
+using namespace std;
+
+static cl::opt<bool> UpdateProfile("sb-update-profile", cl::init(true),
+    cl::desc("Split profile counts between tail copies and their originals "
+             "and write them back as branch_weights"));
+
+namespace SuperBlock {
+
+bool updateProfileCounts(Function &F, DominatorTree &DT, LoopInfo &LI,
+                         BranchProbabilityInfo &BPI, BlockFrequencyInfo &BFI) {
+  if (!UpdateProfile || !F.getEntryCount()) {
+    return false;
+  }
+  BPI.releaseMemory();
+  BPI.calculate(F, LI, nullptr, &DT, nullptr);
+  BFI.releaseMemory();
+  BFI.calculate(F, BPI, LI);
+
+  // Count carried by each out-edge, by successor index.
+  DenseMap<const BasicBlock*, SmallVector<uint64_t, 2>> edgeCounts;
+  auto inFlow = [&](BasicBlock *BB, uint64_t &count) {
+    count = 0;
+    SmallPtrSet<const BasicBlock*, 4> seen;
+    for (BasicBlock *pred : predecessors(BB)) {
+      if (!seen.insert(pred).second || !DT.isReachableFromEntry(pred)) {
+        continue;
+      }
+      auto it = edgeCounts.find(pred);
+      if (it == edgeCounts.end()) {
+        return false;  // irreducible: a predecessor is not done yet
+      }
+      const Instruction *term = pred->getTerminator();
+      for (unsigned i = 0, e = term->getNumSuccessors(); i != e; ++i) {
+        if (term->getSuccessor(i) == BB) {
+          count += it->second[i];
+        }
+      }
+    }
+    return true;
+  };
+
+  bool changed = false;
+  for (BasicBlock *BB : ReversePostOrderTraversal<Function*>(&F)) {
+    uint64_t count;
+    if (BB->isEntryBlock() || LI.isLoopHeader(BB) || !inFlow(BB, count)) {
+      count = BFI.getBlockProfileCount(BB).getValueOr(0);
+    }
+
+    Instruction *term = BB->getTerminator();
+    SmallVector<uint64_t, 2> &out = edgeCounts[BB];
+    uint64_t assigned = 0;
+    unsigned likeliest = 0;
+    for (unsigned i = 0, e = term->getNumSuccessors(); i != e; ++i) {
+      BranchProbability P = BPI.getEdgeProbability(BB, i);
+      out.push_back(P.scale(count));
+      assigned += out.back();
+      if (P > BPI.getEdgeProbability(BB, likeliest)) {
+        likeliest = i;
+      }
+    }
+    if (out.empty()) {
+      continue;
+    }
+    if (assigned <= count) {
+      out[likeliest] += count - assigned;
+    } else {
+      out[likeliest] -= min(out[likeliest], assigned - count);
+    }
+
+    if (out.size() < 2 || count == 0 || !(isa<BranchInst>(term) || isa<SwitchInst>(term))) {
+      continue;
+    }
+    // An edge whose share rounds down to nothing is still taken; a zero
+    // weight would tell BFI that, say, the one exit of a loop never is.
+    // Such blocks get their probabilities instead of counts.
+    SmallVector<uint64_t, 2> weights(out.begin(), out.end());
+    for (unsigned i = 0; i < weights.size(); ++i) {
+      if (weights[i] == 0 && !BPI.getEdgeProbability(BB, i).isZero()) {
+        for (unsigned k = 0; k < weights.size(); ++k) {
+          weights[k] = BPI.getEdgeProbability(BB, k).getNumerator();
+        }
+        break;
+      }
+    }
+    setBranchWeights(term, weights);
+    changed = true;
+  }
+  return changed;
+}
+
+} // end of namespace SuperBlock
@@ -0,0 +1,39 @@
+//===-- SB_PROFILE.h - Profile counts after tail duplication ---------------===//
+//
+// Profile branch_weights are execution counts, and CloneBasicBlock() copies
+// them verbatim: every clone claims all executions of its original while the
+// original goes on claiming them too, and blocks without weights get none at
+// all. updateProfileCounts() splits the flow between the copies and writes it
+// back, so whatever runs after the superblock passes (LICM, the inliner,
+// block placement) sees the profile of the code that is actually there.
+//
+//===----------------------------------------------------------------------===//
+#ifndef SB_PROFILE_H
+#define SB_PROFILE_H
+
+namespace llvm {
+class BlockFrequencyInfo;
+class BranchProbabilityInfo;
+class DominatorTree;
+class Function;
+class LoopInfo;
+} // end of namespace llvm
+
+namespace SuperBlock {
+// Recomputes BPI and BFI on the current CFG of F (DT and LI must be up to
+// date), which gives each clone the flow of the edge that enters it and
+// leaves its original only the side-entrance flow. Block counts are then
+// repaired so flow is conserved: walking in reverse post order, a block that
+// is not a loop header counts exactly what its in-edges carry, and each
+// block's count is split over its out-edges by branch probability, rounding
+// going to the likeliest edge. Every branch and switch with a nonzero count
+// gets the resulting edge counts as its branch_weights, or its probabilities
+// where an edge that is taken at all would get a count of 0.
+//
+// Needs a profile (a function entry count). Returns true if any weights
+// were written; does nothing under -sb-update-profile=false.
+bool updateProfileCounts(llvm::Function &F, llvm::DominatorTree &DT, llvm::LoopInfo &LI,
+                         llvm::BranchProbabilityInfo &BPI, llvm::BlockFrequencyInfo &BFI);
+} // end of namespace SuperBlock
+
+#endif
@@ -0,0 +1,463 @@
+//===-- SB_SCHED.cpp - Superblock instruction scheduling -------------------===//
+//
+// See SB_SCHED.h.
+//
+//===----------------------------------------------------------------------===//
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/MemoryLocation.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/Support/CommandLine.h"
+
+#include "SB_SCHED.h"
+
+using namespace llvm;
+using namespace std;
+
+static cl::opt<bool> ScheduleSB("sb-schedule", cl::init(true),
+    cl::desc("List schedule each superblock as one region"));
+
+static cl::opt<unsigned> IssueWidth("sb-sched-width", cl::init(2),
+    cl::desc("Instructions the superblock scheduler issues per cycle"));
+
+static cl::opt<unsigned> MaxRegionSize("sb-sched-max-region", cl::init(400),
+    cl::desc("Largest number of instructions scheduled as one superblock region"));
+
+static cl::opt<bool> SpeculateLoads("sb-spec-loads", cl::init(true),
+    cl::desc("Hoist loads above side exits where an earlier access to the same "
+             "address, or a null check, makes them safe"));
+
+namespace SuperBlock {
+
+namespace {
+// Stack slot per type that null guarded loads read instead.
+using GuardSlots = DenseMap<Type*, AllocaInst*>;
+
+struct SchedNode {
+  Instruction *I;
+  unsigned Home;            // region block the instruction started in
+  unsigned Latency;
+  unsigned Height = 0;      // longest latency path to the end of the region
+  unsigned NumPreds = 0;    // predecessors not scheduled yet
+  unsigned Ready = 0;       // earliest cycle all operands are available
+  SmallVector<pair<unsigned, unsigned>, 4> Succs;  // (node, edge latency)
+
+  SchedNode(Instruction *I, unsigned Home, unsigned Latency) : I(I), Home(Home), Latency(Latency) {}
+};
+
+
+// List scheduler for one region. Nodes are numbered in program order and
+// every dependence edge points forward, so the graph is acyclic by
+// construction.
+class RegionScheduler {
+  ArrayRef<BasicBlock*> Blocks;
+  AAResults &AA;
+  const TargetTransformInfo &TTI;
+  const DataLayout &DL;
+  GuardSlots &Slots;
+  vector<SchedNode> Nodes;
+  DenseMap<const Instruction*, unsigned> NodeOf;
+  DenseMap<const BasicBlock*, unsigned> BlockOf;
+  vector<unsigned> Branch;  // node of each block's terminator
+  // Loads that may only run above a side exit behind a null check of the
+  // base pointer, which apply() adds if they do end up there.
+  DenseMap<unsigned, Value*> NullGuarded;
+
+public:
+  RegionScheduler(ArrayRef<BasicBlock*> Blocks, AAResults &AA, const TargetTransformInfo &TTI,
+                  GuardSlots &Slots)
+      : Blocks(Blocks), AA(AA), TTI(TTI), DL(Blocks.front()->getModule()->getDataLayout()),
+        Slots(Slots) {}
+
+  bool run() {
+    buildNodes();
+    addDataEdges();
+    addControlEdges();
+    addMemoryEdges();
+    computeHeights();
+    return apply(schedule());
+  }
+
+private:
+  unsigned latencyOf(Instruction *I) {
+    if (I->isTerminator()) {
+      return 1;
+    }
+    auto cost = TTI.getInstructionCost(I, TargetTransformInfo::TCK_Latency).getValue();
+    return cost && *cost > 1 ? *cost : 1;
+  }
+
+  void addEdge(unsigned From, unsigned To, unsigned Latency) {
+    Nodes[From].Succs.push_back({To, Latency});
+    Nodes[To].NumPreds++;
+  }
+
+  // Allowed to run before a side exit it used to follow.
+  static bool canHoist(const Instruction *I) {
+    return !I->isTerminator() && !isa<AllocaInst>(I) && isSafeToSpeculativelyExecute(I);
+  }
+
+  // Allowed to run after a side exit it used to precede, provided its value
+  // is not needed on the exit path.
+  static bool canSink(const Instruction *I) {
+    return !I->isTerminator() && !isa<AllocaInst>(I) && !I->mayHaveSideEffects();
+  }
+
+  void buildNodes() {
+    for (unsigned k = 0; k < Blocks.size(); ++k) {
+      BlockOf[Blocks[k]] = k;
+      for (Instruction &I : *Blocks[k]) {
+        if (isa<PHINode>(I) || isa<DbgInfoIntrinsic>(I)) {
+          continue;
+        }
+        NodeOf[&I] = Nodes.size();
+        Nodes.emplace_back(&I, k, latencyOf(&I));
+      }
+      Branch.push_back(NodeOf[Blocks[k]->getTerminator()]);
+    }
+  }
+
+  void addDataEdges() {
+    for (unsigned u = 0; u < Nodes.size(); ++u) {
+      for (Value *op : Nodes[u].I->operands()) {
+        auto it = NodeOf.find(dyn_cast<Instruction>(op));
+        if (it != NodeOf.end()) {
+          addEdge(it->second, u, Nodes[it->second].Latency);
+          continue;
+        }
+        // A PHI of a later block only holds its value once control got there.
+        if (PHINode *PN = dyn_cast<PHINode>(op)) {
+          auto blk = BlockOf.find(PN->getParent());
+          if (blk != BlockOf.end() && blk->second > 0) {
+            addEdge(Branch[blk->second - 1], u, 0);
+          }
+        }
+      }
+    }
+  }
+
+  // Last region block the value of node u can be computed in: past that the
+  // definition would no longer dominate one of its uses.
+  unsigned latestBlock(unsigned u) {
+    const SchedNode &N = Nodes[u];
+    if (!canSink(N.I)) {
+      return N.Home;
+    }
+    unsigned latest = Blocks.size() - 1;
+    for (const Use &U : N.I->uses()) {
+      const Instruction *user = cast<Instruction>(U.getUser());
+      if (isa<DbgInfoIntrinsic>(user)) {
+        continue;
+      }
+      if (const PHINode *PN = dyn_cast<PHINode>(user)) {
+        // Needed on the edge out of the incoming block.
+        auto blk = BlockOf.find(PN->getIncomingBlock(U));
+        if (blk == BlockOf.end()) {
+          return N.Home;
+        }
+        latest = min(latest, blk->second);
+      } else if (!NodeOf.count(user)) {
+        // Used on an exit path.
+        return N.Home;
+      }
+      // Any other user is a node and comes after u through its data edge.
+    }
+    return max(latest, N.Home);
+  }
+
+  static bool mayFree(const Instruction *I) {
+    auto *CB = dyn_cast<CallBase>(I);
+    return CB && !CB->hasFnAttr(Attribute::NoFree);
+  }
+
+  // The base of Load's address if the load cannot trap once the base is
+  // known not to be null: the base is dereferenceable_or_null far enough and
+  // aligned. Null otherwise.
+  Value *nullGuardBase(LoadInst *Load) {
+    if (Load->getPointerAddressSpace() != DL.getAllocaAddrSpace()) {
+      return nullptr;
+    }
+    APInt offset(DL.getIndexTypeSizeInBits(Load->getPointerOperandType()), 0);
+    Value *base = Load->getPointerOperand()->stripAndAccumulateConstantOffsets(DL, offset, true);
+    bool canBeNull = false, canBeFreed = false;
+    uint64_t bytes = base->getPointerDereferenceableBytes(DL, canBeNull, canBeFreed);
+    uint64_t size = DL.getTypeStoreSize(Load->getType()).getFixedSize();
+    if (!canBeNull || canBeFreed || offset.isNegative() || offset.getZExtValue() + size > bytes) {
+      return nullptr;
+    }
+    Align align = commonAlignment(base->getPointerAlignment(DL), offset.getZExtValue());
+    return align >= Load->getAlign() ? base : nullptr;
+  }
+
+  // First region block node u may run in. A load that is not safe to
+  // speculate anywhere may still go up to the block of an earlier access to
+  // the same address at least as wide and aligned, as long as nothing in
+  // between could free the memory; failing that, anywhere behind a null
+  // check (nullGuardBase()).
+  unsigned earliestBlock(unsigned u) {
+    const SchedNode &N = Nodes[u];
+    if (N.Home == 0 || canHoist(N.I)) {
+      return 0;
+    }
+    auto *Load = dyn_cast<LoadInst>(N.I);
+    if (!SpeculateLoads || !Load || !Load->isSimple()) {
+      return N.Home;
+    }
+    const Value *ptr = Load->getPointerOperand()->stripPointerCasts();
+    TypeSize size = DL.getTypeStoreSize(Load->getType());
+    unsigned earliest = N.Home;
+    for (unsigned v = u; v-- > 0;) {
+      Instruction *I = Nodes[v].I;
+      if (mayFree(I)) {
+        break;
+      }
+      Value *p = getLoadStorePointerOperand(I);
+      if (p && p->stripPointerCasts() == ptr &&
+          DL.getTypeStoreSize(getLoadStoreType(I)) >= size &&
+          getLoadStoreAlignment(I) >= Load->getAlign()) {
+        earliest = Nodes[v].Home;
+      }
+    }
+    if (earliest == N.Home) {
+      if (Value *base = nullGuardBase(Load)) {
+        NullGuarded[u] = base;
+        return 0;
+      }
+    }
+    return earliest;
+  }
+
+  void addControlEdges() {
+    for (unsigned k = 0; k + 1 < Blocks.size(); ++k) {
+      addEdge(Branch[k], Branch[k + 1], 1);
+    }
+    for (unsigned u = 0; u < Nodes.size(); ++u) {
+      if (Nodes[u].I->isTerminator()) {
+        continue;
+      }
+      unsigned earliest = earliestBlock(u);
+      if (earliest > 0) {
+        addEdge(Branch[earliest - 1], u, 0);
+      }
+      addEdge(u, Branch[latestBlock(u)], 0);
+    }
+  }
+
+  bool mayAlias(Instruction *A, Instruction *B) {
+    auto simple = [](Instruction *I) {
+      if (auto *LI = dyn_cast<LoadInst>(I)) {
+        return LI->isSimple();
+      }
+      if (auto *SI = dyn_cast<StoreInst>(I)) {
+        return SI->isSimple();
+      }
+      return false;
+    };
+    if (simple(A) && simple(B)) {
+      return !AA.isNoAlias(MemoryLocation::get(A), MemoryLocation::get(B));
+    }
+    if (simple(A) && isa<CallBase>(B)) {
+      return isModOrRefSet(AA.getModRefInfo(cast<CallBase>(B), MemoryLocation::get(A)));
+    }
+    if (simple(B) && isa<CallBase>(A)) {
+      return isModOrRefSet(AA.getModRefInfo(cast<CallBase>(A), MemoryLocation::get(B)));
+    }
+    return true;
+  }
+
+  // A is before B in program order. True if B must stay after A.
+  bool mustOrder(Instruction *A, Instruction *B) {
+    // Nothing may start executing before an instruction that might not
+    // return unless it is harmless to execute anyway, and side effects may
+    // not be delayed past one.
+    if (!isGuaranteedToTransferExecutionToSuccessor(A) && !canHoist(B)) {
+      return true;
+    }
+    if (!isGuaranteedToTransferExecutionToSuccessor(B) && A->mayHaveSideEffects()) {
+      return true;
+    }
+    if (!A->mayReadOrWriteMemory() || !B->mayReadOrWriteMemory()) {
+      return false;
+    }
+    if (!A->mayWriteToMemory() && !B->mayWriteToMemory()) {
+      return false;
+    }
+    return mayAlias(A, B);
+  }
+
+  void addMemoryEdges() {
+    SmallVector<unsigned, 32> ordered;
+    for (unsigned u = 0; u < Nodes.size(); ++u) {
+      Instruction *I = Nodes[u].I;
+      if (I->isTerminator()) {
+        continue;
+      }
+      if (!I->mayReadOrWriteMemory() && !I->mayHaveSideEffects() && canHoist(I)) {
+        continue;
+      }
+      for (unsigned a : ordered) {
+        if (mustOrder(Nodes[a].I, I)) {
+          // A load reads what an earlier store wrote one cycle later.
+          addEdge(a, u, Nodes[a].I->mayWriteToMemory() ? 1 : 0);
+        }
+      }
+      ordered.push_back(u);
+    }
+  }
+
+  void computeHeights() {
+    for (unsigned u = Nodes.size(); u-- > 0;) {
+      unsigned h = Nodes[u].Latency;
+      for (auto &succ : Nodes[u].Succs) {
+        h = max(h, succ.second + Nodes[succ.first].Height);
+      }
+      Nodes[u].Height = h;
+    }
+  }
+
+  // Cycle by cycle, issue up to IssueWidth ready nodes, tallest first (ties
+  // in program order). Returns the nodes in issue order.
+  vector<unsigned> schedule() {
+    vector<unsigned> order, avail;
+    for (unsigned u = 0; u < Nodes.size(); ++u) {
+      if (Nodes[u].NumPreds == 0) {
+        avail.push_back(u);
+      }
+    }
+    for (unsigned cycle = 0; order.size() < Nodes.size(); ++cycle) {
+      for (unsigned slot = 0; slot < max(1u, (unsigned)IssueWidth); ++slot) {
+        int best = -1;
+        for (unsigned i = 0; i < avail.size(); ++i) {
+          const SchedNode &N = Nodes[avail[i]];
+          if (N.Ready > cycle) {
+            continue;
+          }
+          if (best < 0 || N.Height > Nodes[avail[best]].Height ||
+              (N.Height == Nodes[avail[best]].Height && avail[i] < avail[best])) {
+            best = i;
+          }
+        }
+        if (best < 0) {
+          break;
+        }
+        unsigned u = avail[best];
+        avail.erase(avail.begin() + best);
+        order.push_back(u);
+        for (auto &succ : Nodes[u].Succs) {
+          SchedNode &S = Nodes[succ.first];
+          S.Ready = max(S.Ready, cycle + succ.second);
+          if (--S.NumPreds == 0) {
+            avail.push_back(succ.first);
+          }
+        }
+      }
+    }
+    return order;
+  }
+
+  // Rebuilds the blocks in issue order: everything issued before the
+  // terminator of block k (and after that of block k - 1) ends up in block k.
+  bool apply(const vector<unsigned> &order) {
+    bool moved = false;
+    for (unsigned i = 0; i < order.size(); ++i) {
+      moved |= order[i] != i;
+    }
+    if (!moved) {
+      return false;
+    }
+    SmallVector<DbgVariableIntrinsic*, 8> dbgs;
+    for (BasicBlock *BB : Blocks) {
+      for (Instruction &I : *BB) {
+        if (auto *DVI = dyn_cast<DbgVariableIntrinsic>(&I)) {
+          dbgs.push_back(DVI);
+        }
+      }
+    }
+    unsigned blk = 0;
+    for (unsigned u : order) {
+      Instruction *I = Nodes[u].I;
+      if (I->isTerminator()) {
+        ++blk;
+        continue;
+      }
+      I->moveBefore(Blocks[blk]->getTerminator());
+      auto guarded = NullGuarded.find(u);
+      if (guarded != NullGuarded.end() && blk < Nodes[u].Home) {
+        addNullGuard(cast<LoadInst>(I), guarded->second);
+      }
+    }
+    // Keep debug values next to the definition they describe.
+    for (DbgVariableIntrinsic *DVI : dbgs) {
+      if (DVI->getNumVariableLocationOps() != 1) {
+        continue;
+      }
+      Instruction *def = dyn_cast_or_null<Instruction>(DVI->getVariableLocationOp(0));
+      if (def && NodeOf.count(def)) {
+        DVI->moveAfter(def);
+      }
+    }
+    return true;
+  }
+
+  // Makes Load read a stack slot of its own instead when Base is null.
+  void addNullGuard(LoadInst *Load, Value *Base) {
+    AllocaInst *&slot = Slots[Load->getType()];
+    if (!slot) {
+      Function *F = Load->getFunction();
+      slot = new AllocaInst(Load->getType(), DL.getAllocaAddrSpace(), nullptr, Load->getAlign(),
+                            "sb.spec.slot", &*F->getEntryBlock().getFirstInsertionPt());
+    }
+    slot->setAlignment(max(slot->getAlign(), Load->getAlign()));
+    IRBuilder<> B(Load);
+    Value *isNull = B.CreateICmpEQ(Base, Constant::getNullValue(Base->getType()), "sb.spec.null");
+    Value *slotPtr = B.CreatePointerCast(slot, Load->getPointerOperandType());
+    Load->setOperand(0, B.CreateSelect(isNull, slotPtr, Load->getPointerOperand(), "sb.spec.ptr"));
+  }
+};
+} // end of anonymous namespace
+
+
+bool scheduleSuperblocks(ArrayRef<vector<BasicBlock*>> Traces, AAResults &AA,
+                         const TargetTransformInfo &TTI, const LoopInfo &LI) {
+  bool changed = false;
+  if (!ScheduleSB) {
+    return false;
+  }
+  GuardSlots slots;
+  auto scheduleRegion = [&](ArrayRef<BasicBlock*> Region) {
+    if (Region.size() > 1) {
+      changed |= RegionScheduler(Region, AA, TTI, slots).run();
+    }
+  };
+  for (const vector<BasicBlock*> &Trace : Traces) {
+    unsigned begin = 0, size = 0;
+    for (unsigned i = 0; i < Trace.size(); ++i) {
+      BasicBlock *BB = Trace[i];
+      bool extends = i > begin &&
+                     BB->getSinglePredecessor() == Trace[i - 1] &&
+                     isa<BranchInst>(Trace[i - 1]->getTerminator()) &&
+                     LI.getLoopFor(BB) == LI.getLoopFor(Trace[i - 1]) &&
+                     size + BB->size() <= MaxRegionSize;
+      if (i > begin && !extends) {
+        scheduleRegion(makeArrayRef(Trace).slice(begin, i - begin));
+        begin = i;
+        size = 0;
+      }
+      size += BB->size();
+    }
+    if (size <= MaxRegionSize) {
+      scheduleRegion(makeArrayRef(Trace).slice(begin));
+    }
+  }
+  return changed;
+}
+
+} // end of namespace SuperBlock
@@ -0,0 +1,46 @@
+//===-- SB_SCHED.h - Superblock instruction scheduling ---------------------===//
+//
+// LLVM's schedulers only look at one basic block at a time, so on their own
+// they get nothing out of superblock formation. scheduleSuperblocks() treats
+// each superblock as a single region instead: instructions are list scheduled
+// across the side exits with a latency and issue width model, which lets
+// independent work from later blocks fill the slots before an exit branch.
+//
+//===----------------------------------------------------------------------===//
+#ifndef SB_SCHED_H
+#define SB_SCHED_H
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/IR/BasicBlock.h"
+
+#include <vector>
+
+namespace llvm {
+class AAResults;
+class LoopInfo;
+class TargetTransformInfo;
+} // end of namespace llvm
+
+namespace SuperBlock {
+// Schedules every superblock in Traces (as left by tailDuplicateTrace()). A
+// region is a run of trace blocks in which each block's only predecessor is
+// the block before it in the same loop, so the first block dominates the rest
+// and every edge leaving the run is a side exit.
+//
+// Inside a region an instruction may move above a side exit when it is safe
+// to speculate, and below one when it has no side effects and its value is
+// not used on the exit path. A load that is not safe to speculate on its own
+// may still move up to the block of an earlier, at least as wide and aligned
+// access to the same address with no call in between that could free it;
+// one from a dereferenceable_or_null base may move anywhere, reading a stack
+// slot instead when the base is null (-sb-spec-loads). Memory operations keep
+// their order unless alias analysis proves them independent. The CFG is not
+// changed. Returns true if any instruction moved; does nothing under
+// -sb-schedule=false.
+bool scheduleSuperblocks(llvm::ArrayRef<std::vector<llvm::BasicBlock *>> Traces,
+                         llvm::AAResults &AA,
+                         const llvm::TargetTransformInfo &TTI,
+                         const llvm::LoopInfo &LI);
+} // end of namespace SuperBlock
+
+#endif
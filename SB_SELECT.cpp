@@ -0,0 +1,313 @@
+//===-- SB_SELECT.cpp - Trace selection algorithms -------------------------===//
+//
+// See SB_SELECT.h.
+//
+//===----------------------------------------------------------------------===//
+#include "llvm/IR/Function.h"
+#include "llvm/Support/CommandLine.h"
+
+#include <algorithm>
+#include <deque>
+#include <queue>
+
+#include "SB_PATHPROF.h"
+#include "SB_SELECT.h"
+
+using namespace llvm;
+using namespace std;
+
+static cl::opt<SuperBlock::TraceSelector> Selector("sb-selector",
+    cl::init(SuperBlock::TraceSelector::Greedy),
+    cl::desc("Trace selection algorithm of -psbpass"),
+    cl::values(clEnumValN(SuperBlock::TraceSelector::Greedy, "greedy",
+                          "Grow from the hottest block along edges above the threshold"),
+               clEnumValN(SuperBlock::TraceSelector::MutualMostLikely, "mml",
+                          "Join blocks that are each other's most likely neighbour"),
+               clEnumValN(SuperBlock::TraceSelector::PettisHansen, "pettis-hansen",
+                          "Merge chains along the hottest edges first"),
+               clEnumValN(SuperBlock::TraceSelector::ExtTSP, "exttsp",
+                          "Merge chains by ExtTSP score gain"),
+               clEnumValN(SuperBlock::TraceSelector::HotPaths, "paths",
+                          "Follow the hottest paths of -sb-path-profile")));
+
+// ExtTSP score of a jump (Newell and Pupyrev), distances in bytes.
+static const double ForwardWeight = 0.1;
+static const double BackwardWeight = 0.1;
+static const double ForwardDistance = 1024;
+static const double BackwardDistance = 640;
+
+namespace SuperBlock {
+
+TraceSelector traceSelector(Function &F) {
+  if (Selector == TraceSelector::HotPaths && !hasPathProfile(F)) {
+    return TraceSelector::Greedy;
+  }
+  return Selector;
+}
+
+
+namespace {
+// Blocks of G grouped into chains, each a path of the CFG. Chains are only
+// ever concatenated, tail of one to head of the other.
+struct Chains {
+  const TraceGraph &G;
+  unsigned MaxLength;
+  vector<unsigned> ChainOf;         // block -> chain
+  vector<deque<unsigned>> Members;  // chain -> blocks, empty once merged away
+  vector<unsigned> Stamp;           // chain -> when it last changed
+  unsigned Clock = 0;
+  // Code layout of each chain, for ExtTSP: a block starts Offset - Start of
+  // its chain bytes into the chain, which is Bytes long.
+  vector<double> Size, Offset, Start, Bytes;
+
+  Chains(const TraceGraph &G, unsigned MaxLength)
+      : G(G), MaxLength(MaxLength), ChainOf(G.size()), Members(G.size()), Stamp(G.size(), 0),
+        Size(G.size()), Offset(G.size(), 0), Start(G.size(), 0), Bytes(G.size()) {
+    for (unsigned b = 0; b < G.size(); ++b) {
+      ChainOf[b] = b;
+      Members[b].push_back(b);
+      Size[b] = Bytes[b] = 4.0 * G.Blocks[b]->sizeWithoutDebug();  // roughly
+    }
+  }
+
+  double position(unsigned B) const { return Offset[B] - Start[ChainOf[B]]; }
+
+  // Src -> E.BB can become a fall-through inside a trace.
+  bool canJoin(unsigned Src, const TraceEdge &E) const {
+    unsigned x = ChainOf[Src], y = ChainOf[E.BB];
+    if (E.Backedge || x == y || Members[x].back() != Src || Members[y].front() != E.BB) {
+      return false;
+    }
+    return !MaxLength || Members[x].size() + Members[y].size() <= MaxLength;
+  }
+
+  // Appends the chain starting at Dst to the chain ending at Src; returns the
+  // chain holding both. Only the smaller of the two is relabelled.
+  unsigned join(unsigned Src, unsigned Dst) {
+    unsigned x = ChainOf[Src], y = ChainOf[Dst];
+    if (Members[x].size() >= Members[y].size()) {
+      for (unsigned b : Members[y]) {
+        Offset[b] = Start[x] + Bytes[x] + position(b);
+        ChainOf[b] = x;
+        Members[x].push_back(b);
+      }
+      Members[y].clear();
+      Bytes[x] += Bytes[y];
+      Stamp[x] = ++Clock;
+      return x;
+    }
+    for (auto it = Members[x].rbegin(); it != Members[x].rend(); ++it) {
+      Offset[*it] = Start[y] - Bytes[x] + position(*it);
+      ChainOf[*it] = y;
+      Members[y].push_front(*it);
+    }
+    Members[x].clear();
+    Start[y] -= Bytes[x];
+    Bytes[y] += Bytes[x];
+    Stamp[y] = ++Clock;
+    return y;
+  }
+
+  // Joins along Edges in the given order wherever that is still possible.
+  void joinAll(const vector<pair<unsigned, const TraceEdge*>> &Edges) {
+    for (auto &edge : Edges) {
+      if (canJoin(edge.first, *edge.second)) {
+        join(edge.first, edge.second->BB);
+      }
+    }
+  }
+
+  TraceSet traces() const {
+    TraceSet TS(G);
+    for (unsigned b : G.hottestFirst()) {
+      if (TS.TraceOf[b] >= 0) {
+        continue;
+      }
+      int id = TS.Traces.size();
+      TS.Traces.emplace_back();
+      for (unsigned m : Members[ChainOf[b]]) {
+        TS.Traces.back().push_back(G.Blocks[m]);
+        TS.TraceOf[m] = id;
+      }
+    }
+    return TS;
+  }
+};
+
+
+// Hottest first; ties keep CFG order so the result is deterministic.
+void sortByWeight(const TraceGraph &G, vector<pair<unsigned, const TraceEdge*>> &Edges) {
+  stable_sort(Edges.begin(), Edges.end(), [&](const pair<unsigned, const TraceEdge*> &A,
+                                             const pair<unsigned, const TraceEdge*> &B) {
+    return G.weight(A.first, *A.second) > G.weight(B.first, *B.second);
+  });
+}
+
+
+void mutualMostLikely(Chains &C) {
+  const TraceGraph &G = C.G;
+  vector<pair<unsigned, const TraceEdge*>> edges;
+  for (unsigned b = 0; b < G.size(); ++b) {
+    const TraceEdge *succ = nullptr;
+    for (const TraceEdge &E : G.Succs[b]) {
+      if (!E.Backedge && E.BB != b && (!succ || E.Prob > succ->Prob)) {
+        succ = &E;
+      }
+    }
+    if (!succ) {
+      continue;
+    }
+    const TraceEdge *pred = nullptr;
+    for (const TraceEdge &E : G.Preds[succ->BB]) {
+      if (!E.Backedge && E.BB != succ->BB && (!pred || G.weight(E.BB, E) > G.weight(pred->BB, *pred))) {
+        pred = &E;
+      }
+    }
+    if (pred && pred->BB == b) {
+      edges.push_back({b, succ});
+    }
+  }
+  sortByWeight(G, edges);
+  C.joinAll(edges);
+}
+
+
+void pettisHansen(Chains &C) {
+  const TraceGraph &G = C.G;
+  vector<pair<unsigned, const TraceEdge*>> edges;
+  for (unsigned b = 0; b < G.size(); ++b) {
+    for (const TraceEdge &E : G.Succs[b]) {
+      if (!E.Backedge && E.BB != b && G.weight(b, E) > 0) {
+        edges.push_back({b, &E});
+      }
+    }
+  }
+  sortByWeight(G, edges);
+  C.joinAll(edges);
+}
+
+
+// Greedy ExtTSP chain merging restricted to concatenations along an edge,
+// since a trace has to stay a path. Merging two chains only changes the
+// score of the edges between them, so each candidate's gain stays valid
+// until one of its chains changes; stale ones are dropped as they come up.
+void extTSP(Chains &C) {
+  const TraceGraph &G = C.G;
+  auto jumpScore = [&](double w, double from, double to) {
+    if (to == from) {
+      return w;
+    }
+    if (to > from) {
+      return to - from <= ForwardDistance ? ForwardWeight * w * (1 - (to - from) / ForwardDistance) : 0;
+    }
+    return from - to <= BackwardDistance ? BackwardWeight * w * (1 - (from - to) / BackwardDistance) : 0;
+  };
+  // Score of the edges between chains x and y once y follows x, found from
+  // the smaller of the two.
+  auto gain = [&](unsigned x, unsigned y) {
+    auto at = [&](unsigned b) { return C.position(b) + (C.ChainOf[b] == y ? C.Bytes[x] : 0); };
+    unsigned small = C.Members[x].size() <= C.Members[y].size() ? x : y;
+    unsigned other = small == x ? y : x;
+    double score = 0;
+    for (unsigned b : C.Members[small]) {
+      for (const TraceEdge &E : G.Succs[b]) {
+        if (C.ChainOf[E.BB] == other) {
+          score += jumpScore(G.weight(b, E), at(b) + C.Size[b], at(E.BB));
+        }
+      }
+      for (const TraceEdge &E : G.Preds[b]) {
+        if (C.ChainOf[E.BB] == other) {
+          score += jumpScore(G.weight(E.BB, E), at(E.BB) + C.Size[E.BB], at(b));
+        }
+      }
+    }
+    return score;
+  };
+
+  struct Candidate {
+    double Gain;
+    unsigned Src;
+    const TraceEdge *E;
+    unsigned StampX, StampY;
+    bool operator<(const Candidate &O) const { return Gain < O.Gain; }
+  };
+  priority_queue<Candidate> queue;
+  auto propose = [&](unsigned src, const TraceEdge &E) {
+    if (!C.canJoin(src, E)) {
+      return;
+    }
+    unsigned x = C.ChainOf[src], y = C.ChainOf[E.BB];
+    double g = gain(x, y);
+    if (g > 0) {
+      queue.push({g, src, &E, C.Stamp[x], C.Stamp[y]});
+    }
+  };
+  for (unsigned b = 0; b < G.size(); ++b) {
+    for (const TraceEdge &E : G.Succs[b]) {
+      propose(b, E);
+    }
+  }
+  while (!queue.empty()) {
+    Candidate cand = queue.top();
+    queue.pop();
+    unsigned x = C.ChainOf[cand.Src], y = C.ChainOf[cand.E->BB];
+    if (C.Stamp[x] != cand.StampX || C.Stamp[y] != cand.StampY || !C.canJoin(cand.Src, *cand.E)) {
+      continue;
+    }
+    unsigned z = C.join(cand.Src, cand.E->BB);
+    unsigned tail = C.Members[z].back(), head = C.Members[z].front();
+    for (const TraceEdge &E : G.Succs[tail]) {
+      propose(tail, E);
+    }
+    for (const TraceEdge &E : G.Preds[head]) {
+      for (const TraceEdge &S : G.Succs[E.BB]) {
+        if (S.BB == head) {
+          propose(E.BB, S);
+        }
+      }
+    }
+  }
+}
+
+
+// A path's edges, hottest path first. Joining fails where a block already
+// sits inside another chain, so a colder path that overlaps a hotter one
+// only contributes its pieces around it.
+void hotPathChains(Chains &C) {
+  const TraceGraph &G = C.G;
+  for (auto &path : hotPaths(*G.Blocks.front()->getParent())) {
+    for (unsigned i = 1; i < path.second.size(); ++i) {
+      unsigned src = G.Index.lookup(path.second[i - 1]), dst = G.Index.lookup(path.second[i]);
+      for (const TraceEdge &E : G.Succs[src]) {
+        if (E.BB == dst && C.canJoin(src, E)) {
+          C.join(src, dst);
+        }
+      }
+    }
+  }
+}
+} // end of anonymous namespace
+
+
+TraceSet formChainedTraces(const TraceGraph &G, TraceSelector Algo, unsigned MaxLength) {
+  Chains C(G, MaxLength);
+  switch (Algo) {
+  case TraceSelector::MutualMostLikely:
+    mutualMostLikely(C);
+    break;
+  case TraceSelector::PettisHansen:
+    pettisHansen(C);
+    break;
+  case TraceSelector::ExtTSP:
+    extTSP(C);
+    break;
+  case TraceSelector::HotPaths:
+    hotPathChains(C);
+    break;
+  case TraceSelector::Greedy:
+    break;
+  }
+  return C.traces();
+}
+
+} // end of namespace SuperBlock
@@ -0,0 +1,42 @@
+//===-- SB_SELECT.h - Trace selection algorithms ---------------------------===//
+//
+// -psbpass forms traces with its greedy grower by default. -sb-selector picks
+// another algorithm instead; these build traces bottom up, by merging chains
+// of blocks along CFG edges, so every trace is still a path of the CFG that
+// never follows a back edge:
+//
+//   mml           mutual most likely: B follows A if B is A's likeliest
+//                 successor and A is B's likeliest predecessor
+//   pettis-hansen edges taken hottest first, joining the chain ending at the
+//                 source to the chain starting at the target
+//   exttsp        the concatenation that adds the most to the ExtTSP layout
+//                 score (fall-throughs plus short jumps) taken first
+//   paths         the edges of the hottest Ball-Larus paths of
+//                 -sb-path-profile (SB_PATHPROF.h) joined first, so traces
+//                 follow paths that actually ran end to end
+//
+//===----------------------------------------------------------------------===//
+#ifndef SB_SELECT_H
+#define SB_SELECT_H
+
+#include "SB_TRACE.h"
+
+namespace llvm {
+class Function;
+} // end of namespace llvm
+
+namespace SuperBlock {
+enum class TraceSelector { Greedy, MutualMostLikely, PettisHansen, ExtTSP, HotPaths };
+
+// The algorithm chosen with -sb-selector for F: Greedy instead of HotPaths
+// when the path profile has nothing for F.
+TraceSelector traceSelector(llvm::Function &F);
+
+// Forms the traces of G with Algo, which must not be Greedy (the passes grow
+// those themselves). No trace gets more than MaxLength blocks unless
+// MaxLength is 0. Traces come in the order of their hottest block, every
+// block of G in exactly one of them.
+TraceSet formChainedTraces(const TraceGraph &G, TraceSelector Algo, unsigned MaxLength);
+} // end of namespace SuperBlock
+
+#endif
@@ -0,0 +1,336 @@
+//===-- SB_SPLIT.cpp - Hot/cold splitting along superblock boundaries -----===//
+//
+// See SB_SPLIT.h.
+//
+//===----------------------------------------------------------------------===//
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/PostOrderIterator.h"
+#include "llvm/ADT/SetVector.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Intrinsics.h"
+#include "llvm/IR/Metadata.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Pass.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Transforms/Utils/CodeExtractor.h"
+
+#include <string>
+
+#include "SB_BUDGET.h"
+#include "SB_PLUGIN.h"
+#include "SB_SPLIT.h"
+
+using namespace llvm;
+using namespace std;
+
+static cl::opt<bool> SplitTraces("sb-split-traces", cl::init(false),
+    cl::desc("Have -psbpass record its traces for sb-hot-cold-split, which "
+             "then keeps them whole"));
+
+static cl::opt<unsigned> ColdPercent("sb-cold-percent", cl::init(1),
+    cl::desc("Blocks run less than this percent as often as the function entry are cold"));
+
+static cl::opt<unsigned> ColdMinSize("sb-cold-min-size", cl::init(8),
+    cl::desc("Smallest cold region (TCK_CodeSize) worth outlining"));
+
+static cl::opt<std::string> ColdSection("sb-cold-section", cl::init(""),
+    cl::desc("Section for the outlined cold functions (default: where the "
+             "target puts functions)"));
+
+namespace SuperBlock {
+
+static const char *TraceMD = "sb.trace";
+
+void markTraces(Function &F, const vector<vector<BasicBlock*>> &Traces) {
+  // sb-hot-cold-split only looks at functions with a profile.
+  if (!SplitTraces || !F.getEntryCount()) {
+    return;
+  }
+  IntegerType *Int32 = Type::getInt32Ty(F.getContext());
+  DenseMap<const BasicBlock*, MDNode*> marks;
+  for (unsigned t = 0; t < Traces.size(); ++t) {
+    MDNode *id = MDNode::get(F.getContext(), ConstantAsMetadata::get(ConstantInt::get(Int32, t)));
+    for (BasicBlock *BB : Traces[t]) {
+      marks[BB] = id;
+    }
+  }
+  for (BasicBlock &BB : F) {
+    BB.getTerminator()->setMetadata(TraceMD, marks.lookup(&BB));
+  }
+}
+
+
+// Drops the marks of markTraces() from every function of M, outlined or not,
+// so they never outlive sb-hot-cold-split.
+static void stripTraceMarks(Module &M) {
+  for (Function &F : M) {
+    for (BasicBlock &BB : F) {
+      BB.getTerminator()->setMetadata(TraceMD, nullptr);
+    }
+  }
+}
+
+
+// The traces markTraces() left in F, each in the order of F's blocks.
+static vector<vector<BasicBlock*>> markedTraces(Function &F) {
+  DenseMap<uint64_t, unsigned> index;
+  vector<vector<BasicBlock*>> traces;
+  for (BasicBlock &BB : F) {
+    MDNode *id = BB.getTerminator()->getMetadata(TraceMD);
+    if (!id || id->getNumOperands() != 1) {
+      continue;
+    }
+    auto *C = mdconst::dyn_extract<ConstantInt>(id->getOperand(0));
+    if (!C) {
+      continue;
+    }
+    auto inserted = index.insert({C->getZExtValue(), unsigned(traces.size())});
+    if (inserted.second) {
+      traces.emplace_back();
+    }
+    traces[inserted.first->second].push_back(&BB);
+  }
+  return traces;
+}
+
+
+// Blocks CodeExtractor may take out of F without breaking it (the same
+// limits as LLVM's hot/cold splitting).
+static bool mayOutline(const BasicBlock &BB) {
+  if (BB.hasAddressTaken() || BB.isEHPad() || isa<ResumeInst>(BB.getTerminator()) ||
+      isa<CallBrInst>(BB.getTerminator())) {
+    return false;
+  }
+  for (const Instruction &I : BB) {
+    auto *CI = dyn_cast<CallInst>(&I);
+    if (CI && (CI->isMustTailCall() || CI->getIntrinsicID() == Intrinsic::eh_typeid_for)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+bool splitColdCode(Function &F, const BlockFrequencyInfo &BFI, const DominatorTree &DT,
+                   const TargetTransformInfo &TTI, OptimizationRemarkEmitter *ORE) {
+  auto entryCount = F.getEntryCount();
+  if (!entryCount || F.hasFnAttribute(Attribute::Cold)) {
+    return false;
+  }
+  vector<vector<BasicBlock*>> Traces = markedTraces(F);
+
+  DenseMap<const BasicBlock*, int> traceOf;
+  for (unsigned t = 0; t < Traces.size(); ++t) {
+    for (BasicBlock *BB : Traces[t]) {
+      traceOf[BB] = t;
+    }
+  }
+  auto coldBlock = [&](const BasicBlock *BB) {
+    uint64_t count = BFI.getBlockProfileCount(BB).getValueOr(0);
+    return BB != &F.getEntryBlock() && double(count) * 100 < double(entryCount->getCount()) * ColdPercent &&
+           mayOutline(*BB);
+  };
+  // A trace is only as cold as its hottest block.
+  vector<bool> coldTrace(Traces.size(), true);
+  for (unsigned t = 0; t < Traces.size(); ++t) {
+    for (BasicBlock *BB : Traces[t]) {
+      coldTrace[t] = coldTrace[t] && coldBlock(BB);
+    }
+  }
+  auto cold = [&](const BasicBlock *BB) {
+    auto it = traceOf.find(BB);
+    return it == traceOf.end() ? coldBlock(BB) : coldTrace[it->second];
+  };
+
+  // Grow single-entry regions from headers in reverse post order: a block
+  // joins the region of the header that dominates it once all its forward
+  // predecessors are in.
+  ReversePostOrderTraversal<Function*> RPOT(&F);
+  SmallPtrSet<const BasicBlock*, 16> taken;
+  vector<SetVector<BasicBlock*>> regions;
+  for (BasicBlock *header : RPOT) {
+    if (taken.count(header) || !cold(header)) {
+      continue;
+    }
+    SetVector<BasicBlock*> region;
+    region.insert(header);
+    auto entered = [&](BasicBlock *BB) {
+      return all_of(predecessors(BB), [&](BasicBlock *pred) {
+        return region.count(pred) || DT.dominates(BB, pred);
+      });
+    };
+    for (unsigned i = 0; i < region.size(); ++i) {
+      for (BasicBlock *succ : successors(region[i])) {
+        if (!region.count(succ) && !taken.count(succ) && cold(succ) &&
+            DT.dominates(header, succ) && entered(succ)) {
+          region.insert(succ);
+        }
+      }
+    }
+    // Drop blocks entered from outside (loops whose latch stayed out) and
+    // traces the region only has part of, until neither is left.
+    DenseMap<int, unsigned> members;
+    for (BasicBlock *BB : region) {
+      auto t = traceOf.find(BB);
+      if (t != traceOf.end()) {
+        ++members[t->second];
+      }
+    }
+    auto partial = [&](BasicBlock *BB) {
+      auto t = traceOf.find(BB);
+      return t != traceOf.end() && members[t->second] < Traces[t->second].size();
+    };
+    SmallVector<BasicBlock*, 16> worklist(region.begin() + 1, region.end());
+    while (!worklist.empty() && region.count(header)) {
+      BasicBlock *BB = worklist.pop_back_val();
+      if (BB == header || !region.count(BB) ||
+          (!partial(BB) && all_of(predecessors(BB), [&](BasicBlock *pred) { return region.count(pred); }))) {
+        continue;
+      }
+      region.remove(BB);
+      auto t = traceOf.find(BB);
+      if (t != traceOf.end()) {
+        --members[t->second];
+        worklist.append(Traces[t->second].begin(), Traces[t->second].end());
+      }
+      worklist.append(succ_begin(BB), succ_end(BB));
+    }
+    if (partial(header)) {
+      continue;
+    }
+    unsigned size = 0;
+    for (BasicBlock *BB : region) {
+      size += codeSize(*BB, TTI);
+    }
+    if (size < ColdMinSize) {
+      continue;
+    }
+    taken.insert(region.begin(), region.end());
+    regions.push_back(std::move(region));
+  }
+  if (regions.empty()) {
+    return false;
+  }
+
+  bool modified = false;
+  unsigned outlinedCount = 0;
+  CodeExtractorAnalysisCache CEAC(F);
+  for (auto &region : regions) {
+    BasicBlock *header = region.front();
+    OptimizationRemark remark("sb-hot-cold-split", "HotColdSplit", header->getFirstNonPHI());
+    // The regions are single-entry by construction, so the extractor can do
+    // without a dominator tree.
+    CodeExtractor CE(region.getArrayRef(), nullptr, /*AggregateArgs*/ false, nullptr, nullptr, nullptr,
+                     /*AllowVarArgs*/ false, /*AllowAlloca*/ false,
+                     "cold." + to_string(outlinedCount + 1));
+    if (!CE.isEligible()) {
+      continue;
+    }
+    Function *outlined = CE.extractCodeRegion(CEAC);
+    if (!outlined) {
+      continue;
+    }
+    modified = true;
+    ++outlinedCount;
+    outlined->addFnAttr(Attribute::Cold);
+    outlined->addFnAttr(Attribute::MinSize);
+    if (!ColdSection.empty()) {
+      outlined->setSection(ColdSection);
+    }
+    for (User *U : outlined->users()) {
+      if (auto *CI = dyn_cast<CallInst>(U)) {
+        CI->setIsNoInline();
+      }
+    }
+    if (ORE) {
+      remark << "outlined " << ore::NV("Blocks", unsigned(region.size())) << " cold blocks of "
+             << ore::NV("Function", &F) << " into " << ore::NV("Outlined", outlined);
+      ORE->emit(remark);
+    }
+  }
+  return modified;
+}
+
+
+namespace {
+// Both passes only visit the functions that were there before: the cold
+// functions they add are not split again. Dropping the trace marks changes
+// no analysis and is not reported as a change.
+struct SBHotColdSplitNPM : PassInfoMixin<SBHotColdSplitNPM> {
+  PreservedAnalyses run(Module &M, ModuleAnalysisManager &MAM) {
+    FunctionAnalysisManager &FAM = MAM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+    vector<Function*> functions;
+    for (Function &F : M) {
+      if (!F.isDeclaration()) {
+        functions.push_back(&F);
+      }
+    }
+    bool changed = false;
+    for (Function *F : functions) {
+      if (splitColdCode(*F, FAM.getResult<BlockFrequencyAnalysis>(*F),
+                        FAM.getResult<DominatorTreeAnalysis>(*F), FAM.getResult<TargetIRAnalysis>(*F),
+                        &FAM.getResult<OptimizationRemarkEmitterAnalysis>(*F))) {
+        FAM.invalidate(*F, PreservedAnalyses::none());
+        changed = true;
+      }
+    }
+    stripTraceMarks(M);
+    return changed ? PreservedAnalyses::none() : PreservedAnalyses::all();
+  }
+};
+
+struct SBHotColdSplit : public ModulePass {
+  static char ID;
+  SBHotColdSplit() : ModulePass(ID) {}
+
+  void getAnalysisUsage(AnalysisUsage &AU) const override {
+    AU.addRequired<BlockFrequencyInfoWrapperPass>();
+    AU.addRequired<DominatorTreeWrapperPass>();
+    AU.addRequired<TargetTransformInfoWrapperPass>();
+  }
+
+  bool runOnModule(Module &M) override {
+    vector<Function*> functions;
+    for (Function &F : M) {
+      if (!F.isDeclaration()) {
+        functions.push_back(&F);
+      }
+    }
+    bool changed = false;
+    for (Function *F : functions) {
+      // Each getAnalysis(*F) reruns both on F; the second leaves them in step.
+      DominatorTree &DT = getAnalysis<DominatorTreeWrapperPass>(*F).getDomTree();
+      BlockFrequencyInfo &BFI = getAnalysis<BlockFrequencyInfoWrapperPass>(*F).getBFI();
+      OptimizationRemarkEmitter ORE(F, &BFI);
+      changed |= splitColdCode(*F, BFI, DT, getAnalysis<TargetTransformInfoWrapperPass>().getTTI(*F), &ORE);
+    }
+    stripTraceMarks(M);
+    return changed;
+  }
+};
+} // end of anonymous namespace
+
+
+void registerSplitPasses(PassBuilder &PB) {
+  PB.registerPipelineParsingCallback(
+      [](StringRef Name, ModulePassManager &MPM, ArrayRef<PassBuilder::PipelineElement>) {
+        if (Name == "sb-hot-cold-split") {
+          MPM.addPass(SBHotColdSplitNPM());
+          return true;
+        }
+        return false;
+      });
+}
+
+} // end of namespace SuperBlock
+
+char SuperBlock::SBHotColdSplit::ID = 0;
+static RegisterPass<SuperBlock::SBHotColdSplit> S("sb-hot-cold-split",
+                                                  "Outline the cold code around superblocks");
@@ -0,0 +1,57 @@
+//===-- SB_SPLIT.h - Hot/cold splitting along superblock boundaries -------===//
+//
+// Tail duplication leaves the side-entrance originals and the cold side
+// exits of a trace in the function next to the hot superblocks they were
+// split from, where they still take up i-cache lines and pages. The
+// sb-hot-cold-split module pass moves them out once -psbpass is done:
+// single-entry regions of blocks run less than -sb-cold-percent percent as
+// often as the function entry are outlined with CodeExtractor into F.cold.N
+// functions, marked cold and minsize, called through a noinline call (and
+// placed in -sb-cold-section if one is named):
+//
+//   opt -load LLVMSB.so -load-pass-plugin=LLVMSB.so -sb-split-traces
+//       -passes='pgo-instr-use,psbpass,sb-hot-cold-split' in.bc ...
+//
+// It is a module pass of its own, like LLVM's hotcoldsplit, because a
+// function pass must not add functions to the module.
+//
+// Traces are the unit of splitting: a block of a trace is only cold if every
+// block of its trace is, and a region that would take part of a trace gives
+// the whole trace back, so no superblock straddles the boundary. Under
+// -sb-split-traces, -psbpass hands its traces over as !sb.trace !{i32 N} on
+// the terminator of each of their blocks (markTraces()); sb-hot-cold-split
+// drops every such mark once it is done. Without them it splits blocks by
+// their own counts alone.
+//
+//===----------------------------------------------------------------------===//
+#ifndef SB_SPLIT_H
+#define SB_SPLIT_H
+
+#include "llvm/IR/BasicBlock.h"
+
+#include <vector>
+
+namespace llvm {
+class BlockFrequencyInfo;
+class DominatorTree;
+class Function;
+class OptimizationRemarkEmitter;
+class TargetTransformInfo;
+} // end of namespace llvm
+
+namespace SuperBlock {
+// Records Traces on F's blocks as !sb.trace metadata for sb-hot-cold-split,
+// replacing what an earlier run recorded. Does nothing without
+// -sb-split-traces or a function entry count.
+void markTraces(llvm::Function &F, const std::vector<std::vector<llvm::BasicBlock *>> &Traces);
+
+// Outlines the cold regions of F as described above, keeping the traces
+// recorded by markTraces() whole. Needs a profile (a function entry count).
+// Regions smaller than -sb-cold-min-size (TCK_CodeSize) stay. Every analysis
+// of F is stale afterwards.
+bool splitColdCode(llvm::Function &F, const llvm::BlockFrequencyInfo &BFI,
+                   const llvm::DominatorTree &DT, const llvm::TargetTransformInfo &TTI,
+                   llvm::OptimizationRemarkEmitter *ORE);
+} // end of namespace SuperBlock
+
+#endif
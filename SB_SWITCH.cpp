@@ -0,0 +1,278 @@
+//===-- SB_SWITCH.cpp - Peeling hot switch cases into branches ------------===//
+//
+// See SB_SWITCH.h.
+//
+//===----------------------------------------------------------------------===//
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/Analysis/BranchProbabilityInfo.h"
+#include "llvm/Analysis/DomTreeUpdater.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Pass.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/CommandLine.h"
+
+#include <algorithm>
+
+#include "SB_PLUGIN.h"
+#include "SB_SWITCH.h"
+#include "SB_UTILS.h"
+
+using namespace llvm;
+using namespace std;
+
+static cl::opt<bool> SwitchSplit("sb-switch-split", cl::init(true),
+    cl::desc("Peel the case a -psbpass trace follows out of its switch"));
+
+static cl::opt<unsigned> SwitchMaxValues("sb-switch-max-values", cl::init(4),
+    cl::desc("Most case values one peeled compare-and-branch tests"));
+
+static cl::opt<unsigned> PeelCases("sb-switch-peel-cases", cl::init(3),
+    cl::desc("Most cases -sb-switch-peel peels off one switch"));
+
+static cl::opt<unsigned> PeelPercent("sb-switch-peel-percent", cl::init(20),
+    cl::desc("How often (percent of the switch's executions) a case must be "
+             "taken for -sb-switch-peel to peel it"));
+
+static cl::opt<unsigned> PeelMinCases("sb-switch-peel-min-cases", cl::init(4),
+    cl::desc("Fewest cases a switch needs for -sb-switch-peel to touch it"));
+
+namespace SuperBlock {
+
+BasicBlock *peelSwitchCase(SwitchInst *SI, BasicBlock *Dest, const BranchProbabilityInfo *BPI,
+                           DomTreeUpdater *DTU, LoopInfo *LI) {
+  BasicBlock *BB = SI->getParent();
+  if (Dest == SI->getDefaultDest()) {
+    return nullptr;
+  }
+  SmallVector<ConstantInt*, 4> values;
+  for (auto C : SI->cases()) {
+    if (C.getCaseSuccessor() == Dest) {
+      values.push_back(C.getCaseValue());
+    }
+  }
+  if (values.empty() || values.size() > SwitchMaxValues) {
+    return nullptr;
+  }
+  if (!SI->getMetadata(LLVMContext::MD_prof) && BPI) {
+    SmallVector<uint64_t, 8> weights;
+    for (unsigned i = 0; i < SI->getNumSuccessors(); ++i) {
+      weights.push_back(BPI->getEdgeProbability(BB, i).getNumerator());
+    }
+    setBranchWeights(SI, weights);
+  }
+  bool weighted = SI->getMetadata(LLVMContext::MD_prof);
+
+  BasicBlock *rest = BasicBlock::Create(BB->getContext(), BB->getName() + ".sw", BB->getParent(),
+                                        BB->getNextNode());
+  SI->moveBefore(*rest, rest->end());
+  uint64_t hot = 0, total = 0;
+  {
+    // Keeps the switch's branch_weights in step with its cases.
+    SwitchInstProfUpdateWrapper SIW(*SI);
+    for (unsigned i = 0; i < SI->getNumSuccessors(); ++i) {
+      total += SIW.getSuccessorWeight(i).getValueOr(0);
+    }
+    for (auto it = SI->case_begin(); it != SI->case_end();) {
+      if (it->getCaseSuccessor() == Dest) {
+        hot += SIW.getSuccessorWeight(it->getSuccessorIndex()).getValueOr(0);
+        it = SIW.removeCase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+
+  IRBuilder<> B(BB);
+  Value *cond = nullptr;
+  for (ConstantInt *V : values) {
+    Value *eq = B.CreateICmpEQ(SI->getCondition(), V, "sw.hot");
+    cond = cond ? B.CreateOr(cond, eq, "sw.hot") : eq;
+  }
+  BranchInst *BI = B.CreateCondBr(cond, Dest, rest);
+  if (weighted) {
+    setBranchWeights(BI, {hot, total - hot});
+  }
+  if (SI->getNumCases() == 0) {
+    BranchInst::Create(SI->getDefaultDest(), SI);
+    SI->eraseFromParent();
+  }
+
+  // Dest had one incoming entry per case value and now has one edge from BB.
+  for (PHINode &PN : Dest->phis()) {
+    for (unsigned i = 1; i < values.size(); ++i) {
+      PN.removeIncomingValue(BB, /*DeletePHIIfEmpty*/ false);
+    }
+  }
+  SmallPtrSet<BasicBlock*, 8> moved;
+  vector<DominatorTree::UpdateType> updates;
+  updates.push_back({DominatorTree::Insert, BB, rest});
+  for (BasicBlock *succ : successors(rest)) {
+    if (!moved.insert(succ).second) {
+      continue;
+    }
+    for (PHINode &PN : succ->phis()) {
+      PN.replaceIncomingBlockWith(BB, rest);
+    }
+    updates.push_back({DominatorTree::Delete, BB, succ});
+    updates.push_back({DominatorTree::Insert, rest, succ});
+  }
+  if (DTU) {
+    DTU->applyUpdates(updates);
+  }
+  // rest belongs to the innermost loop of BB that one of its successors is in.
+  if (LI) {
+    Loop *L = LI->getLoopFor(BB);
+    while (L && none_of(moved, [&](BasicBlock *succ) { return L->contains(succ); })) {
+      L = L->getParentLoop();
+    }
+    if (L) {
+      L->addBasicBlockToLoop(rest, *LI);
+    }
+  }
+  return rest;
+}
+
+
+bool splitHotSwitchCases(const vector<vector<BasicBlock*>> &Traces, const BranchProbabilityInfo &BPI,
+                         DomTreeUpdater &DTU, LoopInfo &LI) {
+  if (!SwitchSplit) {
+    return false;
+  }
+  bool modified = false;
+  for (const auto &trace : Traces) {
+    for (unsigned i = 0; i + 1 < trace.size(); ++i) {
+      if (auto *SI = dyn_cast<SwitchInst>(trace[i]->getTerminator())) {
+        modified |= peelSwitchCase(SI, trace[i + 1], &BPI, &DTU, &LI) != nullptr;
+      }
+    }
+  }
+  return modified;
+}
+
+
+bool peelHotSwitches(Function &F, const BranchProbabilityInfo &BPI, DomTreeUpdater &DTU, LoopInfo &LI,
+                     OptimizationRemarkEmitter *ORE) {
+  vector<SwitchInst*> switches;
+  for (Instruction &I : instructions(F)) {
+    if (auto *SI = dyn_cast<SwitchInst>(&I)) {
+      if (SI->getNumCases() >= PeelMinCases) {
+        switches.push_back(SI);
+      }
+    }
+  }
+  bool modified = false;
+  for (SwitchInst *SI : switches) {
+    // BPI only knows the switch in its original block, so rank the cases
+    // before the first peel moves it.
+    BasicBlock *BB = SI->getParent();
+    vector<pair<BasicBlock*, BranchProbability>> hot;
+    SmallPtrSet<BasicBlock*, 8> seen;
+    for (auto C : SI->cases()) {
+      BasicBlock *dest = C.getCaseSuccessor();
+      if (dest == SI->getDefaultDest() || !seen.insert(dest).second) {
+        continue;
+      }
+      BranchProbability prob = BPI.getEdgeProbability(BB, dest);
+      if (prob >= BranchProbability(PeelPercent, 100)) {
+        hot.push_back({dest, prob});
+      }
+    }
+    stable_sort(hot.begin(), hot.end(), [](const pair<BasicBlock*, BranchProbability> &A,
+                                          const pair<BasicBlock*, BranchProbability> &B) {
+      return A.second > B.second;
+    });
+    if (hot.size() > PeelCases) {
+      hot.resize(PeelCases);
+    }
+    OptimizationRemark remark("sb-switch-peel", "PeeledCases", SI);
+    unsigned peeled = 0;
+    for (auto &H : hot) {
+      // A switch whose last cases are peeled is replaced by a branch.
+      bool last = all_of(SI->cases(), [&](const SwitchInst::CaseHandle &C) {
+        return C.getCaseSuccessor() == H.first;
+      });
+      if (!peelSwitchCase(SI, H.first, &BPI, &DTU, &LI)) {
+        continue;
+      }
+      ++peeled;
+      if (last) {
+        break;
+      }
+    }
+    if (peeled) {
+      modified = true;
+      if (ORE) {
+        remark << "peeled " << ore::NV("Cases", peeled) << " hot case(s) of a switch in "
+               << ore::NV("Function", &F);
+        ORE->emit(remark);
+      }
+    }
+  }
+  return modified;
+}
+
+
+namespace {
+struct SBSwitchPeelNPM : PassInfoMixin<SBSwitchPeelNPM> {
+  PreservedAnalyses run(Function &F, FunctionAnalysisManager &FAM) {
+    DomTreeUpdater DTU(FAM.getResult<DominatorTreeAnalysis>(F), DomTreeUpdater::UpdateStrategy::Lazy);
+    OptimizationRemarkEmitter ORE(&F);
+    bool changed = peelHotSwitches(F, FAM.getResult<BranchProbabilityAnalysis>(F), DTU,
+                                   FAM.getResult<LoopAnalysis>(F), &ORE);
+    DTU.flush();
+    if (!changed) {
+      return PreservedAnalyses::all();
+    }
+    PreservedAnalyses PA;
+    PA.preserve<DominatorTreeAnalysis>();
+    PA.preserve<LoopAnalysis>();
+    return PA;
+  }
+};
+
+struct SBSwitchPeel : public FunctionPass {
+  static char ID;
+  SBSwitchPeel() : FunctionPass(ID) {}
+
+  void getAnalysisUsage(AnalysisUsage &AU) const override {
+    AU.addRequired<BranchProbabilityInfoWrapperPass>();
+    AU.addRequired<DominatorTreeWrapperPass>();
+    AU.addRequired<LoopInfoWrapperPass>();
+    AU.addPreserved<DominatorTreeWrapperPass>();
+    AU.addPreserved<LoopInfoWrapperPass>();
+  }
+
+  bool runOnFunction(Function &F) override {
+    DomTreeUpdater DTU(getAnalysis<DominatorTreeWrapperPass>().getDomTree(),
+                       DomTreeUpdater::UpdateStrategy::Lazy);
+    OptimizationRemarkEmitter ORE(&F);
+    bool changed = peelHotSwitches(F, getAnalysis<BranchProbabilityInfoWrapperPass>().getBPI(), DTU,
+                                   getAnalysis<LoopInfoWrapperPass>().getLoopInfo(), &ORE);
+    DTU.flush();
+    return changed;
+  }
+};
+} // end of anonymous namespace
+
+
+void registerSwitchPasses(PassBuilder &PB) {
+  PB.registerPipelineParsingCallback(
+      [](StringRef Name, FunctionPassManager &FPM, ArrayRef<PassBuilder::PipelineElement>) {
+        if (Name == "sb-switch-peel") {
+          FPM.addPass(SBSwitchPeelNPM());
+          return true;
+        }
+        return false;
+      });
+}
+
+} // end of namespace SuperBlock
+
+char SuperBlock::SBSwitchPeel::ID = 0;
+static RegisterPass<SuperBlock::SBSwitchPeel> S("sb-switch-peel", "Peel hot switch cases into branches");
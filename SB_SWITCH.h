@@ -0,0 +1,75 @@
+//===-- SB_SWITCH.h - Peeling hot switch cases into branches --------------===//
+//
+// A trace that runs through a switch (the dispatch of an interpreter loop,
+// the state switch of a lexer) keeps the whole multi-way jump inside the
+// superblock, where the hot case still pays for the jump table or the
+// compare tree. peelSwitchCase() gives that case a compare-and-branch of its
+// own in front of the switch:
+//
+//   BB:     switch %x [a -> Hot, b -> C, ...]
+//
+// becomes
+//
+//   BB:     %sw.hot = icmp eq %x, a
+//           br %sw.hot, Hot, BB.sw          ; branch_weights {hot, rest}
+//   BB.sw:  switch %x [b -> C, ...]
+//
+// so the trace edge is an ordinary two-way branch and the other cases move
+// off the superblock.
+//
+// The sb-switch-peel pass does the same for every switch, trace or not: the
+// one to -sb-switch-peel-cases hottest cases (by BranchProbabilityInfo)
+// taken at least -sb-switch-peel-percent percent of the time become a chain
+// of compare-and-branches, hottest first, ahead of whatever jump table or
+// compare tree the rest of the switch is lowered to:
+//
+//   opt -load LLVMSB.so -load-pass-plugin=LLVMSB.so
+//       -passes='pgo-instr-use,function(sb-switch-peel),psbpass' in.bc ...
+//
+// Switches with fewer than -sb-switch-peel-min-cases cases are left alone;
+// the code generator turns those into compares anyway.
+//
+//===----------------------------------------------------------------------===//
+#ifndef SB_SWITCH_H
+#define SB_SWITCH_H
+
+#include "llvm/IR/BasicBlock.h"
+
+#include <vector>
+
+namespace llvm {
+class BranchProbabilityInfo;
+class DomTreeUpdater;
+class Function;
+class LoopInfo;
+class OptimizationRemarkEmitter;
+class SwitchInst;
+} // end of namespace llvm
+
+namespace SuperBlock {
+// Moves every case of SI that goes to Dest into a compare-and-branch ahead of
+// it, as above. Dest must not be the default destination and may be reached
+// by at most -sb-switch-max-values case values. If SI has no branch_weights,
+// BPI (when given) supplies them first; the weights are split between the new
+// branch and what is left of the switch. A switch left without cases becomes
+// a branch to its default. DTU and LI, when given, are kept up to date.
+// Returns the new block holding the switch, or nullptr if nothing was done.
+llvm::BasicBlock *peelSwitchCase(llvm::SwitchInst *SI, llvm::BasicBlock *Dest,
+                                 const llvm::BranchProbabilityInfo *BPI,
+                                 llvm::DomTreeUpdater *DTU, llvm::LoopInfo *LI);
+
+// Peels, for every trace edge that leaves a switch, the case the trace
+// follows. The new blocks join no trace. Returns true if any case was peeled;
+// does nothing under -sb-switch-split=false.
+bool splitHotSwitchCases(const std::vector<std::vector<llvm::BasicBlock *>> &Traces,
+                         const llvm::BranchProbabilityInfo &BPI,
+                         llvm::DomTreeUpdater &DTU, llvm::LoopInfo &LI);
+
+// Peels the hot cases of every switch of F, as sb-switch-peel does. DTU and
+// LI are kept up to date; BPI is stale afterwards. Returns true if F changed.
+bool peelHotSwitches(llvm::Function &F, const llvm::BranchProbabilityInfo &BPI,
+                     llvm::DomTreeUpdater &DTU, llvm::LoopInfo &LI,
+                     llvm::OptimizationRemarkEmitter *ORE);
+} // end of namespace SuperBlock
+
+#endif
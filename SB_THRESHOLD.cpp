@@ -0,0 +1,80 @@
+//===-- SB_THRESHOLD.cpp - Per-function trace growth threshold -------------===//
+//
+// See SB_THRESHOLD.h.
+//
+//===----------------------------------------------------------------------===//
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/BranchProbabilityInfo.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/Function.h"
+#include "llvm/Support/CommandLine.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "SB_THRESHOLD.h"
+#include "SB_UTILS.h"
+
+using namespace llvm;
+using namespace std;
+
+static cl::opt<unsigned> FixedThreshold("sb-threshold", cl::init(0),
+    cl::desc("Trace growth threshold in percent for every function "
+             "(0: pick one per function from its branch profile)"));
+
+static cl::opt<unsigned> MinThreshold("sb-threshold-min", cl::init(50),
+    cl::desc("Trace growth threshold picked for a function whose branches always go one way"));
+
+static cl::opt<unsigned> MaxThreshold("sb-threshold-max", cl::init(80),
+    cl::desc("Trace growth threshold picked for a function whose branches go either way"));
+
+namespace SuperBlock {
+
+unsigned selectThreshold(Function &F, const BranchProbabilityInfo &BPI, const BlockFrequencyInfo &BFI,
+                         OptimizationRemarkEmitter *ORE, const char *PassName) {
+  unsigned threshold = FixedThreshold;
+  double bias = 1.0;
+  if (!threshold) {
+    double weight = 0, biased = 0;
+    for (BasicBlock &BB : F) {
+      const Instruction *term = BB.getTerminator();
+      if (!term || term->getNumSuccessors() < 2) {
+        continue;
+      }
+      BranchProbability top = BranchProbability::getZero();
+      SmallPtrSet<const BasicBlock*, 4> seen;
+      for (const BasicBlock *succ : successors(&BB)) {
+        if (seen.insert(succ).second) {
+          top = max(top, edgeProbability(&BB, succ, BPI));
+        }
+      }
+      double freq = BFI.getBlockFreq(&BB).getFrequency();
+      weight += freq;
+      biased += freq * top.getNumerator() / top.getDenominator();
+    }
+    if (weight > 0) {
+      bias = max(0.5, biased / weight);
+    }
+    double span = double(MaxThreshold) - double(MinThreshold);
+    threshold = unsigned(lround(MaxThreshold - span * (bias - 0.5) * 2));
+  }
+
+  if (ORE) {
+    ORE->emit([&]() {
+      OptimizationRemarkAnalysis R(PassName, "TraceThreshold", DiagnosticLocation(F.getSubprogram()),
+                                   &F.getEntryBlock());
+      R << "trace growth threshold of " << ore::NV("Function", &F) << ": " << ore::NV("Threshold", threshold) << "%";
+      if (FixedThreshold) {
+        R << " (set by -sb-threshold)";
+      } else {
+        R << " for a weighted branch bias of " << ore::NV("Bias", unsigned(lround(bias * 100))) << "%";
+      }
+      return R;
+    });
+  }
+  return threshold;
+}
+
+} // end of namespace SuperBlock
@@ -0,0 +1,34 @@
+//===-- SB_THRESHOLD.h - Per-function trace growth threshold ---------------===//
+//
+// A trace grows along an edge only if the edge is taken more often than the
+// growth threshold. One fixed percentage suits no function in particular:
+// where nearly every branch is heavily biased, traces can afford to cross the
+// odd unbiased one and should get a lower threshold; where branches are
+// noisy, the same threshold makes long traces that rarely run to the end.
+// selectThreshold() picks the threshold of each function from its profile.
+//
+//===----------------------------------------------------------------------===//
+#ifndef SB_THRESHOLD_H
+#define SB_THRESHOLD_H
+
+namespace llvm {
+class BlockFrequencyInfo;
+class BranchProbabilityInfo;
+class Function;
+class OptimizationRemarkEmitter;
+} // end of namespace llvm
+
+namespace SuperBlock {
+// Trace growth threshold of F, in percent. The bias of a branch is the
+// probability of its likeliest successor; the function's bias is the mean
+// over its branches, each weighted by how often it runs. A bias of 1/2 maps
+// to -sb-threshold-max, a bias of 1 to -sb-threshold-min, linearly in
+// between; a function without branches gets -sb-threshold-min. A nonzero
+// -sb-threshold overrides all of this. The value chosen is reported to ORE,
+// if given, as an analysis remark of pass PassName.
+unsigned selectThreshold(llvm::Function &F, const llvm::BranchProbabilityInfo &BPI,
+                         const llvm::BlockFrequencyInfo &BFI,
+                         llvm::OptimizationRemarkEmitter *ORE, const char *PassName);
+} // end of namespace SuperBlock
+
+#endif
@@ -0,0 +1,89 @@
+//===-- SB_TRACE.cpp - CFG view and result of trace formation --------------===//
+//
+// See SB_TRACE.h.
+//
+//===----------------------------------------------------------------------===//
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/BranchProbabilityInfo.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+
+#include "SB_TRACE.h"
+
+using namespace llvm;
+using namespace std;
+
+namespace SuperBlock {
+
+TraceGraph::TraceGraph(Function &F, BranchProbabilityInfo &bpi, BlockFrequencyInfo &bfi, DominatorTree &dt) {
+  for (BasicBlock &BB : F) {
+    Index[&BB] = Blocks.size();
+    Blocks.push_back(&BB);
+    Count.push_back(bfi.getBlockProfileCount(&BB).getValueOr(0));
+    Freq.push_back(bfi.getBlockFreq(&BB).getFrequency());
+  }
+  unsigned N = Blocks.size();
+  Succs.resize(N);
+  Preds.resize(N);
+
+  // DFS numbers turn every dominance query below into two compares.
+  dt.updateDFSNumbers();
+  vector<DomTreeNode*> Node(N);
+  for (unsigned i = 0; i < N; ++i) {
+    Node[i] = dt.getNode(Blocks[i]);
+  }
+
+  // Seen[t] == b + 1 means block t is already in Succs[b], at Slot[t].
+  vector<unsigned> Seen(N, 0), Slot(N, 0);
+  for (unsigned b = 0; b < N; ++b) {
+    Instruction *term = Blocks[b]->getTerminator();
+    if (!term) {
+      continue;
+    }
+    for (unsigned i = 0, e = term->getNumSuccessors(); i != e; ++i) {
+      unsigned t = Index[term->getSuccessor(i)];
+      BranchProbability prob = bpi.getEdgeProbability(Blocks[b], i);
+      if (Seen[t] == b + 1) {
+        Succs[b][Slot[t]].Prob += prob;
+        continue;
+      }
+      // Same answer as dt.dominates(Succ, CurBB); an unreachable source is
+      // dominated by everything.
+      bool backedge = !Node[b] || (Node[t] &&
+                      Node[t]->getDFSNumIn() <= Node[b]->getDFSNumIn() &&
+                      Node[b]->getDFSNumOut() <= Node[t]->getDFSNumOut());
+      Seen[t] = b + 1;
+      Slot[t] = Succs[b].size();
+      Succs[b].push_back({t, prob, backedge});
+    }
+    for (TraceEdge &E : Succs[b]) {
+      Preds[E.BB].push_back({b, E.Prob, E.Backedge});
+    }
+  }
+}
+
+
+vector<unsigned> TraceGraph::hottestFirst() const {
+  unsigned N = Blocks.size();
+  vector<unsigned> Order(N), Tmp(N);
+  for (unsigned i = 0; i < N; ++i) {
+    Order[i] = i;
+  }
+  for (unsigned shift = 0; shift < 64; shift += 8) {
+    unsigned Bucket[257] = {0};
+    for (unsigned i : Order) {
+      Bucket[((~Count[i] >> shift) & 0xff) + 1]++;
+    }
+    for (unsigned k = 0; k < 256; ++k) {
+      Bucket[k + 1] += Bucket[k];
+    }
+    for (unsigned i : Order) {
+      Tmp[Bucket[(~Count[i] >> shift) & 0xff]++] = i;
+    }
+    Order.swap(Tmp);
+  }
+  return Order;
+}
+
+} // end of namespace SuperBlock
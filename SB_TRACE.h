@@ -0,0 +1,95 @@
+//===-- SB_TRACE.h - CFG view and result of trace formation ----------------===//
+//
+// Trace formation reads the CFG through a TraceGraph and hands its traces on
+// as a TraceSet, whichever algorithm picks them: the greedy growers of
+// -psbpass/-rsbpass in SB_PASS.cpp or the chain builders of SB_SELECT.h.
+//
+//===----------------------------------------------------------------------===//
+#ifndef SB_TRACE_H
+#define SB_TRACE_H
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/Support/BranchProbability.h"
+
+#include <cstdint>
+#include <vector>
+
+namespace llvm {
+class BlockFrequencyInfo;
+class BranchProbabilityInfo;
+class DominatorTree;
+class Function;
+} // end of namespace llvm
+
+namespace SuperBlock {
+// Sentinel returned by best_successor/best_predecessor when the trace stops.
+const unsigned NoBlock = ~0u;
+
+// One CFG edge as seen from trace formation. Parallel edges (e.g. several
+// switch cases to one block) are folded into a single entry whose probability
+// is their sum, exactly what getEdgeProbability(Src, Dst) reports.
+struct TraceEdge {
+  unsigned BB;                  // dense index of the block on the other end
+  llvm::BranchProbability Prob; // probability of the edge, taken from its source
+  bool Backedge;                // target dominates source
+};
+
+
+// Dense, precomputed view of a function's CFG. Blocks are numbered 0..N-1 in
+// layout order and every per-block or per-edge query the trace growers make is
+// answered from these vectors, so forming all traces of a function costs
+// O(blocks + edges): each block is the growing end of a trace at most once per
+// direction and its edge list is scanned once at that point.
+struct TraceGraph {
+  std::vector<llvm::BasicBlock *> Blocks;
+  llvm::DenseMap<const llvm::BasicBlock *, unsigned> Index;
+  std::vector<uint64_t> Count;  // profile count, 0 without a profile
+  std::vector<uint64_t> Freq;   // block frequency, relative to the entry's
+  std::vector<llvm::SmallVector<TraceEdge, 2>> Succs;
+  std::vector<llvm::SmallVector<TraceEdge, 2>> Preds;
+
+  TraceGraph(llvm::Function &F, llvm::BranchProbabilityInfo &bpi, llvm::BlockFrequencyInfo &bfi,
+             llvm::DominatorTree &dt);
+
+  unsigned size() const { return Blocks.size(); }
+
+  // Frequency of the edge from block Src, i.e. how often it is taken.
+  double weight(unsigned Src, const TraceEdge &E) const {
+    return double(Freq[Src]) * E.Prob.getNumerator() / E.Prob.getDenominator();
+  }
+
+  // Block indices ordered by profile count, hottest first. An LSD radix sort
+  // keeps this linear and stable (ties stay in layout order).
+  std::vector<unsigned> hottestFirst() const;
+};
+
+
+// Result of trace formation: the traces in seed order and, per dense block
+// index, the id of the trace holding it.
+struct TraceSet {
+  const TraceGraph &G;
+  std::vector<std::vector<llvm::BasicBlock *>> Traces;
+  std::vector<int> TraceOf;
+
+  TraceSet(const TraceGraph &G) : G(G), TraceOf(G.size(), -1) {}
+
+  // Blocks created after formation (tail copies) belong to no trace.
+  int traceOf(const llvm::BasicBlock *BB) const {
+    auto it = G.Index.find(BB);
+    return it == G.Index.end() ? -1 : TraceOf[it->second];
+  }
+
+  // Recomputes TraceOf after Traces was split or reordered.
+  void renumber() {
+    for (unsigned t = 0; t < Traces.size(); ++t) {
+      for (llvm::BasicBlock *BB : Traces[t]) {
+        TraceOf[G.Index.lookup(BB)] = t;
+      }
+    }
+  }
+};
+} // end of namespace SuperBlock
+
+#endif
@@ -0,0 +1,124 @@
+//===-- SB_TREEGION.cpp - Treegion formation ------------------------------===//
+//
+// See SB_TREEGION.h.
+//
+//===----------------------------------------------------------------------===//
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/BranchProbabilityInfo.h"
+#include "llvm/Analysis/DomTreeUpdater.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/Function.h"
+#include "llvm/Support/CommandLine.h"
+
+#include "SB_TREEGION.h"
+#include "SB_UTILS.h"
+
+using namespace llvm;
+using namespace std;
+
+static cl::opt<unsigned> TreegionThreshold("sb-treegion-threshold", cl::init(20),
+    cl::desc("Probability (percent) of reaching a block from the treegion root "
+             "below which -tsbpass leaves it out of the treegion"));
+
+static cl::opt<unsigned> TreegionMaxDup("sb-treegion-max-dup", cl::init(64),
+    cl::desc("Most instructions -tsbpass tail duplicates into one treegion"));
+
+namespace SuperBlock {
+
+vector<vector<BasicBlock*>> Treegion::paths() const {
+  vector<int> likeliest(Blocks.size(), -1);
+  for (unsigned n = 1; n < Blocks.size(); ++n) {
+    int &best = likeliest[Parent[n]];
+    if (best < 0 || Reach[n] > Reach[best]) {
+      best = n;
+    }
+  }
+  vector<vector<BasicBlock*>> result;
+  for (unsigned n = 0; n < Blocks.size(); ++n) {
+    if (n > 0 && likeliest[Parent[n]] == int(n)) {
+      continue;
+    }
+    result.emplace_back();
+    for (int k = n; k >= 0; k = likeliest[k]) {
+      result.back().push_back(Blocks[k]);
+    }
+  }
+  return result;
+}
+
+
+bool formTreegions(Function &F, const BranchProbabilityInfo &BPI, const BlockFrequencyInfo &BFI,
+                   DomTreeUpdater &DTU, LoopInfo &LI, vector<Treegion> &Treegions) {
+  // Hottest roots first, ties in layout order. Clones made along the way are
+  // placed as soon as they exist, so only the original blocks can be roots.
+  vector<BasicBlock*> roots;
+  for (BasicBlock &BB : F) {
+    roots.push_back(&BB);
+  }
+  stable_sort(roots.begin(), roots.end(), [&](BasicBlock *A, BasicBlock *B) {
+    return BFI.getBlockFreq(A).getFrequency() > BFI.getBlockFreq(B).getFrequency();
+  });
+
+  SmallPtrSet<const BasicBlock*, 32> placed;
+  bool changed = false;
+  for (BasicBlock *root : roots) {
+    if (!placed.insert(root).second) {
+      continue;
+    }
+    Treegion T;
+    T.Blocks.push_back(root);
+    T.Parent.push_back(-1);
+    T.Reach.push_back(1.0);
+    unsigned budget = TreegionMaxDup;
+
+    // Breadth first, so the budget goes to the blocks nearest the root.
+    for (unsigned n = 0; n < T.Blocks.size(); ++n) {
+      BasicBlock *BB = T.Blocks[n];
+      SmallVector<BasicBlock*, 4> succs;
+      for (BasicBlock *succ : successors(BB)) {
+        if (!is_contained(succs, succ)) {
+          succs.push_back(succ);
+        }
+      }
+      for (BasicBlock *succ : succs) {
+        BranchProbability P = edgeProbability(BB, succ, BPI);
+        double reach = T.Reach[n] * P.getNumerator() / P.getDenominator();
+        if (reach * 100 < TreegionThreshold || placed.count(succ)) {
+          continue;
+        }
+        Loop *L = LI.getLoopFor(succ);
+        if (L && L->getHeader() == succ) {
+          continue;  // backedge or loop entry: the loop gets its own treegion
+        }
+
+        BasicBlock *child = succ;
+        if (succ->getUniquePredecessor() != BB) {
+          // Merge point: give this edge a copy of its own.
+          if (succ->size() > budget || !canDuplicateBlock(succ)) {
+            continue;
+          }
+          vector<BasicBlock*> edge = {BB, succ};
+          auto traceOf = [&](const BasicBlock *B) { return B == BB ? 0 : -1; };
+          if (!tailDuplicateTrace(edge, traceOf, &DTU, &LI)) {
+            continue;
+          }
+          child = edge[1];
+          budget -= child->size();
+          placed.insert(child);
+          changed = true;
+        } else {
+          placed.insert(succ);
+        }
+        T.Blocks.push_back(child);
+        T.Parent.push_back(n);
+        T.Reach.push_back(reach);
+      }
+    }
+    Treegions.push_back(std::move(T));
+  }
+  return changed;
+}
+
+} // end of namespace SuperBlock
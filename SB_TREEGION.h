@@ -0,0 +1,55 @@
+//===-- SB_TREEGION.h - Treegion formation ---------------------------------===//
+//
+// A superblock follows one path, so at a branch whose two successors are both
+// warm it keeps one and leaves the other as a side exit. Treegions keep both:
+// a treegion is a single-entry, multiple-exit tree of blocks in which every
+// block but the root has exactly one predecessor, its parent in the tree.
+// Merge points met while growing the tree are tail duplicated, one copy per
+// parent, so the tree shape holds. This suits bimodal branches, which never
+// pass the superblock growth threshold.
+//
+//===----------------------------------------------------------------------===//
+#ifndef SB_TREEGION_H
+#define SB_TREEGION_H
+
+#include "llvm/IR/BasicBlock.h"
+
+#include <vector>
+
+namespace llvm {
+class BlockFrequencyInfo;
+class BranchProbabilityInfo;
+class DomTreeUpdater;
+class Function;
+class LoopInfo;
+} // end of namespace llvm
+
+namespace SuperBlock {
+struct Treegion {
+  std::vector<llvm::BasicBlock *> Blocks;  // root first, parents before children
+  std::vector<int> Parent;                 // index into Blocks, -1 for the root
+  std::vector<double> Reach;               // probability of getting there from the root
+
+  // Splits the tree into paths: each starts at the root or at a child that is
+  // not its parent's likeliest, and goes on through the likeliest child until
+  // a leaf. Every block is on exactly one path and each path is shaped like a
+  // superblock, so scheduleSuperblocks() can take them.
+  std::vector<std::vector<llvm::BasicBlock *>> paths() const;
+};
+
+// Covers F with treegions. Roots are taken hottest first by BFI; a tree grows
+// through every successor edge it reaches with at least
+// -sb-treegion-threshold percent probability from its root, stopping at loop
+// headers and at blocks already placed. A successor that other blocks also
+// branch to is tail duplicated onto the edge (see tailDuplicateTrace()) while
+// the tree's -sb-treegion-max-dup instruction budget lasts, and otherwise
+// left to start a treegion of its own.
+//
+// The treegions are appended to Treegions. Returns true if the CFG changed.
+// DTU and LI are kept up to date; BPI and BFI are not.
+bool formTreegions(llvm::Function &F, const llvm::BranchProbabilityInfo &BPI,
+                   const llvm::BlockFrequencyInfo &BFI, llvm::DomTreeUpdater &DTU,
+                   llvm::LoopInfo &LI, std::vector<Treegion> &Treegions);
+} // end of namespace SuperBlock
+
+#endif
@@ -0,0 +1,292 @@
+//===-- SB_UTILS.cpp - CFG utilities shared by the superblock passes ------===//
+//
+// See SB_UTILS.h.
+//
+//===----------------------------------------------------------------------===//
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/Analysis/BranchProbabilityInfo.h"
+#include "llvm/Analysis/DomTreeUpdater.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/IR/Metadata.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/SSAUpdater.h"
+
+#include "SB_UTILS.h"
+
+using namespace llvm;
+using namespace std;
+
+namespace SuperBlock {
+
+bool canDuplicateBlock(const BasicBlock *BB) {
+  if (BB->isEHPad()) {
+    return false;
+  }
+  const Instruction *term = BB->getTerminator();
+  if (isa<IndirectBrInst>(term) || isa<CallBrInst>(term)) {
+    return false;
+  }
+  for (const Instruction &I : *BB) {
+    if (const auto *CB = dyn_cast<CallBase>(&I)) {
+      if (CB->cannotDuplicate()) {
+        return false;
+      }
+    }
+    // SSAUpdater cannot merge tokens with a PHI.
+    if (I.getType()->isTokenTy() && I.isUsedOutsideOfBlock(BB)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+// Points every edge From -> To at NewTo instead.
+static void redirectEdges(BasicBlock *From, BasicBlock *To, BasicBlock *NewTo) {
+  Instruction *term = From->getTerminator();
+  for (unsigned i = 0, e = term->getNumSuccessors(); i != e; ++i) {
+    if (term->getSuccessor(i) == To) {
+      term->setSuccessor(i, NewTo);
+    }
+  }
+}
+
+
+// Drops the incoming entries of PN that do not come from Keep.
+static void keepOnlyIncoming(PHINode &PN, BasicBlock *Keep) {
+  for (unsigned i = PN.getNumIncomingValues(); i-- > 0;) {
+    if (PN.getIncomingBlock(i) != Keep) {
+      PN.removeIncomingValue(i, false);
+    }
+  }
+}
+
+
+bool tailDuplicateTrace(vector<BasicBlock*> &Trace, TraceOfFn TraceOf,
+                        DomTreeUpdater *DTU, LoopInfo *LI) {
+  if (Trace.size() < 2) {
+    return false;
+  }
+  int id = TraceOf(Trace.front());
+
+  // Find the first side entrance. Traces handed in by heuristic_sb are not
+  // guaranteed to follow CFG edges, so stop at the first one that does not.
+  unsigned first = 1;
+  for (; first < Trace.size(); ++first) {
+    if (!is_contained(successors(Trace[first - 1]), Trace[first])) {
+      return false;
+    }
+    if (any_of(predecessors(Trace[first]),
+               [&](const BasicBlock *pred) { return TraceOf(pred) != id; })) {
+      break;
+    }
+  }
+  if (first == Trace.size()) {
+    return false;
+  }
+  BasicBlock *entryBB = Trace[first - 1];
+  if (isa<IndirectBrInst>(entryBB->getTerminator()) ||
+      isa<CallBrInst>(entryBB->getTerminator())) {
+    return false;
+  }
+
+  // The tail to copy: everything from the side entrance on, up to the first
+  // block that cannot be cloned or is not reached along a CFG edge. The copy
+  // is only reached through entryBB, so it stays inside the loops of its
+  // original only if they also contain entryBB.
+  SmallVector<BasicBlock*, 8> origBBs;
+  for (unsigned i = first; i < Trace.size(); ++i) {
+    if (!canDuplicateBlock(Trace[i]) ||
+        (i > first && !is_contained(successors(Trace[i - 1]), Trace[i]))) {
+      break;
+    }
+    if (LI) {
+      Loop *L = LI->getLoopFor(Trace[i]);
+      if (L && !L->contains(entryBB)) {
+        break;
+      }
+    }
+    origBBs.push_back(Trace[i]);
+  }
+  if (origBBs.empty()) {
+    return false;
+  }
+
+  Function *Parent = entryBB->getParent();
+  ValueToValueMapTy VMap;
+  SmallVector<BasicBlock*, 8> clonedBBs;
+  for (BasicBlock *originalBB : origBBs) {
+    clonedBBs.push_back(CloneBasicBlock(originalBB, VMap, ".sb", Parent));
+    if (LI) {
+      if (Loop *L = LI->getLoopFor(originalBB)) {
+        L->addBasicBlockToLoop(clonedBBs.back(), *LI);
+      }
+    }
+  }
+  // Blocks are deliberately left out of VMap: only the trace edges move to the
+  // clones, side exits keep targeting the original blocks.
+  for (BasicBlock *clonedBB : clonedBBs) {
+    for (Instruction &II : *clonedBB) {
+      RemapInstruction(&II, VMap, RF_NoModuleLevelChanges | RF_IgnoreMissingLocals);
+    }
+  }
+
+  // PHIs at the head of each clone: the first clone is only entered from
+  // entryBB, every later one only from the clone before it.
+  for (unsigned i = 0; i < origBBs.size(); ++i) {
+    BasicBlock *pred = i == 0 ? entryBB : origBBs[i - 1];
+    auto origIt = origBBs[i]->phis().begin();
+    for (PHINode &PN : clonedBBs[i]->phis()) {
+      PHINode &origPN = *origIt++;
+      keepOnlyIncoming(PN, pred);
+      for (unsigned j = 0, e = PN.getNumIncomingValues(); j != e; ++j) {
+        if (i == 0) {
+          // Not remapped: a value flowing in from entryBB is never one of the copies.
+          PN.setIncomingValue(j, origPN.getIncomingValueForBlock(entryBB));
+        } else {
+          PN.setIncomingBlock(j, clonedBBs[i - 1]);
+        }
+      }
+    }
+  }
+
+  // Move the trace edges onto the clones.
+  for (PHINode &PN : origBBs[0]->phis()) {
+    int idx;
+    while ((idx = PN.getBasicBlockIndex(entryBB)) >= 0) {
+      PN.removeIncomingValue(idx, false);
+    }
+  }
+  redirectEdges(entryBB, origBBs[0], clonedBBs[0]);
+  for (unsigned i = 0; i + 1 < origBBs.size(); ++i) {
+    redirectEdges(clonedBBs[i], origBBs[i + 1], clonedBBs[i + 1]);
+  }
+
+  // Every other edge out of a clone is a new edge into an original block
+  // (side exit, or the successor of the last block); give its PHIs the value
+  // the original edge carried, translated to the copy. One entry per edge.
+  for (unsigned i = 0; i < origBBs.size(); ++i) {
+    for (BasicBlock *succ : successors(clonedBBs[i])) {
+      if (i + 1 < origBBs.size() && succ == clonedBBs[i + 1]) {
+        continue;
+      }
+      for (PHINode &PN : succ->phis()) {
+        Value *V = PN.getIncomingValueForBlock(origBBs[i]);
+        Value *clonedV = VMap.lookup(V);
+        PN.addIncoming(clonedV ? clonedV : V, clonedBBs[i]);
+      }
+    }
+  }
+
+  if (DTU) {
+    SmallVector<DominatorTree::UpdateType, 16> updates;
+    updates.push_back({DominatorTree::Delete, entryBB, origBBs[0]});
+    updates.push_back({DominatorTree::Insert, entryBB, clonedBBs[0]});
+    for (BasicBlock *clonedBB : clonedBBs) {
+      SmallPtrSet<BasicBlock*, 4> seen;
+      for (BasicBlock *succ : successors(clonedBB)) {
+        if (seen.insert(succ).second) {
+          updates.push_back({DominatorTree::Insert, clonedBB, succ});
+        }
+      }
+    }
+    DTU->applyUpdates(updates);
+  }
+
+  // Values of the copied blocks now have two definitions.
+  repairSSA(origBBs, {&VMap});
+
+  std::copy(clonedBBs.begin(), clonedBBs.end(), Trace.begin() + first);
+  Trace.resize(first + clonedBBs.size());
+  return true;
+}
+
+
+void repairSSA(ArrayRef<BasicBlock*> Blocks, ArrayRef<const ValueToValueMapTy*> Copies) {
+  // Snapshot the definitions first: SSAUpdater may place PHIs in later blocks
+  // of Blocks, and those have no copies.
+  SmallVector<Instruction*, 64> defs;
+  for (BasicBlock *BB : Blocks) {
+    for (Instruction &I : *BB) {
+      defs.push_back(&I);
+    }
+  }
+
+  SSAUpdater SSA;
+  SmallVector<Use*, 16> uses;
+  for (Instruction *I : defs) {
+    BasicBlock *BB = I->getParent();
+    // Uses inside BB itself still see the original definition.
+    uses.clear();
+    for (Use &U : I->uses()) {
+      Instruction *user = cast<Instruction>(U.getUser());
+      BasicBlock *useBB = user->getParent();
+      if (PHINode *PN = dyn_cast<PHINode>(user)) {
+        useBB = PN->getIncomingBlock(U);
+      }
+      if (useBB != BB) {
+        uses.push_back(&U);
+      }
+    }
+    if (uses.empty()) {
+      continue;
+    }
+
+    SSA.Initialize(I->getType(), I->getName());
+    SSA.AddAvailableValue(BB, I);
+    for (const ValueToValueMapTy *VMap : Copies) {
+      Instruction *clonedI = cast<Instruction>(VMap->lookup(I));
+      SSA.AddAvailableValue(clonedI->getParent(), clonedI);
+    }
+    for (Use *U : uses) {
+      SSA.RewriteUse(*U);
+    }
+  }
+}
+
+
+BranchProbability edgeProbability(const BasicBlock *Src, const BasicBlock *Dst,
+                                  const BranchProbabilityInfo &BPI) {
+  const Instruction *term = Src->getTerminator();
+  MDNode *MD = term->getMetadata(LLVMContext::MD_prof);
+  unsigned numSuccs = term->getNumSuccessors();
+  if (MD && MD->getNumOperands() == numSuccs + 1) {
+    MDString *tag = dyn_cast<MDString>(MD->getOperand(0));
+    if (tag && tag->getString() == "branch_weights") {
+      uint64_t total = 0, taken = 0;
+      for (unsigned i = 0; i < numSuccs; ++i) {
+        uint64_t w = mdconst::extract<ConstantInt>(MD->getOperand(i + 1))->getZExtValue();
+        total += w;
+        if (term->getSuccessor(i) == Dst) {
+          taken += w;
+        }
+      }
+      if (total > 0) {
+        return BranchProbability::getBranchProbability(taken, total);
+      }
+    }
+  }
+  return BPI.getEdgeProbability(Src, Dst);
+}
+
+
+void setBranchWeights(Instruction *Term, ArrayRef<uint64_t> Weights) {
+  uint64_t largest = 0;
+  for (uint64_t w : Weights) {
+    largest = max(largest, w);
+  }
+  uint64_t divisor = largest > UINT32_MAX ? largest / UINT32_MAX + 1 : 1;
+  SmallVector<uint32_t, 4> scaled;
+  for (uint64_t w : Weights) {
+    scaled.push_back(w / divisor);
+  }
+  Term->setMetadata(LLVMContext::MD_prof,
+                    MDBuilder(Term->getContext()).createBranchWeights(scaled));
+}
+
+} // end of namespace SuperBlock
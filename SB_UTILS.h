@@ -0,0 +1,71 @@
+//===-- SB_UTILS.h - CFG utilities shared by the superblock passes --------===//
+//
+// Tail duplication and the SSA reconstruction it needs. psbpass, rsbpass and
+// heuristic_sb only differ in how they pick traces; once a trace is chosen
+// they all turn it into a superblock through tailDuplicateTrace().
+//
+//===----------------------------------------------------------------------===//
+#ifndef SB_UTILS_H
+#define SB_UTILS_H
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/Support/BranchProbability.h"
+#include "llvm/Transforms/Utils/ValueMapper.h"
+
+#include <vector>
+
+namespace llvm {
+class BranchProbabilityInfo;
+class DomTreeUpdater;
+class LoopInfo;
+} // end of namespace llvm
+
+namespace SuperBlock {
+// Trace id of a block, or -1 if it is in no trace (e.g. an earlier tail copy).
+using TraceOfFn = llvm::function_ref<int(const llvm::BasicBlock *)>;
+
+// False for blocks that must not be cloned: EH pads, indirectbr/callbr
+// terminators, noduplicate calls and tokens used outside the block.
+bool canDuplicateBlock(const llvm::BasicBlock *BB);
+
+// Removes the side entrances of Trace. Starting at the first block that has a
+// predecessor from another trace, the rest of the trace is cloned, the clones
+// are chained along the trace edges and the edge from the block before it is
+// moved onto the first clone. PHIs in the clones and in the successors they
+// exit to are fixed up and every value defined in the copied blocks is
+// reconstructed with repairSSA(), so the pass also works on mem2reg'd IR.
+//
+// Cloning stops early at a block canDuplicateBlock() rejects. Trace is updated
+// in place to the superblock (the copied tail replaced by its clones). Returns
+// true if the CFG changed.
+//
+// Given a DTU, every CFG edit is reported to it; given LI, each clone joins
+// its original's loop, and cloning also stops at a block whose loop does not
+// contain the block before the copied tail (the copy would enter that loop
+// somewhere other than its header).
+bool tailDuplicateTrace(std::vector<llvm::BasicBlock *> &Trace, TraceOfFn TraceOf,
+                        llvm::DomTreeUpdater *DTU = nullptr,
+                        llvm::LoopInfo *LI = nullptr);
+
+// After Blocks were cloned once per map in Copies (each map taking original
+// values to their clones), rewrites every use of an original value outside
+// its own block to whichever definition reaches it, inserting PHIs where the
+// copies merge. Uses of the clones must already be dominated by them.
+void repairSSA(llvm::ArrayRef<llvm::BasicBlock *> Blocks,
+               llvm::ArrayRef<const llvm::ValueToValueMapTy *> Copies);
+
+// Probability of the edges Src -> Dst. Read from the branch_weights of Src's
+// terminator when it has them, since BPI knows nothing about blocks cloned
+// after it ran (their copied weights are all there is); BPI otherwise.
+llvm::BranchProbability edgeProbability(const llvm::BasicBlock *Src,
+                                        const llvm::BasicBlock *Dst,
+                                        const llvm::BranchProbabilityInfo &BPI);
+
+// Sets the branch_weights of Term, one weight per successor, scaled down
+// together when the largest does not fit in 32 bits.
+void setBranchWeights(llvm::Instruction *Term, llvm::ArrayRef<uint64_t> Weights);
+} // end of namespace SuperBlock
+
+#endif
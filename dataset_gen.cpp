@@ -25,6 +25,8 @@
 #include <time.h>       /* time */
 #include <fstream>
 
+#include "SB_PLUGIN.h"
+
 using namespace llvm;
 
 std::ofstream ofile;
@@ -42,6 +44,7 @@ struct dataset_gen : public FunctionPass {
 		AU.addRequired<DominatorTreeWrapperPass>();
 		AU.addRequired<BlockFrequencyInfoWrapperPass>();
 		AU.addRequired<BranchProbabilityInfoWrapperPass>();
+		AU.setPreservesAll();
 	}
 	bool runOnFunction(Function &F) override {
 		LoopInfo &LI = getAnalysis<LoopInfoWrapperPass>().getLoopInfo();
@@ -49,6 +52,12 @@ struct dataset_gen : public FunctionPass {
 		DominatorTree& DT = getAnalysis<DominatorTreeWrapperPass>().getDomTree();
 		BranchProbabilityInfo& BPI = getAnalysis<BranchProbabilityInfoWrapperPass>().getBPI();
 		BlockFrequencyInfo& BFI = getAnalysis<BlockFrequencyInfoWrapperPass>().getBFI();
+		return runImpl(F, LI, PDT, DT, BPI, BFI);
+	}
+
+	// shared by the legacy pass and dataset_gen_npm; only reads the IR
+	bool runImpl(Function &F, LoopInfo &LI, PostDominatorTree &PDT, DominatorTree &DT,
+	             BranchProbabilityInfo &BPI, BlockFrequencyInfo &BFI) {
 
     std::map<BasicBlock*, bool> contains_hazard;
     for (BasicBlock& BB : F) {
@@ -82,7 +91,7 @@ struct dataset_gen : public FunctionPass {
     uint64_t total_freq = 0;
     for (BranchInst* BI : conditional_branches) {
       BasicBlock* parent = BI->getParent();
-      auto freq = BFI.getBlockProfileCount(parent).getValue();
+      auto freq = BFI.getBlockProfileCount(parent).getValueOr(0);
       total_freq += freq;
     }
 
@@ -91,7 +100,7 @@ struct dataset_gen : public FunctionPass {
 
     for (BranchInst* BI : conditional_branches) {
       BasicBlock* parent = BI->getParent();
-      auto freq = BFI.getBlockProfileCount(parent).getValue();
+      auto freq = BFI.getBlockProfileCount(parent).getValueOr(0);
       double weight = double(freq)/total_freq;
 
       // features
@@ -107,7 +116,7 @@ struct dataset_gen : public FunctionPass {
 				if (op1->getType()->isPointerTy() && op2->getType()->isPointerTy()) {
           is_pointer_cmp = 1;
           if (CMPI->isEquality() && CMPI->isTrueWhenEqual()) {
-            is_pointer_eq = 0;
+            is_pointer_eq = 1;
           }
         }
       }
@@ -281,11 +290,11 @@ struct dataset_gen : public FunctionPass {
 
       for (Instruction& I : *successor1) {
         unsigned cur_opcode = I.getOpcode();
-				has_taken_call = cur_opcode == Instruction::CallBr;
-        has_taken_invoke = cur_opcode == Instruction::Invoke;
-        has_taken_store = cur_opcode == Instruction::Store;
-        has_taken_ret = cur_opcode == Instruction::Ret;
-        has_taken_indirectbr = cur_opcode == Instruction::IndirectBr;
+        has_taken_call |= cur_opcode == Instruction::CallBr;
+        has_taken_invoke |= cur_opcode == Instruction::Invoke;
+        has_taken_store |= cur_opcode == Instruction::Store;
+        has_taken_ret |= cur_opcode == Instruction::Ret;
+        has_taken_indirectbr |= cur_opcode == Instruction::IndirectBr;
       }
       Instruction* successor1_terminator = successor1->getTerminator();
       if (isa<BranchInst>(successor1_terminator)) {
@@ -301,11 +310,11 @@ struct dataset_gen : public FunctionPass {
 
       for (Instruction& I : *successor2) {
         unsigned cur_opcode = I.getOpcode();
-        has_fall_through_call = cur_opcode == Instruction::CallBr;
-        has_fall_through_invoke = cur_opcode == Instruction::Invoke;
-        has_fall_through_store = cur_opcode == Instruction::Store;
-        has_fall_through_ret = cur_opcode == Instruction::Ret;
-        has_fall_through_indirectbr = cur_opcode == Instruction::IndirectBr;
+        has_fall_through_call |= cur_opcode == Instruction::CallBr;
+        has_fall_through_invoke |= cur_opcode == Instruction::Invoke;
+        has_fall_through_store |= cur_opcode == Instruction::Store;
+        has_fall_through_ret |= cur_opcode == Instruction::Ret;
+        has_fall_through_indirectbr |= cur_opcode == Instruction::IndirectBr;
       }
       Instruction* successor2_terminator = successor2->getTerminator();
       if (isa<BranchInst>(successor2_terminator)) {
@@ -380,6 +389,33 @@ struct dataset_gen : public FunctionPass {
 }; // end of struct Hell
 }  // end of anonymous namespace
 
+namespace {
+// new pass manager wrapper around the legacy pass
+struct dataset_gen_npm : PassInfoMixin<dataset_gen_npm> {
+	PreservedAnalyses run(Function &F, FunctionAnalysisManager &FAM) {
+		dataset_gen P;
+		P.runImpl(F,
+			FAM.getResult<LoopAnalysis>(F),
+			FAM.getResult<PostDominatorTreeAnalysis>(F),
+			FAM.getResult<DominatorTreeAnalysis>(F),
+			FAM.getResult<BranchProbabilityAnalysis>(F),
+			FAM.getResult<BlockFrequencyAnalysis>(F));
+		return PreservedAnalyses::all();
+	}
+};
+}  // end of anonymous namespace
+
+void SuperBlock::registerDatasetGenPasses(PassBuilder &PB) {
+	PB.registerPipelineParsingCallback(
+		[](StringRef Name, FunctionPassManager &FPM, ArrayRef<PassBuilder::PipelineElement>) {
+			if (Name == "dataset_gen") {
+				FPM.addPass(dataset_gen_npm());
+				return true;
+			}
+			return false;
+		});
+}
+
 char dataset_gen::ID = 0;
 static RegisterPass<dataset_gen> X("dataset_gen", "dataset generation",
                              	false /* Only looks at CFG */,
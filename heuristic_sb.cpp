@@ -9,21 +9,28 @@
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Support/Format.h"
 #include "llvm/Support/BranchProbability.h"
-#include "llvm/Analysis/DominanceFrontier.h"
+#include "llvm/Analysis/DomTreeUpdater.h"
 #include "llvm/Analysis/LoopInfo.h"
 #include "llvm/Analysis/PostDominators.h"
 #include "llvm/Analysis/BranchProbabilityInfo.h"
 #include "llvm/Analysis/BlockFrequencyInfo.h"
-#include "llvm/Transforms/Utils/Cloning.h"
-#include "llvm/Transforms/Utils/ValueMapper.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+
+#include "llvm/Support/CommandLine.h"
 
 #include <unordered_set>
 #include <vector>
 #include <algorithm>    // std::sort
+#include <array>
+#include <cmath>        // llround
 #include <map>
 #include <stdio.h>      /* printf, scanf, puts, NULL */
-#include <stdlib.h>     /* srand, rand */
-#include <time.h>       /* time */
+
+#include "SB_PLUGIN.h"
+#include "SB_PRESSURE.h"
+#include "SB_PROFILE.h"
+#include "SB_UTILS.h"
 
 using namespace llvm;
 using namespace std;
@@ -33,9 +40,202 @@ int glb_hazard_agree = 0;
 int glb_path_count = 0;
 int glb_path_agree = 0;
 int glb_conditional_count = 0;
+int glb_estimate_count = 0;
+int glb_estimate_agree = 0;
+
+static cl::opt<bool> StaticWeights("sb-static-weights", cl::init(true),
+    cl::desc("Write the probabilities heuristic_sb estimates as branch_weights "
+             "on the conditional branches that have none"));
+
+// branch_weights of an estimated probability p are p and 1 - p in these units
+static const uint64_t WeightScale = 1 << 20;
 
 
 namespace {
+// The static heuristics of heuristic_sb. Each one predicts which successor of
+// a conditional branch is taken (0 or 1), or returns -1 if it does not apply.
+enum Heuristic { HazardH, PointerH, LoopH, OpcodeH, GuardH, DirectionH, NumHeuristics };
+
+// How often each heuristic picks the successor the branch really takes,
+// calibrated by sbcalibrate.py on the dataset_gen tables in dataset/ (316
+// profiled branches). The measured rates are smoothed toward the SPEC rates
+// of Ball and Larus and of Wu and Larus ({0.70, 0.60, 0.80, 0.84, 0.62, 0.88};
+// hazard standing in for their call, store and return heuristics, loop for
+// loop exit and direction for loop branch), so a heuristic that rarely
+// applies in the tables stays near its published rate. Hazard and pointer
+// keep their published rates: the tables predate the dataset_gen fix that
+// sets the pointer-equality column and looks for hazards in the whole
+// successor, so they measure neither. Regenerate the tables and rerun the
+// script when dataset_gen or the heuristics change.
+const double HitRate[NumHeuristics] = {0.70, 0.60, 0.86, 0.75, 0.54, 0.84};
+
+// avoid a successor that is hazardous, or falls into a hazardous block
+// unconditionally; only applies when exactly one successor is avoided
+int hazardHeuristic(BranchInst* BI, std::map<BasicBlock*, bool>& contains_hazard, PostDominatorTree* PDT) {
+	auto avoid = [&](unsigned i) {
+		BasicBlock* child = BI->getSuccessor(i);
+		if (contains_hazard[child]) {
+			return true;
+		}
+		Instruction* child_terminator = child->getTerminator();
+		if (BranchInst* child_terminator_B = dyn_cast<BranchInst>(child_terminator)) {
+			if (child_terminator_B->isUnconditional()) {
+				BasicBlock* child_child = child_terminator_B->getSuccessor(0);
+				return contains_hazard[child_child] && !PDT->dominates(child_terminator, BI);
+			}
+		}
+		return false;
+	};
+	bool avoid_first = avoid(0);
+	bool avoid_second = avoid(1);
+	if (avoid_first == avoid_second) {
+		return -1;
+	}
+	return avoid_first ? 1 : 0;
+}
+
+// pointers are not likely to be null, and not likely to be equal
+int pointerHeuristic(CmpInst* CMPI) {
+	Value* op1 = CMPI->getOperand(0);
+	Value* op2 = CMPI->getOperand(1);
+	if (!op1->getType()->isPointerTy() || !op2->getType()->isPointerTy() || op1 == op2) {
+		return -1;
+	}
+	// eq should fall through; ne, gt, lt, gte, lte should be taken
+	return (CMPI->isTrueWhenEqual() && CMPI->isEquality()) ? 1 : 0;
+}
+
+// stay in a loop rather than leave every loop
+int loopHeuristic(BranchInst* BI, LoopInfo* LI) {
+	Loop* loop1 = LI->getLoopFor(BI->getSuccessor(0));
+	Loop* loop2 = LI->getLoopFor(BI->getSuccessor(1));
+	if (!loop1 == !loop2) {
+		return -1;
+	}
+	return loop1 ? 0 : 1;
+}
+
+// negative numbers are unlikely, and floating point values are unlikely to be equal
+int opcodeHeuristic(CmpInst* CMPI) {
+	Value* op1 = CMPI->getOperand(0);
+	Value* op2 = CMPI->getOperand(1);
+	if (isa<Constant>(op1) != isa<Constant>(op2)) {
+		// with the constant on the right: c < x is x > c
+		Value* c = op2;
+		CmpInst::Predicate p = CMPI->getPredicate();
+		if (isa<Constant>(op1)) {
+			c = op1;
+			p = CmpInst::getSwappedPredicate(p);
+		}
+		bool isNegative = false;
+		bool isZero = false;
+		if (ConstantInt* CI = dyn_cast<ConstantInt>(c)) {
+			isNegative = CI->isNegative();
+			isZero = CI->isZero();
+		}
+		else if (ConstantFP* CF = dyn_cast<ConstantFP>(c)) {
+			isNegative = CF->isNegative();
+			isZero = CF->isZero();
+		}
+		bool less = p == CmpInst::FCMP_OLT || p == CmpInst::FCMP_ULT || p == CmpInst::ICMP_ULT || p == CmpInst::ICMP_SLT;
+		bool less_equal = p == CmpInst::FCMP_OLE || p == CmpInst::FCMP_ULE || p == CmpInst::ICMP_ULE || p == CmpInst::ICMP_SLE;
+		// x == negative, x < negative, x <= negative, x < 0 fall through
+		if (isNegative && ((CMPI->isTrueWhenEqual() && CMPI->isEquality()) || less || less_equal)) {
+			return 1;
+		}
+		if (isZero && less) {
+			return 1;
+		}
+	}
+	if (FCmpInst* FCMP = dyn_cast<FCmpInst>(CMPI)) {
+		if (FCMP->isEquality()) {
+			return FCMP->isTrueWhenEqual() ? 1 : 0;
+		}
+	}
+	return -1;
+}
+
+// go to the successor that uses an operand of the comparison (and does not
+// run anyway); only applies when one operand points one way
+int guardHeuristic(BranchInst* BI, CmpInst* CMPI, PostDominatorTree* PDT) {
+	BasicBlock* successor1 = BI->getSuccessor(0);
+	BasicBlock* successor2 = BI->getSuccessor(1);
+	auto guards = [&](Value* op, int& dir) {
+		// constants are used everywhere and guard nothing
+		if (isa<Constant>(op)) {
+			return false;
+		}
+		bool guard_first = false;
+		bool guard_second = false;
+		for (auto U: op->users()) {
+			if (Instruction* UI = dyn_cast<Instruction>(U)) {
+				if ((UI->getParent() == successor1) && !PDT->dominates(successor1->getTerminator(), BI)) {
+					guard_first = true;
+				}
+				if ((UI->getParent() == successor2) && !PDT->dominates(successor2->getTerminator(), BI)) {
+					guard_second = true;
+				}
+			}
+		}
+		if (guard_first == guard_second) {
+			return false;
+		}
+		dir = guard_first ? 0 : 1;
+		return true;
+	};
+	int guard_op1_dir = 0;
+	int guard_op2_dir = 0;
+	bool guard_op1 = guards(CMPI->getOperand(0), guard_op1_dir);
+	bool guard_op2 = guards(CMPI->getOperand(1), guard_op2_dir);
+	if (guard_op1 == guard_op2) {
+		return -1;
+	}
+	return guard_op1 ? guard_op1_dir : guard_op2_dir;
+}
+
+// branches back to a block that dominates them are taken
+int directionHeuristic(BranchInst* BI, DominatorTree* DT) {
+	bool back1 = DT->dominates(BI->getSuccessor(0)->getTerminator(), BI);
+	bool back2 = DT->dominates(BI->getSuccessor(1)->getTerminator(), BI);
+	if (back1 == back2) {
+		return -1;
+	}
+	return back1 ? 0 : 1;
+}
+
+std::array<int, NumHeuristics> applyHeuristics(BranchInst* BI, std::map<BasicBlock*, bool>& contains_hazard,
+                                               LoopInfo* LI, PostDominatorTree* PDT, DominatorTree* DT) {
+	std::array<int, NumHeuristics> res;
+	res.fill(-1);
+	res[HazardH] = hazardHeuristic(BI, contains_hazard, PDT);
+	if (CmpInst* CMPI = dyn_cast<CmpInst>(BI->getCondition())) {
+		res[PointerH] = pointerHeuristic(CMPI);
+		res[OpcodeH] = opcodeHeuristic(CMPI);
+		res[GuardH] = guardHeuristic(BI, CMPI, PDT);
+	}
+	res[LoopH] = loopHeuristic(BI, LI);
+	res[DirectionH] = directionHeuristic(BI, DT);
+	return res;
+}
+
+// Dempster-Shafer combination of the heuristics that apply, as Wu and Larus
+// do it: a heuristic with hit rate h that predicts successor 0 believes it is
+// taken with probability h, and beliefs p and q combine into
+// pq / (pq + (1-p)(1-q)). Returns false if no heuristic applies.
+bool combineEvidence(const std::array<int, NumHeuristics>& votes, double& taken) {
+	bool covered = false;
+	taken = 0.5;
+	for (int h = 0; h < NumHeuristics; h++) {
+		if (votes[h] < 0) {
+			continue;
+		}
+		double q = votes[h] == 0 ? HitRate[h] : 1 - HitRate[h];
+		taken = taken * q / (taken * q + (1 - taken) * (1 - q));
+		covered = true;
+	}
+	return covered;
+}
+
 struct heuristic_sb : public FunctionPass {
 	static char ID;
 	heuristic_sb() : FunctionPass(ID) {}
@@ -47,7 +247,11 @@ struct heuristic_sb : public FunctionPass {
 		AU.addRequired<DominatorTreeWrapperPass>();
 		AU.addRequired<BlockFrequencyInfoWrapperPass>();
 		AU.addRequired<BranchProbabilityInfoWrapperPass>();
-		AU.addRequired<DominanceFrontierWrapperPass>();
+		AU.addRequired<TargetTransformInfoWrapperPass>();
+		// kept up to date through the DomTreeUpdater in tailDuplication
+		AU.addPreserved<LoopInfoWrapperPass>();
+		AU.addPreserved<PostDominatorTreeWrapperPass>();
+		AU.addPreserved<DominatorTreeWrapperPass>();
 	}
 	bool runOnFunction(Function &F) override {
 		LoopInfo &LI = getAnalysis<LoopInfoWrapperPass>().getLoopInfo();
@@ -55,8 +259,18 @@ struct heuristic_sb : public FunctionPass {
 		DominatorTree& DT = getAnalysis<DominatorTreeWrapperPass>().getDomTree();
 		BranchProbabilityInfo& BPI = getAnalysis<BranchProbabilityInfoWrapperPass>().getBPI();
 		BlockFrequencyInfo& BFI = getAnalysis<BlockFrequencyInfoWrapperPass>().getBFI();
-		srand(time(NULL));
-		auto Traces = traceFormation(&LI, &PDT, &DT, &BPI, &BFI, F);
+		TargetTransformInfo& TTI = getAnalysis<TargetTransformInfoWrapperPass>().getTTI(F);
+		return runImpl(F, LI, PDT, DT, BPI, BFI, TTI);
+	}
+
+	// shared by the legacy pass and heuristic_sb_npm
+	bool runImpl(Function &F, LoopInfo &LI, PostDominatorTree &PDT, DominatorTree &DT,
+	             BranchProbabilityInfo &BPI, BlockFrequencyInfo &BFI, const TargetTransformInfo &TTI) {
+		bool wrote_weights = false;
+		auto Traces = traceFormation(&LI, &PDT, &DT, &BPI, &BFI, F, wrote_weights);
+		// end traces where their values stop fitting in registers
+		OptimizationRemarkEmitter ORE(&F, &BFI);
+		SuperBlock::splitTracesByPressure(Traces, TTI, &ORE, "heuristic_sb");
 
 		// errs() << "----traces formed----" << "\n";
 		// for (auto trace : Traces) {
@@ -77,9 +291,14 @@ struct heuristic_sb : public FunctionPass {
 			count += 1;
 		}
 
-		bool res = tailDuplication(Traces, tracemap, &F);
+		DomTreeUpdater DTU(DT, PDT, DomTreeUpdater::UpdateStrategy::Lazy);
+		bool res = tailDuplication(Traces, tracemap, DTU, LI);
+		DTU.flush();
+		if (res) {
+			SuperBlock::updateProfileCounts(F, DT, LI, BPI, BFI);
+		}
 		errs() << "modified in tail duplication: " << res << "\n";
-		return res;
+		return res || wrote_weights;
 	}
 
 	std::vector<std::vector<BasicBlock*>> traceFormation(
@@ -88,7 +307,8 @@ struct heuristic_sb : public FunctionPass {
 		DominatorTree* DT,
 		BranchProbabilityInfo* BPI,
 		BlockFrequencyInfo* BFI,
-		Function& F
+		Function& F,
+		bool& wrote_weights
 		) {
 		// res is the 2d vector of traces
 		std::vector<std::vector<BasicBlock*>> res;
@@ -100,6 +320,8 @@ struct heuristic_sb : public FunctionPass {
 		std::map<BasicBlock*, bool> contains_rt;
 		// store all possible conditional branches for later use
 		std::vector<BranchInst*> conditional_branches;
+		// probability that a conditional branch takes its first successor
+		std::map<BranchInst*, double> estimated;
 
 		for (BasicBlock& BB : F) {
 			contains_hazard[&BB] = false;
@@ -133,349 +355,54 @@ struct heuristic_sb : public FunctionPass {
 		// make predictions for conditional branches
 		std::map<BranchInst*, int> hazard_predicted;
 		std::map<BranchInst*, int> path_predicted;
+		// what every heuristic that applies predicts, per branch
+		std::map<BranchInst*, std::array<int, NumHeuristics>> votes;
+		for (BranchInst* BI : conditional_branches) {
+			votes[BI] = applyHeuristics(BI, contains_hazard, LI, PDT, DT);
+		}
 
 		// first pass to deal with hazard heuristic
 		for (BranchInst* BI : conditional_branches) {
-			bool avoid_first = false;
-			bool avoid_second = false;
-			// check first successor
-			BasicBlock* first_child = BI->getSuccessor(0);
-			if (contains_hazard[first_child]) {
-				avoid_first = true;
-				// old version
-				// hazard_predicted[BI] = 1;
-				// continue;
-			}
-			// check if first successor child yield to hazardous block unconditionally
-			else {
-				Instruction* first_child_terminator = first_child->getTerminator();
-				if (BranchInst* first_child_terminator_B = dyn_cast<BranchInst>(first_child_terminator)) {
-					if (first_child_terminator_B->isUnconditional()) {
-						BasicBlock* first_child_child = first_child_terminator_B->getSuccessor(0);
-						if (contains_hazard[first_child_child] && !PDT->dominates(first_child_terminator, BI)) {
-							avoid_first = true;
-							// hazard_predicted[BI] = 1;
-							// continue;
-						}
-					}
-				}
-			}
-
-			// check second successor
-			BasicBlock* second_child = BI->getSuccessor(1);
-			if (contains_hazard[second_child]) {
-				avoid_second = true;
-				// hazard_predicted[BI] = 0;
-			}
-			// check if first successor child yield to hazardous block unconditionally
-			else {
-				Instruction* second_child_terminator = second_child->getTerminator();
-				if (BranchInst* second_child_terminator_B = dyn_cast<BranchInst>(second_child_terminator)) {
-					if (second_child_terminator_B->isUnconditional()) {
-						BasicBlock* second_child_child = second_child_terminator_B->getSuccessor(0);
-						if (contains_hazard[second_child_child] && !PDT->dominates(second_child_terminator, BI)) {
-							avoid_second = true;
-							// hazard_predicted[BI] = 0;
-						}
-					}
-				}
-			}
-
-			// new version
-			// only apply heuristic when xor is true
-			if (avoid_first != avoid_second) {
-				if (avoid_first) {
-					hazard_predicted[BI] = 1;
-				}
-				else {
-					hazard_predicted[BI] = 0;
-				}
+			if (votes[BI][HazardH] >= 0) {
+				hazard_predicted[BI] = votes[BI][HazardH];
 			}
 		}
 
 		// use a vector of vector to deal with related branches later
 		std::vector<std::vector<BranchInst*>> path_heuristic_inst(5);
 		std::unordered_set<BranchInst*> already_sorted_relation;
-		// second pass to deal with path selection heuristic
+		// second pass to deal with path selection heuristic: the first of
+		// pointer, loop, opcode, guard and direction that applies decides
 		for (BranchInst* BI : conditional_branches) {
 			// only predict branches not predicted by hazard heuristic
 			if (hazard_predicted.find(BI) != hazard_predicted.end()) {
 				continue;
 			}
-
-			Value* condition = BI->getCondition();
-			if (CmpInst* CMPI = dyn_cast<CmpInst>(condition)) {
-				Value* op1 = CMPI->getOperand(0);
-				Value* op2 = CMPI->getOperand(1);
-
-				// case 0 pointer heuristic
-				// check if both operands are pointer
-				if (op1->getType()->isPointerTy() && op2->getType()->isPointerTy()) {
-					// pointers are not likely to be null
-					// pointers are not likely to be equal
-					// if not the same operand
-					if (op1 != op2) {
-						// eq gte lte
-						if (CMPI->isTrueWhenEqual()) {
-							// eq should fall through
-							if (CMPI->isEquality()) {
-								path_predicted[BI] = 1;
-							}
-							// gte, lte should be taken
-							else {
-								path_predicted[BI] = 0;
-							}
-						}
-						// ne gt lt
-						else {
-							path_predicted[BI] = 0;
-						}
-						path_heuristic_inst[0].push_back(BI);
-						continue;
-					}
-				}
-
-				// case 1 loop heuristic
-				BasicBlock* successor1 = BI->getSuccessor(0);
-				BasicBlock* successor2 = BI->getSuccessor(1);
-				// if one of them is in a loop
-				if (!(LI->getLoopFor(successor1)) != !(LI->getLoopFor(successor2))) {
-					if (LI->getLoopFor(successor1)) {
-						path_predicted[BI] = 0;
-					}
-					else {
-						path_predicted[BI] = 1;
-					}
-					path_heuristic_inst[1].push_back(BI);
-					continue;
-				}
-
-				// case 2 opcode heuristic
-				// negative numbers are unlikely
-				// xor constant
-				if (isa<Constant>(op1) != isa<Constant>(op2)) {
-					if (isa<ConstantInt>(op1) || isa<ConstantFP>(op1)) {
-						bool isNegative = false;
-						bool isZero = false;
-						if (isa<ConstantInt>(op1)) {
-							ConstantInt* cop1 = dyn_cast<ConstantInt>(op1);
-							isNegative = cop1->isNegative();
-							isZero = cop1->isZero();
-						}
-						else {
-							ConstantFP* cop1 = dyn_cast<ConstantFP>(op1);
-							isNegative = cop1->isNegative();
-							isZero = cop1->isZero();
-						}
-						if (isNegative) {
-							// eq
-							if (CMPI->isTrueWhenEqual() && CMPI->isEquality()) {
-								path_predicted[BI] = 1;
-								path_heuristic_inst[2].push_back(BI);
-								continue;
-							}
-							// not eq nor ne
-							else if (CMPI->isRelational()) {
-								CmpInst::Predicate p = CMPI->getPredicate();
-								if (
-									p == CmpInst::FCMP_OGE ||
-									p == CmpInst::FCMP_UGE ||
-									p == CmpInst::ICMP_UGE ||
-									p == CmpInst::ICMP_SGE ||
-									p == CmpInst::FCMP_OGT ||
-									p == CmpInst::FCMP_UGT ||
-									p == CmpInst::ICMP_UGT ||
-									p == CmpInst::ICMP_SGT
-								) {
-									path_predicted[BI] = 1;
-									path_heuristic_inst[2].push_back(BI);
-									continue;
-								}
-							}
-						}
-						if (isZero) {
-							if (CMPI->isRelational()) {
-								CmpInst::Predicate p = CMPI->getPredicate();
-								if (
-									p == CmpInst::FCMP_OGT ||
-									p == CmpInst::FCMP_UGT ||
-									p == CmpInst::ICMP_UGT ||
-									p == CmpInst::ICMP_SGT
-								) {
-									path_predicted[BI] = 1;
-									path_heuristic_inst[2].push_back(BI);
-									continue;
-								}
-							}
-						}
-					}
-					else if (isa<ConstantInt>(op2) || isa<ConstantFP>(op2)) {
-						bool isNegative = false;
-						bool isZero = false;
-						if (isa<ConstantInt>(op2)) {
-							ConstantInt* cop2 = dyn_cast<ConstantInt>(op2);
-							isNegative = cop2->isNegative();
-							isZero = cop2->isZero();
-						}
-						else {
-							ConstantFP* cop2 = dyn_cast<ConstantFP>(op2);
-							isNegative = cop2->isNegative();
-							isZero = cop2->isZero();
-						}
-						if (isNegative) {
-							// eq
-							if (CMPI->isTrueWhenEqual() && CMPI->isEquality()) {
-								path_predicted[BI] = 1;
-								path_heuristic_inst[2].push_back(BI);
-								continue;
-							}
-							// not eq nor ne
-							else if (CMPI->isRelational()) {
-								CmpInst::Predicate p = CMPI->getPredicate();
-								if (
-									p == CmpInst::FCMP_OLE ||
-									p == CmpInst::FCMP_ULE ||
-									p == CmpInst::ICMP_ULE ||
-									p == CmpInst::ICMP_SLE ||
-									p == CmpInst::FCMP_OLT ||
-									p == CmpInst::FCMP_ULT ||
-									p == CmpInst::ICMP_ULT ||
-									p == CmpInst::ICMP_SLT
-								) {
-									path_predicted[BI] = 1;
-									path_heuristic_inst[2].push_back(BI);
-									continue;
-								}
-							}
-						}
-						if (isZero) {
-							if (CMPI->isRelational()) {
-								CmpInst::Predicate p = CMPI->getPredicate();
-								if (
-									p == CmpInst::FCMP_OLT ||
-									p == CmpInst::FCMP_ULT ||
-									p == CmpInst::ICMP_ULT ||
-									p == CmpInst::ICMP_SLT
-								) {
-									path_predicted[BI] = 1;
-									path_heuristic_inst[2].push_back(BI);
-									continue;
-								}
-							}
-						}
-					}
-				}
-				// floating point comparison are unlikely to be equal
-				if (isa<FCmpInst>(CMPI)) {
-					FCmpInst* FCMP = dyn_cast<FCmpInst>(CMPI);
-					if (FCMP->isEquality()) {
-						//eq
-						if (FCMP->isTrueWhenEqual()) {
-							path_predicted[BI] = 1;
-						}
-						//ne
-						else {
-							path_predicted[BI] = 0;
-						}
-					}
-					// can extend this beyound equality branches
-					// else {
-					// 	path_predicted[BI] = 0;
-					// }
-					path_heuristic_inst[2].push_back(BI);
-				}
-
-				// case 3 guard heuristic
-				bool guard_op1 = false;
-				int guard_op1_dir = 0;
-				bool guard_op2 = false;
-				int guard_op2_dir = 0;
-
-				bool guard_first = false;
-				bool guard_second = false;
-				for (auto U: op1->users()) {
-					if (Instruction* UI = dyn_cast<Instruction>(U)) {
-						if ((UI->getParent() == successor1) && !PDT->dominates(successor1->getTerminator(), BI)) {
-							guard_first = true;
-						}
-						if ((UI->getParent() == successor2) && !PDT->dominates(successor2->getTerminator(), BI)) {
-							guard_second = true;
-						}
-					}
-				}
-
-				if (guard_first != guard_second) {
-					guard_op1 = true;
-					if (guard_first) {
-						guard_op1_dir = 0;
-					}
-					else {
-						guard_op1_dir = 1;
-					}
-				}
-
-				guard_first = false;
-				guard_second = false;
-				for (auto U: op2->users()) {
-					if (Instruction* UI = dyn_cast<Instruction>(U)) {
-						if ((UI->getParent() == successor1) && !PDT->dominates(successor1->getTerminator(), BI)) {
-							guard_first = true;
-						}
-						if ((UI->getParent() == successor2) && !PDT->dominates(successor2->getTerminator(), BI)) {
-							guard_second = true;
-						}
-					}
-				}
-				if (guard_first != guard_second) {
-					guard_op2 = true;
-					if (guard_first) {
-						guard_op2_dir = 0;
-					}
-					else {
-						guard_op2_dir = 1;
-					}
-				}
-				if (guard_op1 != guard_op2) {
-					if (guard_op1) {
-						if (guard_op1_dir == 0) {
-							path_predicted[BI] = 0;
-							path_heuristic_inst[3].push_back(BI);
-							continue;
-						}
-						else {
-							path_predicted[BI] = 1;
-							path_heuristic_inst[3].push_back(BI);
-							continue;
-						}
-					}
-					else {
-						if (guard_op2_dir == 0) {
-							path_predicted[BI] = 0;
-							path_heuristic_inst[3].push_back(BI);
-							continue;
-						}
-						else {
-							path_predicted[BI] = 1;
-							path_heuristic_inst[3].push_back(BI);
-							continue;
-						}
-					}
+			if (!isa<CmpInst>(BI->getCondition())) {
+				continue;
+			}
+			for (int h = PointerH; h < NumHeuristics; h++) {
+				if (votes[BI][h] >= 0) {
+					path_predicted[BI] = votes[BI][h];
+					path_heuristic_inst[h - PointerH].push_back(BI);
+					break;
 				}
+			}
+		}
 
-
-
-
-				// case 4 branch direction heuristic
-				if (DT->dominates(successor1->getTerminator(), BI) && !DT->dominates(successor2->getTerminator(), BI)) {
-					path_predicted[BI] = 0;
-					path_heuristic_inst[4].push_back(BI);
-					continue;
-				}
-				if (DT->dominates(successor2->getTerminator(), BI) && !DT->dominates(successor1->getTerminator(), BI)) {
-					path_predicted[BI] = 1;
-					path_heuristic_inst[4].push_back(BI);
-					continue;
-				}
+		// combine all the evidence into a probability per branch, and give
+		// BPI/BFI (of this and every later pass) the estimate as branch_weights
+		for (BranchInst* BI : conditional_branches) {
+			double taken;
+			if (!combineEvidence(votes[BI], taken)) {
+				continue;
+			}
+			estimated[BI] = taken;
+			if (StaticWeights && !BI->getMetadata(LLVMContext::MD_prof)) {
+				uint64_t weight_first = std::max<uint64_t>(1, llround(taken * WeightScale));
+				uint64_t weight_second = std::max<uint64_t>(1, llround((1 - taken) * WeightScale));
+				SuperBlock::setBranchWeights(BI, {weight_first, weight_second});
+				wrote_weights = true;
 			}
 		}
 
@@ -719,11 +646,30 @@ struct heuristic_sb : public FunctionPass {
 			}
 		}
 
+		int estimate_agree_count = 0;
+		for (const auto& p: estimated) {
+			BasicBlock* parent = p.first->getParent();
+			auto threshold = BranchProbability::getBranchProbability(1,2);
+			int profile_predicted = 0;
+			for (int i = 0; i < 2; i++) {
+				auto prob = BPI->getEdgeProbability(parent, i);
+				if (prob > threshold) {
+					profile_predicted = i;
+					break;
+				}
+			}
+			if (profile_predicted == (p.second >= 0.5 ? 0 : 1)) {
+				estimate_agree_count += 1;
+			}
+		}
+
 		glb_path_agree += path_agree_count;
 		glb_path_count += path_predicted.size();
 		glb_hazard_agree += hazard_agree_count;
 		glb_hazard_count += hazard_predicted.size();
 		glb_conditional_count += conditional_branches.size();
+		glb_estimate_agree += estimate_agree_count;
+		glb_estimate_count += estimated.size();
 
 		errs() << "///////////////////////Branch Prediction Stats///////////////////////" << "\n";
 		errs() << "num conditional branches =" << glb_conditional_count << "\n";
@@ -754,6 +700,12 @@ struct heuristic_sb : public FunctionPass {
 		errs() << "num agreeing with profiling = " << glb_path_agree <<  "\n";
 		errs() << "\n";
 
+		errs() << "----estimated by dempster-shafer----" << "\n";
+		errs() << "num estimated by dempster-shafer = " << glb_estimate_count << "\n";
+		errs() << "\n";
+		errs() << "num agreeing with profiling = " << glb_estimate_agree <<  "\n";
+		errs() << "\n";
+
 
 
 
@@ -783,7 +735,7 @@ struct heuristic_sb : public FunctionPass {
 			// process blocks in loops
 			for (BasicBlock* cur_seed : BFSorder) {
 				if (seen_in_trace.find(cur_seed) == seen_in_trace.end()) {
-					auto cur_trace = growTrace(cur_seed, contains_indirectbr, contains_rt, hazard_predicted, path_predicted, seen_in_trace, DT);
+					auto cur_trace = growTrace(cur_seed, contains_indirectbr, contains_rt, estimated, seen_in_trace, DT, BPI);
 					res.push_back(cur_trace);
 				}
 			}
@@ -817,7 +769,7 @@ struct heuristic_sb : public FunctionPass {
 
 		for (BasicBlock* cur_seed : BFSorder) {
 			if (seen_in_trace.find(cur_seed) == seen_in_trace.end()) {
-				auto cur_trace = growTrace(cur_seed, contains_indirectbr, contains_rt, hazard_predicted, path_predicted, seen_in_trace, DT);
+				auto cur_trace = growTrace(cur_seed, contains_indirectbr, contains_rt, estimated, seen_in_trace, DT, BPI);
 				// add cur trace to res
 				res.push_back(cur_trace);
 			}
@@ -829,10 +781,10 @@ struct heuristic_sb : public FunctionPass {
 		BasicBlock* seed,
 		std::map<BasicBlock*, bool>& contains_indirectbr,
 		std::map<BasicBlock*, bool>& contains_rt,
-		std::map<BranchInst*, int>& hazard_predicted,
-		std::map<BranchInst*, int>& path_predicted,
+		std::map<BranchInst*, double>& estimated,
 		std::unordered_set<BasicBlock*>& seen_in_trace,
-		DominatorTree* DT
+		DominatorTree* DT,
+		BranchProbabilityInfo* BPI
 	) {
 		std::vector<BasicBlock*> res;
 		res.push_back(seed);
@@ -850,24 +802,44 @@ struct heuristic_sb : public FunctionPass {
 			Instruction* cur_node_terminator = cur_node->getTerminator();
 			if (BranchInst* BI = dyn_cast<BranchInst>(cur_node_terminator)) {
 				if (BI->isConditional()) {
-					if (hazard_predicted.find(BI) == hazard_predicted.end()) {
-						if (path_predicted.find(BI) == path_predicted.end()) {
-							// not covered, randomly choose
-							int cur_choice = rand() % 2;
-							likely = BI->getSuccessor(cur_choice);
-						}
-						else {
-							likely = BI->getSuccessor(path_predicted[BI]);
-						}
+					auto it = estimated.find(BI);
+					if (it != estimated.end() && it->second != 0.5) {
+						likely = BI->getSuccessor(it->second > 0.5 ? 0 : 1);
 					}
 					else {
-						likely = BI->getSuccessor(hazard_predicted[BI]);
+						// not covered, take BPI's own guess
+						auto prob = BPI->getEdgeProbability(cur_node, 0u);
+						likely = BI->getSuccessor(prob >= BranchProbability::getBranchProbability(1, 2) ? 0 : 1);
 					}
 				}
 				else {
 					likely = BI->getSuccessor(0);
 				}
 			}
+			else if (isa<SwitchInst>(cur_node_terminator)) {
+				// follow the case BPI finds strictly most likely; on a tie the trace ends
+				likely = nullptr;
+				BranchProbability best = BranchProbability::getZero();
+				bool tie = false;
+				std::unordered_set<BasicBlock*> counted;
+				for (BasicBlock* succ : successors(cur_node)) {
+					if (!counted.insert(succ).second) {
+						continue;
+					}
+					auto prob = BPI->getEdgeProbability(cur_node, succ);
+					if (!likely || prob > best) {
+						likely = succ;
+						best = prob;
+						tie = false;
+					}
+					else if (prob == best) {
+						tie = true;
+					}
+				}
+				if (!likely || tie) {
+					break;
+				}
+			}
 			else {
 				break;
 			}
@@ -888,262 +860,58 @@ struct heuristic_sb : public FunctionPass {
 		return i->getLoopDepth() > j->getLoopDepth();
 	}
 
-	bool tailDuplication(std::vector<std::vector<BasicBlock*>> traces, std::map<BasicBlock*, int> TraceMap, Function* Parent) {
-		DominanceFrontier &df = getAnalysis<DominanceFrontierWrapperPass>().getDominanceFrontier();
-		// copied BB
-		std::map<BasicBlock*, BasicBlock*> copiedMap;
-		ValueToValueMapTy VMap;
+	bool tailDuplication(std::vector<std::vector<BasicBlock*>>& traces, const std::map<BasicBlock*, int>& TraceMap,
+	                     DomTreeUpdater& DTU, LoopInfo& LI) {
+		// Blocks outside every trace must not count as trace 0.
+		auto TraceOf = [&](const BasicBlock* BB) {
+			auto it = TraceMap.find(const_cast<BasicBlock*>(BB));
+			return it == TraceMap.end() ? -1 : it->second;
+		};
 		bool modified = false;
-		bool doCopy = false;
-		BasicBlock* prevCopiedBB;
 		for (auto& curTrace: traces) {
-			doCopy = false;
-			BasicBlock* prevBB = *curTrace.begin();
-			for (auto it = next(curTrace.begin()); it != curTrace.end(); ++it) {  // Ignore first BB
-				BasicBlock* originalBB = *it;
-				BasicBlock* clonedBB;
-				// ValueToValueMapTy VMap;
-				if (!doCopy) {  // detect first side entrance
-					for (auto pred : predecessors(originalBB)) {
-						// if predecessor not in trace, side entrance
-						if (TraceMap[pred] != TraceMap[originalBB]) {
-							modified = true;
-							doCopy = true;
-							// copy first original block
-							clonedBB = CloneBasicBlock(originalBB, VMap, "", Parent);
-							VMap[originalBB] = clonedBB;
-
-							// find predecessor in trace, connect predecessor and copy
-							Instruction* term = prevBB->getTerminator();
-							// set prevBB's successor, remove edge between predecessor and original
-							// find idx of origBB in trace, substitute with copiedBB
-							unsigned idx = 0;
-							for (auto succ : successors(prevBB)) {
-								if (succ == originalBB) {
-									break;
-								}
-								idx++;
-							}
-							term->setSuccessor(idx, clonedBB);
-
-							for (Instruction &II : *clonedBB) {
-								RemapInstruction(&II, VMap, RF_NoModuleLevelChanges | RF_IgnoreMissingLocals);
-							}
-
-							prevCopiedBB = clonedBB;
-							break;
-						}
-					}
-					// No side entrace for current BB, update previously BB
-					prevBB = originalBB;
-				}
-				// tail portion
-				else {
-					// Copy current BB
-					clonedBB = CloneBasicBlock(originalBB, VMap, "", Parent);
-					VMap[originalBB] = clonedBB;
-					// previously copied BB connects to copied BB
-					// remove edge between previously copied and current copied BB
-					Instruction* term = prevCopiedBB->getTerminator();
-					unsigned idx = 0;
-					for (auto succ : successors(prevCopiedBB)) {
-						if (succ == originalBB) {
-							break;
-						}
-						idx++;
-					}
-					term->setSuccessor(idx, clonedBB);
-
-					for (Instruction &II : *clonedBB) {
-						RemapInstruction(&II, VMap, RF_NoModuleLevelChanges | RF_IgnoreMissingLocals);
-					}
-					prevCopiedBB = clonedBB;
-				}
-
-				if (doCopy) {  // if we just cloned a BB:
-
-					////////////////////////      PHI NODE HANDLING      ////////////////////////
-					// 1) Handle repeat defs in originalBB & clonedBB
-					// go to clonedBB/origBB's def-instr's uses' BB, check phi nodes
-					// 1a) no phinode for the def value: add phinode for the def from origBB vs clonedBB
-					// 1b) exist phinode, add clonedBB's def value to it
-
-					// Check VMap
-					ValueToValueMapTy::iterator VMapItr;
-					int idx = 0;
-					BasicBlock::iterator initialBC = clonedBB->begin();
-					Instruction* oFirstNonPhi = originalBB->getFirstNonPHI();
-					for (BasicBlock::iterator BI = originalBB->begin(), BE = originalBB->end(); BI != BE; ++BI) {
-						BasicBlock::iterator BC =  next(initialBC, idx);
-						Instruction* clonedInst = dyn_cast<Instruction>(BC);
-						Instruction* origInst = dyn_cast<Instruction>(BI);
-
-						for (User *U : BI->users()) {
-							if (Instruction* useInstr = dyn_cast<Instruction>(U)) {
-								// Create Phi Node only when not in trace (side exit/trace exit)
-								if (TraceMap[useInstr->getParent()] == TraceMap[originalBB]) {
-									continue;
-								}
-
-								Value* origValue = dyn_cast<Value>(BI);
-								Value* clonedValue = dyn_cast<Value>(clonedInst);
-								// Already exist Phi node
-
-								PHINode *Phi = dyn_cast<PHINode>(U);
-								if (Phi) {
-									Phi->addIncoming(clonedValue, clonedBB);
-								}
-								else {
-									Instruction* firstNonPhi = useInstr->getParent()->getFirstNonPHI();
-									PHINode *Phi = PHINode::Create(clonedInst->getType(), 2, "", firstNonPhi);
-									Phi->addIncoming(origInst, originalBB);
-									Phi->addIncoming(clonedInst, clonedBB);
-								}
-							}
-						}
-						idx++;
-					}
-
-					// 2) Handle exising phi node, remove unecessary operand
-					// Check if incoming BB reachable to original/cloneBB (BFS).
-					// If not, remove
-					for (BasicBlock::iterator BI = originalBB->begin(), BE = originalBB->end(); BI != BE; ++BI) {
-						PHINode *Phi = dyn_cast<PHINode>(&*BI);
-						if (!Phi) {
-							break;
-						}
-
-						// getNumIncomingValues()
-						vector<BasicBlock*> RemList;
-						vector<pair<Value*, BasicBlock*>> AddList;
-						for (unsigned i = 0, e = Phi->getNumIncomingValues(); i != e; ++i) {
-							BasicBlock* incomingBB = Phi->getIncomingBlock(i);
-							Value* incomingInstr = Phi->getIncomingValue(i);
-
-							bool found = false;
-							for (auto succ : successors(incomingBB)) {
-								if (succ == originalBB) {
-									found = true;
-									break;
-								}
-							}
-							if (!found) {
-								RemList.push_back(incomingBB);
-							}
-						}
-						for (auto& remBB: RemList) {
-							if (Phi) {
-								Phi->removeIncomingValue(remBB, false);
-							}
-						}
-
-						if (pred_size(originalBB) > Phi->getNumIncomingValues()) {
-							bool found = false;
-							Value* incomingInstrVal;
-							for (auto opred: predecessors(originalBB)) {
-								for (unsigned i = 0, e = Phi->getNumIncomingValues(); i != e; ++i) {
-									BasicBlock* incomingBB = Phi->getIncomingBlock(i);
-									incomingInstrVal = Phi->getIncomingValue(i);
-									if (incomingBB == opred) {
-										found = true;
-										break;
-									}
-								}
-								if (!found) {
-									// Find phi's incomingBB's VMap corresponds to opred
-									for (unsigned i = 0, e = Phi->getNumIncomingValues(); i != e; ++i) {
-										incomingInstrVal = Phi->getIncomingValue(i);
-										BasicBlock* inBB = Phi->getIncomingBlock(i);
-										Value* cInBBVal = VMap[inBB];
-
-										const Value * cIncomVal = incomingInstrVal;
-										Value* mVal = VMap[cIncomVal];
-										if (Instruction* mInstr = dyn_cast<Instruction>(mVal)) {
-											if (mInstr->getParent() == opred) {
-												pair<Value*, BasicBlock*> tp(mVal, opred);
-												AddList.push_back(tp);
-												break;
-											}
-										} else if (BasicBlock* cInBB = dyn_cast<BasicBlock>(cInBBVal)) {
-											if (cInBB == opred) {
-												pair<Value*, BasicBlock*> tp(mVal, opred);
-												AddList.push_back(tp);
-												break;
-											}
-										}
-									}
-								}
-								found = false;
-							}
-							for (pair<Value*, BasicBlock*> addPair: AddList) {
-								Value* addVal = addPair.first;
-								BasicBlock* addBB = addPair.second;
-								Phi->addIncoming(addVal, addBB);
-							}
-
-						}
-					}
-
-					bool allIncomExpired = true;
-					for (BasicBlock::iterator BI = clonedBB->begin(), BE = clonedBB->end(); BI != BE; ++BI) {
-						PHINode *Phi = dyn_cast<PHINode>(&*BI);
-						allIncomExpired = true;
-						if (!Phi) {
-							break;
-						}
-
-						// vector<BasicBlock*> RemList;
-						vector<pair<Value*, BasicBlock*>> ExpList;
-						for (unsigned i = 0, e = Phi->getNumIncomingValues(); i != e; ++i) {
-							BasicBlock* incomingBB = Phi->getIncomingBlock(i);
-							Value* incomingInstr = Phi->getIncomingValue(i);
-
-							bool found = false;
-							for (auto succ : successors(incomingBB)) {
-								if (succ == clonedBB) {
-									found = true;
-									allIncomExpired = false;
-									break;
-								}
-							}
-							if (!found) {
-								pair<Value*, BasicBlock*> p1(incomingInstr, incomingBB);
-								ExpList.push_back(p1);
-							}
-						}
-
-						// Remove invalid incoming values, before removing, first check if need to add new def
-						for (pair<Value*, BasicBlock*> expPair: ExpList) {
-
-							if (Instruction* expInstr = dyn_cast<Instruction>(expPair.first)) {
-								BasicBlock* remBB = expPair.second;
-								if (allIncomExpired && (TraceMap[remBB] == TraceMap[originalBB])) {
-									// if old incomingBB inside trace, find corresponding value from newly clonedBB
-									// to substitute in PHI node.
-									const Value * tVal = expPair.first;
-									Value* cVal = VMap[tVal];
-								}
-
-								Phi->removeIncomingValue(remBB, false);
-							} else {
-								// while.cond 29
-								BasicBlock* remBB = expPair.second;
-								Phi->removeIncomingValue(remBB, false);
-							}
-
-						}
-
-					}
-				}
-			}
+			modified |= SuperBlock::tailDuplicateTrace(curTrace, TraceOf, &DTU, &LI);
 		}
-
 		return modified;
 	}
 
 }; // end of struct Hell
 }  // end of anonymous namespace
 
+namespace {
+// new pass manager wrapper around the legacy pass
+struct heuristic_sb_npm : PassInfoMixin<heuristic_sb_npm> {
+	PreservedAnalyses run(Function &F, FunctionAnalysisManager &FAM) {
+		heuristic_sb P;
+		bool Changed = P.runImpl(F,
+			FAM.getResult<LoopAnalysis>(F),
+			FAM.getResult<PostDominatorTreeAnalysis>(F),
+			FAM.getResult<DominatorTreeAnalysis>(F),
+			FAM.getResult<BranchProbabilityAnalysis>(F),
+			FAM.getResult<BlockFrequencyAnalysis>(F),
+			FAM.getResult<TargetIRAnalysis>(F));
+		if (!Changed) {
+			return PreservedAnalyses::all();
+		}
+		PreservedAnalyses PA;
+		PA.preserve<DominatorTreeAnalysis>();
+		PA.preserve<PostDominatorTreeAnalysis>();
+		PA.preserve<LoopAnalysis>();
+		return PA;
+	}
+};
+}  // end of anonymous namespace
+
+void SuperBlock::registerHeuristicSBPasses(PassBuilder &PB) {
+	PB.registerPipelineParsingCallback(
+		[](StringRef Name, FunctionPassManager &FPM, ArrayRef<PassBuilder::PipelineElement>) {
+			if (Name == "heuristic_sb") {
+				FPM.addPass(heuristic_sb_npm());
+				return true;
+			}
+			return false;
+		});
+}
+
 char heuristic_sb::ID = 0;
 static RegisterPass<heuristic_sb> X("heuristic_sb", "heuristic super block formation",
                              	false /* Only looks at CFG */,
@@ -1,26 +1,23 @@
 PATH2LIB=~/Proj/Superblock/build/Superblock/LLVMSB.so        # Specify your build directory in the project
 PASS=-psbpass                  # Choose either -fplicm-correctness or -fplicm-performance
+PATH2RT=~/Proj/Superblock/Superblock/SB_PATHPROF_RT.c           # Path profile runtime, for PATHPROF=1
 
 # Delete outputs from previous run.
-rm -f default.profraw ${1}_prof ${1}_psb ${1}_rsb ${1}_no_sb *.bc ${1}.profdata *_output *.ll
+rm -f default.profraw ${1}.pathprof ${1}_pathprof ${1}_prof ${1}_psb ${1}_rsb ${1}_no_sb *.bc ${1}.profdata *_output *.ll
 
-# Convert source code to bitcode (IR)
-clang -emit-llvm -c ${1}.c -o ${1}.bc
+# Convert source code to bitcode (IR). Without -disable-O0-optnone every
+# function is optnone and opt skips mem2reg and the superblock passes.
+clang -Xclang -disable-O0-optnone -emit-llvm -c ${1}.c -o ${1}.bc
 # clang -emit-llvm -c ${1}.c -o ${1}.ls.bc
 
-# Proj: Mem2reg
-opt -mem2reg ${1}.bc -o ${1}.mr.bc
+# Proj: Mem2reg, then canonicalize natural loops
+opt -passes='mem2reg,loop-simplify' ${1}.bc -o ${1}.ls.bc
 
-# Canonicalize natural loops
-opt -loop-simplify ${1}.mr.bc -o ${1}.ls.bc
-
-# Proj: Add LICM 
-opt -licm ${1}.ls.bc -o ${1}.licm.bc
-# Proj: Add Dead Code Elimination
-opt -dce ${1}.licm.bc -o ${1}.dce.bc
+# Proj: Add LICM and Dead Code Elimination
+opt -passes='function(loop-mssa(licm),dce)' ${1}.ls.bc -o ${1}.dce.bc
 
 # Instrument profiler
-opt -pgo-instr-gen -instrprof ${1}.ls.bc -o ${1}.ls.prof.bc
+opt -passes='pgo-instr-gen,instrprof' ${1}.ls.bc -o ${1}.ls.prof.bc
 # Generate binary executable with profiler embedded
 clang -fprofile-instr-generate ${1}.ls.prof.bc -o ${1}_prof
 
@@ -28,16 +25,41 @@ clang -fprofile-instr-generate ${1}.ls.prof.bc -o ${1}_prof
 ./${1}_prof > correct_output
 llvm-profdata merge -o ${1}.profdata default.profraw
 
-# Apply Superblock
-opt -o ${1}.psb.bc -pgo-instr-use -pgo-test-profile-file=${1}.profdata -load ${PATH2LIB} -psbpass < ${1}.ls.bc > /dev/null
-opt -o ${1}.rsb.bc -pgo-instr-use -pgo-test-profile-file=${1}.profdata -load ${PATH2LIB} -rsbpass < ${1}.ls.bc > /dev/null
+# With PATHPROF=1, also take a Ball-Larus path profile and let -psbpass follow
+# its hottest paths (-sb-selector=paths)
+PSBSEL=""
+if [ "${PATHPROF}" = "1" ]; then
+    opt -load-pass-plugin=${PATH2LIB} -passes=pathprof-gen ${1}.ls.bc -o ${1}.pp.bc
+    clang ${1}.pp.bc ${PATH2RT} -o ${1}_pathprof
+    SB_PATHPROF_FILE=${1}.pathprof ./${1}_pathprof > /dev/null
+    PSBSEL="-load ${PATH2LIB} -sb-selector=paths -sb-path-profile=${1}.pathprof"
+fi
+
+# With INLINE=1, inline hot small callees before -psbpass forms traces
+# (sb-inline, see SB_INLINE.h); callers that change lose their path profile
+PSBPRE=""
+if [ "${INLINE}" = "1" ]; then
+    PSBPRE="sb-inline,globaldce,"
+fi
+
+# With SWPEEL=1, peel the hottest switch cases into branches first
+# (sb-switch-peel, see SB_SWITCH.h)
+PSBFN=""
+if [ "${SWPEEL}" = "1" ]; then
+    PSBFN="function(sb-switch-peel),"
+fi
 
-# Proj: Add LICM 
-opt -licm ${1}.psb.bc -o ${1}.psbl.bc
-opt -licm ${1}.rsb.bc -o ${1}.rsbl.bc
-# Proj: Add Dead Code Elimination
-opt -dce ${1}.psbl.bc -o ${1}.psbo.bc
-opt -dce ${1}.rsbl.bc -o ${1}.rsbo.bc
+# Apply Superblock (LLVMSB.so is a -load-pass-plugin), alone and followed by LICM + DCE.
+# psbpass/rsbpass run at module level so tail duplication gets the module's
+# code growth budget (see SB_BUDGET.h); sb-hot-cold-split then outlines the
+# cold code psbpass leaves around its superblocks, keeping its traces whole
+# (-sb-split-traces, see SB_SPLIT.h)
+PGOUSE="-pgo-test-profile-file=${1}.profdata -load-pass-plugin=${PATH2LIB}"
+PSBSPLIT="-load ${PATH2LIB} -sb-split-traces"
+opt ${PGOUSE} ${PSBSPLIT} ${PSBSEL} -passes="pgo-instr-use,${PSBPRE}${PSBFN}psbpass,sb-hot-cold-split" ${1}.ls.bc -o ${1}.psb.bc
+opt ${PGOUSE} -passes='pgo-instr-use,rsbpass' ${1}.ls.bc -o ${1}.rsb.bc
+opt ${PGOUSE} ${PSBSPLIT} ${PSBSEL} -passes="pgo-instr-use,${PSBPRE}${PSBFN}psbpass,sb-hot-cold-split,function(loop-mssa(licm),dce)" ${1}.ls.bc -o ${1}.psbo.bc
+opt ${PGOUSE} -passes='pgo-instr-use,rsbpass,function(loop-mssa(licm),dce)' ${1}.ls.bc -o ${1}.rsbo.bc
 
 # Generate binary excutable before SuperBlock formation: Unoptimzied code
 clang ${1}.dce.bc -o ${1}_no_sbo
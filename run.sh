@@ -1,5 +1,5 @@
 PATH2LIB=~/Proj/Superblock/build/Profile_Superblock/LLVMPSB.so        # Specify your build directory in the project
-PASS=-fplicm-correctness                   # Choose either -fplicm-correctness or -fplicm-performance
+PASS=psbpass                               # Choose either psbpass or fplicm-performance
 
 # Delete outputs from previous run.
 rm -f default.profraw ${1}_prof ${1}_fplicm ${1}_no_fplicm *.bc ${1}.profdata *_output *.ll
@@ -7,9 +7,9 @@ rm -f default.profraw ${1}_prof ${1}_fplicm ${1}_no_fplicm *.bc ${1}.profdata *_
 # Convert source code to bitcode (IR)
 clang -emit-llvm -c ${1}.c -o ${1}.bc
 # Canonicalize natural loops
-opt -loop-simplify ${1}.bc -o ${1}.ls.bc
+opt -passes=loop-simplify ${1}.bc -o ${1}.ls.bc
 # Instrument profiler
-opt -pgo-instr-gen -instrprof ${1}.ls.bc -o ${1}.ls.prof.bc
+opt -passes='pgo-instr-gen,instrprof' ${1}.ls.bc -o ${1}.ls.prof.bc
 # Generate binary executable with profiler embedded
 clang -fprofile-instr-generate ${1}.ls.prof.bc -o ${1}_prof
 
@@ -18,8 +18,7 @@ clang -fprofile-instr-generate ${1}.ls.prof.bc -o ${1}_prof
 llvm-profdata merge -o ${1}.profdata default.profraw
 
 # Apply FPLICM
-# opt -o ${1}.fplicm.bc -pgo-instr-use -pgo-test-profile-file=${1}.profdata -load ${PATH2LIB} ${PASS} < ${1}.ls.bc > /dev/null
-opt -o ${1}.fplicm.bc -pgo-instr-use -pgo-test-profile-file=${1}.profdata -load ${PATH2LIB} -psbpass < ${1}.ls.bc > /dev/null
+opt -pgo-test-profile-file=${1}.profdata -load-pass-plugin=${PATH2LIB} -passes="pgo-instr-use,function(${PASS})" ${1}.ls.bc -o ${1}.fplicm.bc
 
 # Generate binary excutable before FPLICM: Unoptimzied code
 clang ${1}.ls.bc -o ${1}_no_fplicm
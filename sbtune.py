@@ -0,0 +1,181 @@
+#!/usr/bin/env python3
+"""Offline autotuner for the superblock passes.
+
+Searches the pass parameters for one benchmark and input: the selection
+algorithm (tsbpass, or psbpass with each -sb-selector), the trace growth
+threshold, the trace length cap and the tail duplication budget (for
+tsbpass, its treegion threshold and duplication limit). Builds the same way
+prun.sh does, profiling once; the variants are built in parallel, checked
+against the unoptimized output, then timed one after the other, round robin,
+and ranked by median time.
+
+The best configuration is written as name=value lines that the pass loads:
+
+    ./sbtune.py wc -i 'input1/cccp.c' -j 8
+    opt -load LLVMSB.so -load-pass-plugin=LLVMSB.so -sb-config=wc.sbconfig \\
+        -passes='pgo-instr-use,psbpass' ...
+
+(the 'pass' line names the pass to put in -passes=). Everything runs locally;
+only clang, opt, llvm-profdata and the benchmark itself are invoked.
+"""
+import argparse
+import concurrent.futures
+import itertools
+import os
+import random
+import shlex
+import statistics
+import subprocess
+import sys
+import time
+
+# Values tried per pass. 0 keeps the pass's own choice (the adaptive
+# threshold, no trace length cap).
+SPACE = {
+    'psbpass': {
+        'sb-selector': ['greedy', 'mml', 'pettis-hansen', 'exttsp'],
+        'sb-threshold': [0, 50, 55, 60, 65, 70, 80, 90],
+        'sb-max-trace-length': [0, 4, 8, 16, 32],
+        'sb-dup-growth': [0, 5, 10, 20, 50],
+    },
+    'tsbpass': {
+        'sb-treegion-threshold': [10, 20, 30, 40],
+        'sb-treegion-max-dup': [16, 64, 256],
+    },
+}
+DEFAULTS = {'sb-selector': 'greedy', 'sb-threshold': 0, 'sb-max-trace-length': 0, 'sb-dup-growth': 10,
+            'sb-treegion-threshold': 20, 'sb-treegion-max-dup': 64}
+
+
+def run(cmd, **kwargs):
+    return subprocess.run(cmd, check=True, stdout=subprocess.PIPE,
+                          stderr=subprocess.PIPE, **kwargs)
+
+
+class Bench:
+    def __init__(self, args):
+        self.args = args
+        self.name = os.path.basename(args.bench)
+        self.src = os.path.abspath(args.bench + '.c')
+        self.lib = os.path.abspath(os.path.expanduser(args.lib))
+        self.input = shlex.split(args.input)
+        self.dir = os.path.abspath(args.workdir or 'sbtune.' + self.name)
+        os.makedirs(self.dir, exist_ok=True)
+
+    def path(self, name):
+        return os.path.join(self.dir, name)
+
+    def execute(self, exe, env=None):
+        return subprocess.run([exe] + self.input, stdout=subprocess.PIPE,
+                              stderr=subprocess.DEVNULL, cwd=os.getcwd(),
+                              env=env, timeout=self.args.timeout).stdout
+
+    # Same steps as prun.sh up to the profile.
+    def prepare(self):
+        bc, ls, prof = self.path('b.bc'), self.path('ls.bc'), self.path('prof.bc')
+        run(['clang', '-Xclang', '-disable-O0-optnone', '-emit-llvm', '-c', self.src, '-o', bc])
+        run(['opt', '-passes=mem2reg,loop-simplify', bc, '-o', ls])
+        run(['opt', '-passes=pgo-instr-gen,instrprof', ls, '-o', prof])
+        run(['clang', '-fprofile-instr-generate', prof, '-o', self.path('prof')])
+        raw = self.path('default.profraw')
+        env = dict(os.environ, LLVM_PROFILE_FILE=raw)
+        self.reference = self.execute(self.path('prof'), env)
+        run(['llvm-profdata', 'merge', '-o', self.path('profdata'), raw])
+        run(['clang', ls, '-o', self.path('no_sb')])
+
+    def build(self, n, config):
+        opts = ['-%s=%s' % (k, v) for k, v in config.items() if k != 'pass']
+        bc, exe = self.path('v%d.bc' % n), self.path('v%d' % n)
+        run(['opt', '-load', self.lib, '-load-pass-plugin=' + self.lib,
+             '-pgo-test-profile-file=' + self.path('profdata')] + opts +
+            ['-passes=pgo-instr-use,%s' % config['pass'],
+             self.path('ls.bc'), '-o', bc])
+        run(['clang', bc, '-o', exe])
+        return exe
+
+
+def candidates(args):
+    # Each pass with its defaults first, then a random sample of the rest.
+    rng = random.Random(args.seed)
+    defaults, rest = [], []
+    for p, space in SPACE.items():
+        if args.passes and p not in args.passes:
+            continue
+        names = sorted(space)
+        for values in itertools.product(*(space[k] for k in names)):
+            config = dict(zip(names, values), **{'pass': p})
+            if all(config[k] == DEFAULTS[k] for k in names):
+                defaults.append(config)
+            else:
+                rest.append(config)
+    rng.shuffle(rest)
+    return defaults + rest[:max(args.trials - len(defaults), 0)]
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    ap.add_argument('bench', help='benchmark source without .c, as for prun.sh')
+    ap.add_argument('-i', '--input', default='', help='arguments to run the benchmark with')
+    ap.add_argument('--lib', default='~/Proj/Superblock/build/Superblock/LLVMSB.so')
+    ap.add_argument('-j', '--jobs', type=int, default=os.cpu_count())
+    ap.add_argument('-n', '--trials', type=int, default=24, help='configurations to try')
+    ap.add_argument('-r', '--reps', type=int, default=5, help='timed runs per configuration')
+    ap.add_argument('-p', '--passes', nargs='*', choices=sorted(SPACE), help='selection algorithms to try')
+    ap.add_argument('-o', '--output', help='configuration file (default BENCH.sbconfig)')
+    ap.add_argument('--workdir', help='build directory (default sbtune.BENCH)')
+    ap.add_argument('--timeout', type=float, default=600)
+    ap.add_argument('--seed', type=int, default=0)
+    args = ap.parse_args()
+
+    bench = Bench(args)
+    bench.prepare()
+    configs = candidates(args)
+
+    # Build in parallel; a variant that fails to build or prints something
+    # else is dropped.
+    exes = {}
+    with concurrent.futures.ThreadPoolExecutor(args.jobs) as pool:
+        futures = {pool.submit(bench.build, n, c): n for n, c in enumerate(configs)}
+        for f in concurrent.futures.as_completed(futures):
+            n = futures[f]
+            try:
+                exes[n] = f.result()
+            except subprocess.CalledProcessError as e:
+                print('build failed: %s\n%s' % (configs[n], e.stderr.decode()[-500:]), file=sys.stderr)
+    for n in sorted(exes):
+        if bench.execute(exes[n]) != bench.reference:
+            print('wrong output: %s' % configs[n], file=sys.stderr)
+            del exes[n]
+    if not exes:
+        sys.exit('sbtune: no configuration built and ran correctly')
+
+    # Time serially so the variants do not compete for the machine.
+    exes[-1] = bench.path('no_sb')
+    times = {n: [] for n in exes}
+    for _ in range(args.reps):
+        for n, exe in exes.items():
+            start = time.perf_counter()
+            bench.execute(exe)
+            times[n].append(time.perf_counter() - start)
+    median = {n: statistics.median(t) for n, t in times.items()}
+    baseline = median.pop(-1)
+
+    ranked = sorted(median, key=median.get)
+    for n in ranked:
+        print('%8.4f s  %s' % (median[n], ' '.join('%s=%s' % kv for kv in sorted(configs[n].items()))))
+    print('%8.4f s  without superblocks' % baseline)
+
+    best = configs[ranked[0]]
+    output = args.output or bench.name + '.sbconfig'
+    with open(output, 'w') as f:
+        f.write('# sbtune.py %s: %.4f s, median of %d (%.4f s without superblocks)\n' %
+                (' '.join([bench.name] + bench.input), median[ranked[0]], args.reps, baseline))
+        f.write('pass=%s\n' % best['pass'])
+        for k in sorted(best):
+            if k != 'pass':
+                f.write('%s=%s\n' % (k, best[k]))
+    print('wrote', output)
+
+
+if __name__ == '__main__':
+    main()